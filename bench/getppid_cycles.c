@@ -0,0 +1,128 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * getppid_cycles.c -- measures the number of CPU cycles spent on a getppid
+ * syscall intercepted by libsyscall_intercept.
+ *
+ * The getppid function in libc contains a syscall instruction used only for
+ * the getppid syscall, thus it is patched using a wrapper specialised to
+ * that syscall number. To compare this with the generic wrappers, run
+ * the program with the INTERCEPT_GENERIC_WRAPPERS environment variable set:
+ *
+ * $ ./getppid_cycles
+ * $ INTERCEPT_GENERIC_WRAPPERS=1 ./getppid_cycles
+ *
+ * The cost of the same syscall without any interception is also measured,
+ * using syscall_no_intercept.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+
+#define ITERATIONS 100000
+#define ROUNDS 10
+
+static int
+hook(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) syscall_number;
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+	(void) result;
+
+	return 1; /* forward every syscall to the kernel */
+}
+
+static void
+call_getppid(void)
+{
+	(void) getppid();
+}
+
+static void
+call_getppid_no_intercept(void)
+{
+	(void) syscall_no_intercept(SYS_getppid);
+}
+
+/*
+ * measure -- returns the smallest average number of cycles per call
+ * observed in a few rounds.
+ */
+static uint64_t
+measure(void (*func)(void))
+{
+	uint64_t best = UINT64_MAX;
+
+	for (int round = 0; round < ROUNDS; ++round) {
+		uint64_t start = __builtin_ia32_rdtsc();
+
+		for (int i = 0; i < ITERATIONS; ++i)
+			func();
+
+		uint64_t cycles =
+		    (__builtin_ia32_rdtsc() - start) / ITERATIONS;
+
+		if (cycles < best)
+			best = cycles;
+	}
+
+	return best;
+}
+
+int
+main()
+{
+	intercept_hook_point = hook;
+
+	printf("getppid not intercepted: %lu cycles\n",
+	    (unsigned long)measure(call_getppid_no_intercept));
+	printf("getppid intercepted (%s wrappers): %lu cycles\n",
+	    getenv("INTERCEPT_GENERIC_WRAPPERS") ? "generic" : "specialised",
+	    (unsigned long)measure(call_getppid));
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * startup_time.c -- measures the time it takes to start a process using
+ * libsyscall_intercept, most of which is spent on finding the syscall
+ * instructions in libc.
+ *
+ * The program starts itself repeatedly, and waits for the new process to
+ * exit. This is done once with hotpatching disabled using the
+ * INTERCEPT_HOOK_CMDLINE_FILTER environment variable, and with it
+ * enabled, the difference is the time spent on hotpatching. Hotpatching
+ * is measured both with a single thread ( INTERCEPT_WORKERS=1 ), and with
+ * the default number of threads, unless INTERCEPT_WORKERS is set. The
+ * environment variables controlling the way syscalls are found are passed
+ * on to the new processes, e.g.:
+ *
+ * $ ./startup_time
+ * $ INTERCEPT_SCAN_WINDOWS=1 ./startup_time
+ * $ INTERCEPT_ALL_OBJS=1 INTERCEPT_WORKERS=4 ./startup_time
+ */
+
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+
+#define RUNS 50
+
+extern char **environ;
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+/*
+ * measure -- returns the average time in milliseconds it takes to start
+ * a new process, and wait for it to exit.
+ */
+static double
+measure(const char *path, int hotpatching)
+{
+	char *child_argv[] = {(char *)path, "child",
+				hotpatching ? "1" : "0", NULL};
+	double start = now();
+
+	for (int i = 0; i < RUNS; ++i) {
+		pid_t pid;
+		int status;
+
+		if (posix_spawn(&pid, path, NULL, NULL,
+		    child_argv, environ) != 0) {
+			perror("posix_spawn");
+			exit(EXIT_FAILURE);
+		}
+
+		if (waitpid(pid, &status, 0) != pid ||
+		    !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			fputs("child failed\n", stderr);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return (now() - start) / RUNS;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc > 2 && strcmp(argv[1], "child") == 0) {
+		/* check if the parent set up INTERCEPT_HOOK_CMDLINE_FILTER */
+		if (syscall_hook_in_process_allowed() != atoi(argv[2]))
+			return EXIT_FAILURE;
+
+		return EXIT_SUCCESS;
+	}
+
+	const char *mode =
+	    getenv("INTERCEPT_SCAN_WINDOWS") ? "windows" : "whole text";
+
+	setenv("INTERCEPT_HOOK_CMDLINE_FILTER", "-", 1);
+	double without = measure(argv[0], 0);
+
+	unsetenv("INTERCEPT_HOOK_CMDLINE_FILTER");
+	const char *workers = getenv("INTERCEPT_WORKERS");
+	double with_workers = measure(argv[0], 1);
+
+	setenv("INTERCEPT_WORKERS", "1", 1);
+	double with = measure(argv[0], 1);
+
+	printf("startup without hotpatching: %.3f ms\n", without);
+	printf("startup with hotpatching (%s): %.3f ms\n", mode, with);
+	printf("time spent on hotpatching: %.3f ms\n", with - without);
+	printf("time spent on hotpatching with %s workers: %.3f ms\n",
+	    workers ? workers : "the default number of",
+	    with_workers - without);
+
+	return EXIT_SUCCESS;
+}
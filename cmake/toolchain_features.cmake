@@ -68,6 +68,7 @@ check_c_compiler_flag(-Wno-unused-command-line-argument HAS_NOUNUSEDARG)
 check_c_compiler_flag(-pie HAS_ARG_PIE)
 check_c_compiler_flag(-nopie HAS_ARG_NOPIE)
 check_c_compiler_flag(-no-pie HAS_ARG_NO_PIE)
+check_c_compiler_flag(-mgeneral-regs-only HAS_GENERAL_REGS_ONLY)
 
 if(HAS_WERROR AND TREAT_WARNINGS_AS_ERRORS)
 	set(CMAKE_C_FLAGS "${CMAKE_C_FLAGS} -Werror")
@@ -57,9 +57,124 @@ extern int (*intercept_hook_point)(long syscall_number,
 			long arg4, long arg5,
 			long *result);
 
+/*
+ * intercept_hook_point_desc - an alternative to intercept_hook_point, able
+ * to change the syscall before it is executed. The syscall number, and the
+ * six args are passed in a struct, which the hook function can modify.
+ * The hook function can return:
+ *
+ * INTERCEPT_HOOK_HANDLED -- the syscall is not executed, the value stored
+ *  to *result is returned to libc
+ * INTERCEPT_HOOK_FORWARD -- the original syscall is executed, any changes
+ *  made to *desc are ignored
+ * INTERCEPT_HOOK_FORWARD_MODIFIED -- the syscall described by *desc
+ *  is executed, e.g.: an open syscall with a different path, or different
+ *  flags
+ *
+ * It is called before intercept_hook_point, for the syscalls selected
+ * using intercept_set_syscall_filter. If it returns INTERCEPT_HOOK_HANDLED,
+ * or INTERCEPT_HOOK_FORWARD_MODIFIED, intercept_hook_point is not called.
+ *
+ * The syscall number can not be changed to, or from any of: clone, clone3,
+ * vfork, rt_sigreturn. A clone syscall creating a new thread is executed
+ * in its original context ( see intercept_hook_point_clone_child ), with
+ * the modified arguments loaded into the corresponding registers -- these
+ * registers keep the modified values after the syscall returns.
+ */
+struct intercept_syscall_desc {
+	int nr;
+	long args[6];
+};
+
+#define INTERCEPT_HOOK_HANDLED 0
+#define INTERCEPT_HOOK_FORWARD 1
+#define INTERCEPT_HOOK_FORWARD_MODIFIED 2
+
+extern int (*intercept_hook_point_desc)(struct intercept_syscall_desc *desc,
+			long *result);
+
+/*
+ * intercept_hook_point_context - an alternative to intercept_hook_point,
+ * receiving some information about the context of the syscall, e.g. for
+ * profiling, or stack unwinding. It is called first among the hooks of
+ * syscalls selected using intercept_set_syscall_filter, the return value
+ * has the same meaning as that of intercept_hook_point.
+ *
+ * The struct intercept_context is only valid during the call. New fields
+ * are only ever appended to it, the size field contains the size of the
+ * struct as known by libsyscall_intercept -- fields beyond that size must
+ * not be accessed. See "The context visible to hooks" in asm_wrapper.md.
+ *
+ * size -- sizeof(struct intercept_context) in the library
+ * syscall -- the syscall number, and arguments
+ * site -- identifies the patched syscall instruction, the same pointer is
+ *  passed for each syscall issued via the same instruction
+ * rip -- the address of the original syscall instruction, i.e. the address
+ *  of the patched code
+ * object_path -- the path of the object containing the syscall instruction
+ * object_offset -- the offset of the syscall instruction in that object
+ * rsp, rbp, rbx, r12 - r15 -- the stack pointer, and the callee-saved
+ *  registers, as they were at the syscall instruction
+ */
+struct intercept_context {
+	unsigned long size;
+	struct intercept_syscall_desc syscall;
+	const void *site;
+	const void *rip;
+	const char *object_path;
+	unsigned long object_offset;
+	long rsp;
+	long rbp;
+	long rbx;
+	long r12;
+	long r13;
+	long r14;
+	long r15;
+};
+
+extern int (*intercept_hook_point_context)(
+			const struct intercept_context *context,
+			long *result);
+
 extern void (*intercept_hook_point_clone_child)(void);
 extern void (*intercept_hook_point_clone_parent)(long pid);
 
+/*
+ * intercept_hook_point_exit - called after libsyscall_intercept executed
+ * a syscall, i.e. when intercept_hook_point returned non-zero, or was not
+ * called at all -- for syscalls selected using intercept_set_syscall_filter.
+ * The *result argument contains the value returned by the kernel, and can
+ * be changed by the hook, before it is returned to libc. This allows hooks
+ * only interested in observing syscalls to let libsyscall_intercept
+ * execute them.
+ * It is not called for syscalls that do not return normally, i.e.
+ * rt_sigreturn, vfork. After a clone syscall creating a new thread, it is
+ * called in both threads, if the syscall instruction used is dedicated to
+ * that syscall ( this is the case with the clone functions in libc ).
+ */
+extern void (*intercept_hook_point_exit)(long syscall_number,
+			long arg0, long arg1,
+			long arg2, long arg3,
+			long arg4, long arg5,
+			long *result);
+
+/*
+ * intercept_hook_general_regs_only - a hook library compiled with the
+ * -mgeneral-regs-only compiler flag can define this variable with a
+ * non-zero value:
+ *
+ * const int intercept_hook_general_regs_only = 1;
+ *
+ * This declares that the hook functions never touch any SIMD registers,
+ * not even by calling into other libraries ( e.g. memcpy in libc ). In that
+ * case, libsyscall_intercept does not save and restore the SIMD registers
+ * around calling the hook functions. This applies to all hook functions in
+ * the process, not just the ones in the library defining this variable.
+ * The variable is examined only once, while libsyscall_intercept is
+ * initialized, before any other library constructors are called.
+ */
+extern const int intercept_hook_general_regs_only;
+
 /*
  * syscall_no_intercept - syscall without interception
  *
@@ -95,6 +210,114 @@ syscall_error_code(long result)
  */
 int syscall_hook_in_process_allowed(void);
 
+/*
+ * intercept_set_syscall_filter - select the syscalls to be forwarded to
+ * intercept_hook_point.
+ * By default, every syscall is forwarded to the hook. Once a set of syscall
+ * numbers is specified using this function, any other syscall is executed
+ * directly by the patched code, without saving registers, or calling into
+ * the library at all. This can save a considerable amount of time per
+ * syscall, when the hook is only interested in a few syscalls.
+ * Passing NULL as syscall_numbers restores the default.
+ * Only syscall numbers below 512 can be filtered, syscalls with larger
+ * numbers are always forwarded to the hook.
+ *
+ * Returns zero on success, and -1 if any of the numbers can not be filtered,
+ * in which case the set of selected syscalls is left unchanged.
+ */
+int intercept_set_syscall_filter(const long *syscall_numbers, unsigned count);
+
+/*
+ * intercept_register_hook - register a hook function for a single syscall.
+ * Any number of hook functions can be registered for the same syscall,
+ * e.g. by multiple libraries loaded into the same process. These are called
+ * in the order of decreasing priority, hooks with equal priorities are
+ * called in the order of registration.
+ * The hook functions have the same semantics as intercept_hook_point:
+ * a zero return value means the syscall is handled, and no other hook is
+ * called for it -- a non-zero return value passes the syscall on to the
+ * next hook. The legacy intercept_hook_point is called last, as a catch-all
+ * hook for any syscall selected using intercept_set_syscall_filter.
+ *
+ * Syscalls with a hook registered are always forwarded to the hook, even
+ * if they are not selected using intercept_set_syscall_filter. A library
+ * using only this interface can call intercept_set_syscall_filter with an
+ * empty set, so every other syscall is executed without calling into
+ * libsyscall_intercept. The exception is the initial set specified using
+ * the INTERCEPT_SYSCALL_FILTER environment variable: the syscall
+ * instructions used only for syscalls not in that set are not patched, so
+ * a hook registered for such a syscall is only called from the rest of the
+ * syscall instructions, e.g. the one in syscall(2). Such a registration is
+ * noted in the log ( see INTERCEPT_LOG ).
+ * Only syscall numbers below 512 are supported.
+ *
+ * Returns zero on success, and -1 if the syscall number is not supported,
+ * or hook is NULL.
+ */
+typedef int (*intercept_hook_fn)(long syscall_number,
+			long arg0, long arg1,
+			long arg2, long arg3,
+			long arg4, long arg5,
+			long *result);
+
+int intercept_register_hook(long syscall_number, intercept_hook_fn hook,
+				int priority);
+
+/*
+ * intercept_unregister_hook - remove a hook function registered using
+ * intercept_register_hook. Returns zero on success, and -1 if the hook is
+ * not registered for the syscall number.
+ */
+int intercept_unregister_hook(long syscall_number, intercept_hook_fn hook);
+
+/*
+ * intercept_register_exit_hook, intercept_unregister_exit_hook - the same
+ * as intercept_register_hook, and intercept_unregister_hook, for exit hooks.
+ * The exit hooks registered for a syscall are all called, in the order of
+ * decreasing priority, after the syscall is executed, followed by
+ * intercept_hook_point_exit ( see above ). Each of them can change the
+ * result of the syscall.
+ */
+typedef void (*intercept_exit_hook_fn)(long syscall_number,
+			long arg0, long arg1,
+			long arg2, long arg3,
+			long arg4, long arg5,
+			long *result);
+
+int intercept_register_exit_hook(long syscall_number,
+				intercept_exit_hook_fn hook, int priority);
+
+int intercept_unregister_exit_hook(long syscall_number,
+				intercept_exit_hook_fn hook);
+
+/*
+ * intercept_deactivate - restore the original code of the patched syscalls,
+ * so they are executed directly, without any overhead added by
+ * libsyscall_intercept. The hooks are not called for the syscalls issued
+ * from then on, until intercept_activate is called. The wrappers of the
+ * syscalls are kept, and threads executing them continue normally.
+ *
+ * intercept_activate - write the patches again, after intercept_deactivate.
+ * In lazy mode ( see the INTERCEPT_LAZY environment variable ), nothing is
+ * patched at startup -- the libraries are patched when this is first
+ * called, or when the first hook is registered using
+ * intercept_register_hook, or intercept_register_exit_hook.
+ *
+ * Both can be called at any time, from any thread, even from a hook
+ * function -- the code is overwritten in a way that is safe while other
+ * threads are executing it. The syscall instructions patched at startup,
+ * whose patches can not be written that way, are not patched again by
+ * intercept_activate. The libraries loaded after startup are handled
+ * according to INTERCEPT_DLOPEN_OBJS -- in that case, the syscalls of the
+ * dynamic loader stay patched while the rest is deactivated, but are not
+ * forwarded to the hooks.
+ *
+ * Both return zero on success, and -1 if syscalls are not intercepted in
+ * this process ( see syscall_hook_in_process_allowed ).
+ */
+int intercept_deactivate(void);
+int intercept_activate(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -47,6 +47,19 @@ int (*intercept_hook_point)(long syscall_number,
 			long arg4, long arg5,
 			long *result);
 
+int (*intercept_hook_point_context)(
+			const struct intercept_context *context,
+			long *result);
+
+int (*intercept_hook_point_desc)(struct intercept_syscall_desc *desc,
+			long *result);
+
+void (*intercept_hook_point_exit)(long syscall_number,
+			long arg0, long arg1,
+			long arg2, long arg3,
+			long arg4, long arg5,
+			long *result);
+
 long
 syscall_no_intercept(long syscall_number, ...)
 {
@@ -59,3 +72,48 @@ syscall_hook_in_process_allowed(void)
 {
 	return 0;
 }
+
+int
+intercept_set_syscall_filter(const long *syscall_numbers, unsigned count)
+{
+	(void) syscall_numbers;
+	(void) count;
+	return 0;
+}
+
+int
+intercept_register_hook(long syscall_number, intercept_hook_fn hook,
+				int priority)
+{
+	(void) syscall_number;
+	(void) hook;
+	(void) priority;
+	return 0;
+}
+
+int
+intercept_unregister_hook(long syscall_number, intercept_hook_fn hook)
+{
+	(void) syscall_number;
+	(void) hook;
+	return 0;
+}
+
+int
+intercept_register_exit_hook(long syscall_number, intercept_exit_hook_fn hook,
+				int priority)
+{
+	(void) syscall_number;
+	(void) hook;
+	(void) priority;
+	return 0;
+}
+
+int
+intercept_unregister_exit_hook(long syscall_number,
+				intercept_exit_hook_fn hook)
+{
+	(void) syscall_number;
+	(void) hook;
+	return 0;
+}
@@ -37,6 +37,14 @@
 int main()
 {
 	intercept_hook_point = nullptr;
+	intercept_hook_point_exit = nullptr;
+	intercept_hook_point_desc = nullptr;
+	intercept_hook_point_context = nullptr;
 	(void) syscall_no_intercept(0);
 	(void) syscall_hook_in_process_allowed();
+	(void) intercept_set_syscall_filter(nullptr, 0);
+	(void) intercept_register_hook(0, nullptr, 0);
+	(void) intercept_unregister_hook(0, nullptr);
+	(void) intercept_register_exit_hook(0, nullptr, 0);
+	(void) intercept_unregister_exit_hook(0, nullptr);
 }
@@ -0,0 +1,860 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * disasm_builtin.c -- a small table driven x86-64 instruction decoder,
+ * implementing the interface described in disasm_wrapper.h without
+ * depending on any external disassembler library.
+ *
+ * The decoder only computes what syscall_intercept needs: the length of
+ * each instruction, and a rough classification of it ( syscall, nop,
+ * jumps, calls, rets, RIP relative operands ). It does not know the
+ * names of most instructions, and does not validate the operands
+ * the way a real disassembler would. Any byte sequence that can not
+ * be decoded is reported as an instruction with zero length.
+ *
+ * The decoder follows the conventions of the capstone based wrapper
+ * in disasm_wrapper.c, so the rest of the library can not tell the
+ * difference -- see the differential test in test/disasm_diff.c.
+ */
+
+#include "intercept.h"
+#include "intercept_util.h"
+#include "disasm_wrapper.h"
+
+#include <assert.h>
+#include <string.h>
+
+const char intercept_disasm_name[] = "builtin";
+
+struct intercept_disasm_context {
+	const unsigned char *begin;
+	const unsigned char *end;
+};
+
+/* The maximum length of an x86 instruction, as defined by the ISA */
+#define MAX_INS_LENGTH 15
+
+/*
+ * Flags used in the opcode tables below.
+ *
+ * OP_MODRM	-- the opcode is followed by a ModRM byte
+ * OP_IMM8	-- an 8 bit immediate follows ( after the ModRM, SIB,
+ *		   displacement bytes, if any )
+ * OP_IMM16	-- 16 bit immediate
+ * OP_IMMZ	-- 16 or 32 bit immediate, depending on operand size
+ * OP_IMMV	-- 16, 32, or 64 bit immediate, depending on operand size
+ * OP_REL8	-- 8 bit relative jump target
+ * OP_REL32	-- 32 bit relative jump target
+ * OP_MOFFS	-- 32 or 64 bit absolute address, depending on address size
+ * OP_GROUP_IMM	-- the opcode has an immediate only if the reg field of
+ *		   the ModRM byte is zero or one ( test, in opcodes f6, f7 )
+ * OP_INVALID	-- the opcode can not appear in 64 bit mode
+ * OP_PREFIX	-- not an opcode, but a prefix
+ */
+#define OP_MODRM	0x001
+#define OP_IMM8		0x002
+#define OP_IMM16	0x004
+#define OP_IMMZ		0x008
+#define OP_IMMV		0x010
+#define OP_REL8		0x020
+#define OP_REL32	0x040
+#define OP_MOFFS	0x080
+#define OP_GROUP_IMM	0x100
+#define OP_INVALID	0x200
+#define OP_PREFIX	0x400
+
+#define M OP_MODRM
+#define I8 OP_IMM8
+#define I16 OP_IMM16
+#define IZ OP_IMMZ
+#define IV OP_IMMV
+#define R8 OP_REL8
+#define R32 OP_REL32
+#define MO OP_MOFFS
+#define GI OP_GROUP_IMM
+#define X OP_INVALID
+#define P OP_PREFIX
+
+/* Opcodes of the one byte opcode map */
+static const unsigned short one_byte_table[0x100] = {
+/* 00 */ M, M, M, M, I8, IZ, X, X, M, M, M, M, I8, IZ, X, 0,
+/* 10 */ M, M, M, M, I8, IZ, X, X, M, M, M, M, I8, IZ, X, X,
+/* 20 */ M, M, M, M, I8, IZ, P, X, M, M, M, M, I8, IZ, P, X,
+/* 30 */ M, M, M, M, I8, IZ, P, X, M, M, M, M, I8, IZ, P, X,
+/* 40 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 50 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+/* 60 */ X, X, 0, M, P, P, P, P, IZ, M|IZ, I8, M|I8, 0, 0, 0, 0,
+/* 70 */ R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8, R8,
+/* 80 */ M|I8, M|IZ, X, M|I8, M, M, M, M, M, M, M, M, M, M, M, M,
+/* 90 */ 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, X, 0, 0, 0, 0, 0,
+/* a0 */ MO, MO, MO, MO, 0, 0, 0, 0, I8, IZ, 0, 0, 0, 0, 0, 0,
+/* b0 */ I8, I8, I8, I8, I8, I8, I8, I8, IV, IV, IV, IV, IV, IV, IV, IV,
+/* c0 */ M|I8, M|I8, I16, 0, 0, 0, M|I8, M|IZ, I16|I8, 0, I16, 0, 0, I8, X, 0,
+/* d0 */ M, M, M, M, X, X, X, 0, M, M, M, M, M, M, M, M,
+/* e0 */ R8, R8, R8, R8, I8, I8, I8, I8, R32, R32, X, R8, 0, 0, 0, 0,
+/* f0 */ P, 0, P, P, 0, 0, M|GI, M|GI, 0, 0, 0, 0, 0, 0, M, M,
+};
+
+/* Opcodes following the 0x0f escape byte */
+static const unsigned short two_byte_table[0x100] = {
+/* 00 */ M, M, M, M, X, 0, 0, 0, 0, 0, X, 0, X, M, 0, M|I8,
+/* 10 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* 20 */ M, M, M, M, X, X, X, X, M, M, M, M, M, M, M, M,
+/* 30 */ 0, 0, 0, 0, 0, 0, X, 0, X, X, X, X, X, X, X, X,
+/* 40 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* 50 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* 60 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* 70 */ M|I8, M|I8, M|I8, M|I8, M, M, M, 0, M, M, M, M, M, M, M, M,
+/* 80 */ R32, R32, R32, R32, R32, R32, R32, R32,
+	R32, R32, R32, R32, R32, R32, R32, R32,
+/* 90 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* a0 */ 0, 0, 0, M, M|I8, M, X, X, 0, 0, 0, M, M|I8, M, M, M,
+/* b0 */ M, M, M, M, M, M, M, M, M, M, M|I8, M, M, M, M, M,
+/* c0 */ M, M, M|I8, M, M|I8, M|I8, M|I8, M, 0, 0, 0, 0, 0, 0, 0, 0,
+/* d0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* e0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+/* f0 */ M, M, M, M, M, M, M, M, M, M, M, M, M, M, M, M,
+};
+
+#undef M
+#undef I8
+#undef I16
+#undef IZ
+#undef IV
+#undef R8
+#undef R32
+#undef MO
+#undef GI
+#undef X
+#undef P
+
+#define REX_B 0x1
+#define REX_R 0x4
+#define REX_W 0x8
+
+#define MAP_ONE_BYTE 0
+#define MAP_0F 1
+#define MAP_OTHER 2
+
+/*
+ * has_vex_map1_imm8 -- opcodes in the VEX/EVEX encoded 0x0f map, that
+ * have an 8 bit immediate operand.
+ */
+static bool
+has_vex_map1_imm8(unsigned char opcode)
+{
+	switch (opcode) {
+		case 0x70:
+		case 0x71:
+		case 0x72:
+		case 0x73:
+		case 0xc2:
+		case 0xc4:
+		case 0xc5:
+		case 0xc6:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * The state of decoding a single instruction, while walking through
+ * its bytes.
+ */
+struct decoder {
+	const unsigned char *code;
+	const unsigned char *end; /* the first byte not to be read */
+	const unsigned char *cursor;
+
+	bool opsize_prefix; /* 0x66 */
+	bool addrsize_prefix; /* 0x67 */
+	bool rep_prefix; /* 0xf3 */
+	unsigned char rex;
+
+	/*
+	 * The opcode map the opcode byte belongs to: zero for the one byte
+	 * opcode map, MAP_0F for the two byte map, and MAP_OTHER for
+	 * everything else -- the classification routines below don't need
+	 * to look at any other opcode maps.
+	 */
+	int map;
+
+	unsigned char opcode;
+	unsigned char modrm;
+	bool has_modrm;
+
+	bool rip_relative;
+	int32_t disp;
+
+	/* the first byte of the immediate operand, if there is one */
+	const unsigned char *imm;
+};
+
+static bool
+has_bytes(const struct decoder *d, size_t count)
+{
+	return d->cursor + count <= d->end &&
+	    d->cursor + count <= d->code + MAX_INS_LENGTH;
+}
+
+static int32_t
+read_le32(const unsigned char *bytes)
+{
+	uint32_t value = (uint32_t)bytes[0];
+
+	value |= ((uint32_t)bytes[1]) << 8;
+	value |= ((uint32_t)bytes[2]) << 16;
+	value |= ((uint32_t)bytes[3]) << 24;
+
+	return (int32_t)value;
+}
+
+/*
+ * decode_modrm -- decodes a ModRM byte, and the optional SIB byte and
+ * displacement bytes following it.
+ * Returns false if the instruction is truncated.
+ */
+static bool
+decode_modrm(struct decoder *d)
+{
+	if (!has_bytes(d, 1))
+		return false;
+
+	d->has_modrm = true;
+	d->modrm = *d->cursor++;
+
+	unsigned mod = d->modrm >> 6;
+	unsigned rm = d->modrm & 7;
+	size_t disp_size = 0;
+
+	if (mod == 3)
+		return true;
+
+	if (rm == 4) {
+		/* SIB byte */
+		if (!has_bytes(d, 1))
+			return false;
+
+		unsigned char sib = *d->cursor++;
+
+		if (mod == 0 && (sib & 7) == 5)
+			disp_size = 4;
+	} else if (mod == 0 && rm == 5) {
+		/* RIP relative addressing in 64 bit mode */
+		d->rip_relative = true;
+		disp_size = 4;
+	}
+
+	if (mod == 1)
+		disp_size = 1;
+	else if (mod == 2)
+		disp_size = 4;
+
+	if (!has_bytes(d, disp_size))
+		return false;
+
+	if (disp_size == 1)
+		d->disp = (int8_t)d->cursor[0];
+	else if (disp_size == 4)
+		d->disp = read_le32(d->cursor);
+
+	d->cursor += disp_size;
+
+	return true;
+}
+
+static bool
+skip_bytes(struct decoder *d, size_t count)
+{
+	if (!has_bytes(d, count))
+		return false;
+
+	d->cursor += count;
+	return true;
+}
+
+/*
+ * decode_vex -- decodes the rest of an instruction starting with a
+ * VEX ( c4, c5 ), EVEX ( 62 ), or XOP ( 8f ) prefix. The cursor
+ * points to the byte following the first prefix byte.
+ */
+static bool
+decode_vex(struct decoder *d, unsigned char prefix)
+{
+	unsigned map;
+	size_t payload;
+
+	if (d->rex != 0 || d->opsize_prefix || d->rep_prefix)
+		return false; /* #UD */
+
+	switch (prefix) {
+		case 0xc5:
+			payload = 1;
+			map = 1;
+			break;
+		case 0xc4:
+		case 0x8f:
+			payload = 2;
+			if (!has_bytes(d, 1))
+				return false;
+			map = d->cursor[0] & 0x1f;
+			break;
+		case 0x62:
+			payload = 3;
+			if (!has_bytes(d, 1))
+				return false;
+			map = d->cursor[0] & 0x7;
+			break;
+		default:
+			return false;
+	}
+
+	if (!skip_bytes(d, payload))
+		return false;
+
+	if (!has_bytes(d, 1))
+		return false;
+
+	d->opcode = *d->cursor++;
+
+	/* vzeroupper, vzeroall are the only ones without a ModRM byte */
+	if (prefix != 0x8f && map == 1 && d->opcode == 0x77)
+		return true;
+
+	if (!decode_modrm(d))
+		return false;
+
+	if (prefix == 0x8f) {
+		/* XOP maps 8, 9, 0xa */
+		if (map == 8)
+			return skip_bytes(d, 1);
+		else if (map == 0xa)
+			return skip_bytes(d, 4);
+		else if (map == 9)
+			return true;
+		else
+			return false;
+	}
+
+	switch (map) {
+		case 1:
+			if (has_vex_map1_imm8(d->opcode))
+				return skip_bytes(d, 1);
+			return true;
+		case 2:
+		case 5:
+		case 6:
+			return true;
+		case 3:
+			return skip_bytes(d, 1);
+		default:
+			return false;
+	}
+}
+
+static void
+set_rip_relative(struct intercept_disasm_result *result,
+		const unsigned char *code, int32_t disp)
+{
+	result->has_ip_relative_opr = true;
+	result->rip_disp = disp;
+	result->rip_ref_addr = code + result->length + disp;
+}
+
+/*
+ * classify_one_byte -- fill the fields of the result describing the
+ * instructions in the one byte opcode map.
+ */
+static void
+classify_one_byte(struct intercept_disasm_result *result,
+		const struct decoder *d, int32_t rel)
+{
+	unsigned reg = (d->modrm >> 3) & 7;
+
+	if ((d->opcode >= 0x70 && d->opcode <= 0x7f) ||
+	    (d->opcode >= 0xe0 && d->opcode <= 0xe3)) {
+		/* jcc, loop, jrcxz */
+		result->is_jump = true;
+		result->is_rel_jump = true;
+		set_rip_relative(result, d->code, rel);
+		return;
+	}
+
+	switch (d->opcode) {
+		case 0xe9:
+		case 0xeb:
+			result->is_jump = true;
+			result->is_rel_jump = true;
+			set_rip_relative(result, d->code, rel);
+			break;
+		case 0xe8:
+			result->is_jump = true;
+			result->is_call = true;
+			result->is_rel_jump = true;
+			set_rip_relative(result, d->code, rel);
+			break;
+		case 0xc2:
+		case 0xc3:
+			result->is_ret = true;
+			break;
+		case 0x90:
+			/* xchg %eax, %r8d is not a nop, pause isn't either */
+			if ((d->rex & 1) == 0 && !d->rep_prefix)
+				result->is_nop = true;
+			break;
+		case 0xff:
+			/* only near calls, and jumps -- /2 and /4 */
+			if (reg != 2 && reg != 4)
+				break;
+
+			result->is_jump = true;
+			result->is_call = (reg == 2);
+
+			if ((d->modrm >> 6) == 3) {
+				/* jmp *%rax */
+				result->is_indirect_jump = true;
+			} else {
+				/*
+				 * jmp *8(%rax) -- treated as a relative
+				 * jump, just as in the capstone wrapper
+				 */
+				result->is_rel_jump = true;
+				set_rip_relative(result, d->code, d->disp);
+			}
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * classify_two_byte -- fill the fields of the result describing the
+ * instructions in the 0x0f opcode map.
+ */
+static void
+classify_two_byte(struct intercept_disasm_result *result,
+		const struct decoder *d, int32_t rel)
+{
+	if (d->opcode == 0x05) {
+		result->is_syscall = true;
+	} else if (d->opcode == 0x1f) {
+		result->is_nop = true;
+	} else if (d->opcode >= 0x80 && d->opcode <= 0x8f) {
+		result->is_jump = true;
+		result->is_rel_jump = true;
+		set_rip_relative(result, d->code, rel);
+	}
+}
+
+/*
+ * is_rax_operand -- checks if a register number encoded in an instruction
+ * refers to RAX, or any part of it. The rex_bit argument is the REX bit
+ * extending the register number ( REX_R for the reg field of the ModRM
+ * byte, REX_B for the rm field ). Without a REX prefix, register number
+ * four is AH in byte sized operations.
+ */
+static bool
+is_rax_operand(const struct decoder *d, unsigned reg, unsigned char rex_bit,
+		bool byte_op)
+{
+	if ((d->rex & rex_bit) != 0)
+		return false;
+
+	return reg == 0 || (byte_op && d->rex == 0 && reg == 4);
+}
+
+/*
+ * classify_rax_effect -- looks for instructions loading a constant into RAX,
+ * and for instructions leaving RAX intact, the same way check_rax_effect
+ * does in disasm_wrapper.c. Only a few very common instructions
+ * are recognized, anything else is assumed to modify RAX.
+ */
+static void
+classify_rax_effect(struct intercept_disasm_result *result,
+		const struct decoder *d)
+{
+	unsigned char op = d->opcode;
+	unsigned mod = d->modrm >> 6;
+	unsigned reg = (d->modrm >> 3) & 7;
+	unsigned rm = d->modrm & 7;
+	bool dst_is_rax;
+
+	if (result->is_nop) {
+		result->preserves_rax = true;
+		return;
+	}
+
+	if (d->map == MAP_0F) {
+		/* movzx, movsx */
+		if (op == 0xb6 || op == 0xb7 || op == 0xbe || op == 0xbf)
+			result->preserves_rax =
+			    !is_rax_operand(d, reg, REX_R, false);
+		return;
+	}
+
+	if (d->map != MAP_ONE_BYTE)
+		return;
+
+	if (op < 0x40 && (op & 7) < 4) {
+		/* add, or, adc, sbb, and, sub, xor, cmp with a ModRM byte */
+		bool byte_op = (op & 1) == 0;
+
+		if ((op & 0x38) == 0x38) {
+			/* cmp */
+			result->preserves_rax = true;
+			return;
+		}
+
+		if ((op & 2) != 0)
+			dst_is_rax = is_rax_operand(d, reg, REX_R, byte_op);
+		else if (mod == 3)
+			dst_is_rax = is_rax_operand(d, rm, REX_B, byte_op);
+		else
+			dst_is_rax = false; /* memory destination */
+
+		result->preserves_rax = !dst_is_rax;
+
+		/* xor %eax, %eax */
+		if ((op == 0x31 || op == 0x33) && mod == 3 && reg == 0 &&
+		    rm == 0 && (d->rex & (REX_R | REX_B)) == 0 &&
+		    !d->opsize_prefix) {
+			result->sets_rax_imm = true;
+			result->rax_imm = 0;
+		}
+
+		return;
+	}
+
+	switch (op) {
+		case 0x3c: /* cmp $imm, %al */
+		case 0x3d: /* cmp $imm, %eax */
+		case 0x50: /* push */
+		case 0x51:
+		case 0x52:
+		case 0x53:
+		case 0x54:
+		case 0x55:
+		case 0x56:
+		case 0x57:
+		case 0x84: /* test */
+		case 0x85:
+		case 0xa8:
+		case 0xa9:
+			result->preserves_rax = true;
+			break;
+		case 0x63: /* movsxd */
+		case 0x8a: /* mov r/m, reg */
+		case 0x8b:
+		case 0x8d: /* lea */
+			result->preserves_rax =
+			    !is_rax_operand(d, reg, REX_R, op == 0x8a);
+			break;
+		case 0x80: /* add, or, adc, sbb, and, sub, xor, cmp $imm */
+		case 0x81:
+		case 0x83:
+		case 0x88: /* mov reg, r/m */
+		case 0x89:
+			if ((op == 0x80 || op == 0x81 || op == 0x83) &&
+			    reg == 7)
+				result->preserves_rax = true; /* cmp $imm */
+			else if (mod != 3)
+				result->preserves_rax = true;
+			else
+				result->preserves_rax = !is_rax_operand(d, rm,
+				    REX_B, op == 0x80 || op == 0x88);
+			break;
+		case 0xb8: /* mov $imm, %eax */
+			if (d->rex & REX_B) {
+				result->preserves_rax = true;
+			} else if (d->rex & REX_W) {
+				result->sets_rax_imm = true;
+				result->rax_imm = (int64_t)(
+				    (uint64_t)(uint32_t)read_le32(d->imm) |
+				    ((uint64_t)(uint32_t)read_le32(d->imm + 4)
+				    << 32));
+			} else if (!d->opsize_prefix) {
+				result->sets_rax_imm = true;
+				result->rax_imm =
+				    (int64_t)(uint32_t)read_le32(d->imm);
+			}
+			break;
+		case 0xc7: /* mov $imm, r/m */
+			if (reg != 0)
+				break;
+			if (mod != 3 || !is_rax_operand(d, rm, REX_B, false)) {
+				result->preserves_rax = true;
+			} else if (d->rex & REX_W) {
+				result->sets_rax_imm = true;
+				result->rax_imm = read_le32(d->imm);
+			} else if (!d->opsize_prefix) {
+				result->sets_rax_imm = true;
+				result->rax_imm =
+				    (int64_t)(uint32_t)read_le32(d->imm);
+			}
+			break;
+		default:
+			if (op >= 0xb0 && op <= 0xbf)
+				result->preserves_rax = !is_rax_operand(d,
+				    op & 7, REX_B, op < 0xb8);
+			break;
+	}
+}
+
+/*
+ * intercept_disasm_init -- should be called before disassembling a region of
+ * code. The builtin decoder does not need any state, other than the bounds
+ * of the region.
+ *
+ * One must pass this context pointer to intercept_disasm_destroy following
+ * a disassembling loop.
+ */
+struct intercept_disasm_context *
+intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
+{
+	struct intercept_disasm_context *context;
+
+	context = xmmap_anon(sizeof(*context));
+	context->begin = begin;
+	context->end = end;
+
+	return context;
+}
+
+/*
+ * intercept_disasm_destroy -- see comments for above routine
+ */
+void
+intercept_disasm_destroy(struct intercept_disasm_context *context)
+{
+	xmunmap(context, sizeof(*context));
+}
+
+/*
+ * decode -- walks through the bytes of a single instruction.
+ * Returns the length of the instruction, or zero if the bytes can not be
+ * decoded.
+ */
+static unsigned
+decode(struct decoder *d, int32_t *rel)
+{
+	unsigned short flags;
+	unsigned char byte;
+
+	d->map = MAP_ONE_BYTE;
+	*rel = 0;
+
+	/* legacy prefixes, and REX */
+	for (;;) {
+		if (!has_bytes(d, 1))
+			return 0;
+
+		byte = *d->cursor;
+
+		if (byte == 0x66) {
+			d->opsize_prefix = true;
+		} else if (byte == 0x67) {
+			d->addrsize_prefix = true;
+		} else if (byte == 0xf3 || byte == 0xf2) {
+			d->rep_prefix = (byte == 0xf3);
+		} else if (byte == 0xf0 || byte == 0x2e || byte == 0x36 ||
+		    byte == 0x3e || byte == 0x26 || byte == 0x64 ||
+		    byte == 0x65) {
+			/* lock, segment override, branch hints */
+		} else if ((byte & 0xf0) == 0x40) {
+			d->rex = byte;
+			++d->cursor;
+			if (!has_bytes(d, 1))
+				return 0;
+			byte = *d->cursor;
+			/* a REX prefix must come last */
+			if (one_byte_table[byte] & OP_PREFIX ||
+			    (byte & 0xf0) == 0x40)
+				return 0;
+			break;
+		} else {
+			break;
+		}
+
+		d->rex = 0;
+		++d->cursor;
+	}
+
+	d->opcode = *d->cursor++;
+
+	if (d->opcode == 0xc4 || d->opcode == 0xc5 || d->opcode == 0x62) {
+		d->map = MAP_OTHER;
+		if (!decode_vex(d, d->opcode))
+			return 0;
+		return (unsigned)(d->cursor - d->code);
+	}
+
+	if (d->opcode == 0x8f && has_bytes(d, 1) &&
+	    (*d->cursor & 0x38) != 0) {
+		/* AMD XOP, otherwise this is pop r/m */
+		d->map = MAP_OTHER;
+		if (!decode_vex(d, d->opcode))
+			return 0;
+		return (unsigned)(d->cursor - d->code);
+	}
+
+	if (d->opcode == 0x0f) {
+		if (!has_bytes(d, 1))
+			return 0;
+
+		d->opcode = *d->cursor++;
+		d->map = MAP_0F;
+
+		if (d->opcode == 0x38 || d->opcode == 0x3a) {
+			/* three byte opcode maps */
+			bool has_imm = (d->opcode == 0x3a);
+
+			if (!skip_bytes(d, 1))
+				return 0;
+			if (!decode_modrm(d))
+				return 0;
+			if (has_imm && !skip_bytes(d, 1))
+				return 0;
+
+			d->map = MAP_OTHER;
+			return (unsigned)(d->cursor - d->code);
+		}
+
+		flags = two_byte_table[d->opcode];
+	} else {
+		flags = one_byte_table[d->opcode];
+	}
+
+	if (flags & OP_INVALID)
+		return 0;
+
+	if (flags & OP_MODRM) {
+		if (!decode_modrm(d))
+			return 0;
+	}
+
+	bool wide = (d->rex & 8) != 0;
+	size_t imm_size = 0;
+
+	if (flags & OP_IMM8)
+		imm_size += 1;
+	if (flags & OP_IMM16)
+		imm_size += 2;
+	if (flags & OP_IMMZ)
+		imm_size += (d->opsize_prefix && !wide) ? 2 : 4;
+	if (flags & OP_IMMV)
+		imm_size += wide ? 8 : (d->opsize_prefix ? 2 : 4);
+	if (flags & OP_MOFFS)
+		imm_size += d->addrsize_prefix ? 4 : 8;
+	if ((flags & OP_GROUP_IMM) && ((d->modrm >> 3) & 7) < 2) {
+		if (d->opcode == 0xf6)
+			imm_size += 1;
+		else
+			imm_size += (d->opsize_prefix && !wide) ? 2 : 4;
+	}
+
+	d->imm = d->cursor;
+
+	if (flags & OP_REL8) {
+		if (!has_bytes(d, 1))
+			return 0;
+		*rel = (int8_t)*d->cursor;
+		imm_size += 1;
+	}
+
+	if (flags & OP_REL32) {
+		if (!has_bytes(d, 4))
+			return 0;
+		*rel = read_le32(d->cursor);
+		imm_size += 4;
+	}
+
+	if (!skip_bytes(d, imm_size))
+		return 0;
+
+	return (unsigned)(d->cursor - d->code);
+}
+
+/*
+ * intercept_disasm_next_instruction - Examines a single instruction
+ * in a text section, collecting data that can be used later to make
+ * decisions about patching.
+ */
+struct intercept_disasm_result
+intercept_disasm_next_instruction(struct intercept_disasm_context *context,
+					const unsigned char *code)
+{
+	struct intercept_disasm_result result = {0, };
+	struct decoder d = {0, };
+	int32_t rel;
+
+	d.code = code;
+	d.cursor = code;
+	d.end = context->end + 1;
+
+	if (code < context->begin || code >= d.end)
+		return result;
+
+	result.length = decode(&d, &rel);
+	if (result.length == 0)
+		return result;
+
+	if (d.map == MAP_ONE_BYTE)
+		classify_one_byte(&result, &d, rel);
+	else if (d.map == MAP_0F)
+		classify_two_byte(&result, &d, rel);
+
+	if (d.rip_relative && !result.has_ip_relative_opr)
+		set_rip_relative(&result, code, d.disp);
+
+	classify_rax_effect(&result, &d);
+
+#ifndef NDEBUG
+	if (result.is_syscall)
+		result.mnemonic = "syscall";
+	else if (result.is_nop)
+		result.mnemonic = "nop";
+	else if (result.is_call)
+		result.mnemonic = "call";
+	else if (result.is_jump)
+		result.mnemonic = "jmp";
+	else if (result.is_ret)
+		result.mnemonic = "ret";
+	else
+		result.mnemonic = "(insn)";
+#endif
+
+	result.is_set = true;
+
+	return result;
+}
@@ -47,6 +47,8 @@
 #include <syscall.h>
 #include "capstone_wrapper.h"
 
+const char intercept_disasm_name[] = "capstone";
+
 struct intercept_disasm_context {
 	csh handle;
 	cs_insn *insn;
@@ -68,6 +70,28 @@ nop_vsnprintf()
 	return 0;
 }
 
+/*
+ * capstone allocates memory using malloc while creating, and destroying
+ * a context, which is not safe on the worker threads used at startup
+ * ( see workers.c ), as those share the thread local storage -- including
+ * the per thread malloc caches -- of the thread that started them. These
+ * calls are serialized, as if they were all made on the same thread.
+ * Disassembling an instruction does not allocate memory.
+ */
+static int capstone_lock;
+
+static void
+lock_capstone(void)
+{
+	spin_lock(&capstone_lock);
+}
+
+static void
+unlock_capstone(void)
+{
+	spin_unlock(&capstone_lock);
+}
+
 /*
  * intercept_disasm_init -- should be called before disassembling a region of
  * code. The context created contains the context capstone needs ( or generally
@@ -86,6 +110,8 @@ intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
 	context->begin = begin;
 	context->end = end;
 
+	lock_capstone();
+
 	/*
 	 * Initialize the disassembler.
 	 * The handle here must be passed to capstone each time it is used.
@@ -117,6 +143,8 @@ intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
 	if ((context->insn = cs_malloc(context->handle)) == NULL)
 		xabort("cs_malloc");
 
+	unlock_capstone();
+
 	return context;
 }
 
@@ -126,8 +154,10 @@ intercept_disasm_init(const unsigned char *begin, const unsigned char *end)
 void
 intercept_disasm_destroy(struct intercept_disasm_context *context)
 {
+	lock_capstone();
 	cs_free(context->insn, 1);
 	cs_close(&context->handle);
+	unlock_capstone();
 	xmunmap(context, sizeof(*context));
 }
 
@@ -198,6 +228,78 @@ check_op(struct intercept_disasm_result *result, cs_x86_op *op,
 	}
 }
 
+/*
+ * is_rax_reg - checks if a register is RAX, or any part of it.
+ */
+static bool
+is_rax_reg(x86_reg reg)
+{
+	return reg == X86_REG_AL || reg == X86_REG_AH || reg == X86_REG_AX ||
+	    reg == X86_REG_EAX || reg == X86_REG_RAX;
+}
+
+/*
+ * check_rax_effect - looks for instructions loading a constant into RAX,
+ * and for instructions leaving RAX intact. Only a few very common
+ * instructions are recognized, anything else is assumed to modify RAX.
+ */
+static void
+check_rax_effect(struct intercept_disasm_result *result, const cs_insn *insn)
+{
+	const cs_x86 *x86 = &insn->detail->x86;
+	const cs_x86_op *dst = x86->operands;
+	const cs_x86_op *src = x86->operands + 1;
+
+	switch (insn->id) {
+		case X86_INS_CMP:
+		case X86_INS_TEST:
+		case X86_INS_PUSH:
+		case X86_INS_NOP:
+			result->preserves_rax = true;
+			return;
+		case X86_INS_MOV:
+		case X86_INS_MOVABS:
+		case X86_INS_MOVZX:
+		case X86_INS_MOVSX:
+		case X86_INS_MOVSXD:
+		case X86_INS_LEA:
+		case X86_INS_ADD:
+		case X86_INS_SUB:
+		case X86_INS_AND:
+		case X86_INS_OR:
+		case X86_INS_XOR:
+			break;
+		default:
+			return;
+	}
+
+	if (x86->op_count != 2)
+		return;
+
+	/* the first operand is the destination */
+	if (dst->type != X86_OP_REG || !is_rax_reg(dst->reg)) {
+		result->preserves_rax = true;
+		return;
+	}
+
+	if (dst->reg != X86_REG_EAX && dst->reg != X86_REG_RAX)
+		return;
+
+	if ((insn->id == X86_INS_MOV || insn->id == X86_INS_MOVABS) &&
+	    src->type == X86_OP_IMM) {
+		/* mov $0x27, %eax */
+		result->sets_rax_imm = true;
+		result->rax_imm = src->imm;
+		if (dst->reg == X86_REG_EAX)
+			result->rax_imm = (int64_t)(uint32_t)src->imm;
+	} else if (insn->id == X86_INS_XOR &&
+	    src->type == X86_OP_REG && src->reg == dst->reg) {
+		/* xor %eax, %eax */
+		result->sets_rax_imm = true;
+		result->rax_imm = 0;
+	}
+}
+
 /*
  * intercept_disasm_next_instruction - Examines a single instruction
  * in a text section. This is only a wrapper around capstone specific code,
@@ -287,6 +389,8 @@ intercept_disasm_next_instruction(struct intercept_disasm_context *context,
 		check_op(&result, context->insn->detail->x86.operands + op_i,
 		    code);
 
+	check_rax_effect(&result, context->insn);
+
 	result.is_set = true;
 
 	return result;
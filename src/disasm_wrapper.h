@@ -81,6 +81,20 @@ struct intercept_disasm_result {
 
 	bool is_nop;
 
+	/*
+	 * The effect of the instruction on the RAX register, used for
+	 * finding syscall numbers without executing the code.
+	 * The flag sets_rax_imm marks instructions loading a constant
+	 * into EAX or RAX, with the constant stored in rax_imm ( e.g.:
+	 * mov $0x27, %eax -- or xor %eax, %eax with a zero constant ).
+	 * The flag preserves_rax marks instructions that are known to
+	 * leave RAX intact. If neither is set, the instruction might
+	 * modify RAX in some way.
+	 */
+	bool sets_rax_imm;
+	bool preserves_rax;
+	int64_t rax_imm;
+
 	/*
 	 * Optional fields:
 	 * The rip_disp field contains the displacement used in
@@ -99,6 +113,12 @@ struct intercept_disasm_result {
 
 struct intercept_disasm_context;
 
+/*
+ * A short name of the disassembler implementation, identifying it in
+ * the files written by plan_cache.c.
+ */
+extern const char intercept_disasm_name[];
+
 struct intercept_disasm_context *
 intercept_disasm_init(const unsigned char *begin, const unsigned char *end);
 
@@ -0,0 +1,426 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * hook_registry.c -- hook functions registered for individual syscalls.
+ *
+ * Any number of libraries can register hook functions using
+ * intercept_register_hook, each for a single syscall number. The hooks
+ * registered for a syscall are stored in a chain ordered by priority,
+ * and the chains are stored in a table indexed by the syscall number, so
+ * finding the hooks interested in a syscall takes a single lookup.
+ * The exit hooks registered using intercept_register_exit_hook -- called
+ * after a syscall is executed -- are stored the same way, in another table.
+ *
+ * The chains are never modified after they are published in the table.
+ * Registering, or unregistering a hook creates a new chain, replacing the
+ * old one, which is never freed -- another thread might be just calling
+ * the hooks in it. Registration is expected to be rare, e.g. happening only
+ * while loading the hook libraries, thus the memory leaked is negligible.
+ *
+ * The legacy intercept_hook_point is called after all the hooks registered
+ * for the syscall let it through, if it is selected by the syscall filter,
+ * preceded by intercept_hook_point_context, and intercept_hook_point_desc.
+ * Similarly, intercept_hook_point_exit is called after the registered
+ * exit hooks.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "intercept.h"
+#include "intercept_util.h"
+#include "libsyscall_intercept_hook_point.h"
+
+int (*intercept_hook_point_context)(const struct intercept_context *context,
+			long *result)
+	__attribute__((visibility("default")));
+
+int (*intercept_hook_point_desc)(struct intercept_syscall_desc *desc,
+			long *result)
+	__attribute__((visibility("default")));
+
+void (*intercept_hook_point_exit)(long syscall_number,
+			long arg0, long arg1,
+			long arg2, long arg3,
+			long arg4, long arg5,
+			long *result)
+	__attribute__((visibility("default")));
+
+/*
+ * Both kinds of hook functions are stored as a generic function pointer,
+ * and are converted back to their original type before calling them.
+ */
+typedef void (*any_hook_fn)(void);
+
+struct hook_entry {
+	any_hook_fn hook;
+	int priority;
+};
+
+struct hook_chain {
+	unsigned count;
+	struct hook_entry entries[];
+};
+
+static struct hook_chain *hook_table[SYSCALL_FILTER_SIZE];
+static struct hook_chain *exit_hook_table[SYSCALL_FILTER_SIZE];
+
+/* serializes modifications of hook_table */
+static int registry_lock;
+
+static void
+lock_registry(void)
+{
+	spin_lock(&registry_lock);
+}
+
+static void
+unlock_registry(void)
+{
+	spin_unlock(&registry_lock);
+}
+
+/*
+ * allocate_chain -- allocate memory for a new chain from a pool of
+ * anonymous mappings, as the memory is never freed. Only called while
+ * holding the registry lock.
+ */
+static struct hook_chain *
+allocate_chain(unsigned count)
+{
+	static unsigned char *pool;
+	static size_t pool_available;
+
+	size_t size = sizeof(struct hook_chain) +
+			count * sizeof(struct hook_entry);
+
+	size = (size + 15) & ~(size_t)15;
+
+	if (size > pool_available) {
+		pool_available = size < 0x10000 ? 0x10000 : size;
+		pool = xmmap_anon(pool_available);
+	}
+
+	struct hook_chain *chain = (struct hook_chain *)pool;
+
+	pool += size;
+	pool_available -= size;
+	chain->count = count;
+
+	return chain;
+}
+
+/*
+ * update_registered -- let the syscall filter know whether a syscall
+ * has any hook registered. Only called while holding the registry lock.
+ */
+static void
+update_registered(unsigned long nr)
+{
+	syscall_filter_set_registered((long)nr,
+	    hook_table[nr] != NULL || exit_hook_table[nr] != NULL);
+}
+
+/*
+ * add_hook -- add a hook function to the chain of hooks registered for a
+ * syscall. The new hook is placed after any other hook with a higher or
+ * equal priority.
+ */
+static int
+add_hook(struct hook_chain **table, long syscall_number, any_hook_fn hook,
+		int priority)
+{
+	unsigned long nr = (unsigned long)syscall_number;
+
+	if (nr >= SYSCALL_FILTER_SIZE || hook == NULL)
+		return -1;
+
+	lock_registry();
+
+	struct hook_chain *old = table[nr];
+	unsigned old_count = (old == NULL) ? 0 : old->count;
+	struct hook_chain *chain = allocate_chain(old_count + 1);
+	unsigned i = 0;
+
+	for (; i < old_count && old->entries[i].priority >= priority; ++i)
+		chain->entries[i] = old->entries[i];
+
+	chain->entries[i].hook = hook;
+	chain->entries[i].priority = priority;
+
+	for (; i < old_count; ++i)
+		chain->entries[i + 1] = old->entries[i];
+
+	__atomic_store_n(table + nr, chain, __ATOMIC_RELEASE);
+	update_registered(nr);
+
+	unlock_registry();
+
+	hook_registered();
+
+	return 0;
+}
+
+/*
+ * remove_hook -- remove a hook function from the chain of hooks registered
+ * for a syscall. If the same function was registered multiple times, the
+ * one with the highest priority is removed.
+ */
+static int
+remove_hook(struct hook_chain **table, long syscall_number, any_hook_fn hook)
+{
+	unsigned long nr = (unsigned long)syscall_number;
+
+	if (nr >= SYSCALL_FILTER_SIZE)
+		return -1;
+
+	lock_registry();
+
+	struct hook_chain *old = table[nr];
+	unsigned old_count = (old == NULL) ? 0 : old->count;
+	unsigned i = 0;
+
+	while (i < old_count && old->entries[i].hook != hook)
+		++i;
+
+	if (i == old_count) {
+		unlock_registry();
+		return -1;
+	}
+
+	struct hook_chain *chain = NULL;
+
+	if (old_count > 1) {
+		chain = allocate_chain(old_count - 1);
+
+		for (unsigned j = 0; j < i; ++j)
+			chain->entries[j] = old->entries[j];
+
+		for (unsigned j = i + 1; j < old_count; ++j)
+			chain->entries[j - 1] = old->entries[j];
+	}
+
+	__atomic_store_n(table + nr, chain, __ATOMIC_RELEASE);
+	update_registered(nr);
+
+	unlock_registry();
+
+	return 0;
+}
+
+int
+intercept_register_hook(long syscall_number, intercept_hook_fn hook,
+				int priority)
+	__attribute__((visibility("default")));
+
+int
+intercept_unregister_hook(long syscall_number, intercept_hook_fn hook)
+	__attribute__((visibility("default")));
+
+int
+intercept_register_exit_hook(long syscall_number, intercept_exit_hook_fn hook,
+				int priority)
+	__attribute__((visibility("default")));
+
+int
+intercept_unregister_exit_hook(long syscall_number,
+				intercept_exit_hook_fn hook)
+	__attribute__((visibility("default")));
+
+/*
+ * The functions below are part of syscall_intercept's public API.
+ */
+int
+intercept_register_hook(long syscall_number, intercept_hook_fn hook,
+				int priority)
+{
+	return add_hook(hook_table, syscall_number, (any_hook_fn)hook,
+			priority);
+}
+
+int
+intercept_unregister_hook(long syscall_number, intercept_hook_fn hook)
+{
+	return remove_hook(hook_table, syscall_number, (any_hook_fn)hook);
+}
+
+int
+intercept_register_exit_hook(long syscall_number, intercept_exit_hook_fn hook,
+				int priority)
+{
+	return add_hook(exit_hook_table, syscall_number, (any_hook_fn)hook,
+			priority);
+}
+
+int
+intercept_unregister_exit_hook(long syscall_number,
+				intercept_exit_hook_fn hook)
+{
+	return remove_hook(exit_hook_table, syscall_number, (any_hook_fn)hook);
+}
+
+/*
+ * call_hooks -- forward a syscall to the hooks interested in it.
+ * The return value follows the convention of intercept_hook_point: zero
+ * means the syscall was handled by one of the hooks, and the result is
+ * stored in *result -- non-zero means the syscall described by *desc should
+ * be executed. The contents of *desc are only changed by
+ * intercept_hook_point_desc returning INTERCEPT_HOOK_FORWARD_MODIFIED.
+ * The context argument is only used when intercept_hook_point_context is
+ * not NULL, and the hook is skipped if the context is NULL.
+ */
+int
+call_hooks(struct syscall_desc *desc, const struct intercept_context *context,
+		long *result)
+{
+	unsigned long nr = (unsigned long)desc->nr;
+
+	if (nr < SYSCALL_FILTER_SIZE) {
+		struct hook_chain *chain =
+		    __atomic_load_n(hook_table + nr, __ATOMIC_ACQUIRE);
+
+		if (chain != NULL) {
+			for (unsigned i = 0; i < chain->count; ++i) {
+				intercept_hook_fn hook =
+				    (intercept_hook_fn)chain->entries[i].hook;
+
+				if (hook(desc->nr,
+				    desc->args[0],
+				    desc->args[1],
+				    desc->args[2],
+				    desc->args[3],
+				    desc->args[4],
+				    desc->args[5],
+				    result) == 0)
+					return 0;
+			}
+		}
+	}
+
+	if (!is_syscall_selected(desc->nr))
+		return 1;
+
+	/*
+	 * The hook pointers can be set by other threads at any time, each
+	 * one is read once. The context is only NULL, if there was no
+	 * context hook yet, when the caller looked at it.
+	 */
+	int (*context_hook)(const struct intercept_context *, long *) =
+	    __atomic_load_n(&intercept_hook_point_context, __ATOMIC_RELAXED);
+
+	if (context_hook != NULL && context != NULL &&
+	    context_hook(context, result) == 0)
+		return 0;
+
+	int (*desc_hook)(struct intercept_syscall_desc *, long *) =
+	    __atomic_load_n(&intercept_hook_point_desc, __ATOMIC_RELAXED);
+
+	if (desc_hook != NULL) {
+		struct intercept_syscall_desc modified;
+
+		modified.nr = desc->nr;
+		for (unsigned i = 0; i < 6; ++i)
+			modified.args[i] = desc->args[i];
+
+		switch (desc_hook(&modified, result)) {
+			case INTERCEPT_HOOK_HANDLED:
+				return 0;
+			case INTERCEPT_HOOK_FORWARD_MODIFIED:
+				desc->nr = modified.nr;
+				for (unsigned i = 0; i < 6; ++i)
+					desc->args[i] = modified.args[i];
+				return 1;
+			default:
+				break;
+		}
+	}
+
+	int (*hook)(long, long, long, long, long, long, long, long *) =
+	    __atomic_load_n(&intercept_hook_point, __ATOMIC_RELAXED);
+
+	if (hook == NULL)
+		return 1;
+
+	return hook(desc->nr,
+		    desc->args[0],
+		    desc->args[1],
+		    desc->args[2],
+		    desc->args[3],
+		    desc->args[4],
+		    desc->args[5],
+		    result);
+}
+
+/*
+ * call_exit_hooks -- forward the result of a syscall to the exit hooks
+ * interested in it. Each of these can change the result.
+ */
+void
+call_exit_hooks(const struct syscall_desc *desc, long *result)
+{
+	unsigned long nr = (unsigned long)desc->nr;
+
+	if (nr < SYSCALL_FILTER_SIZE) {
+		struct hook_chain *chain =
+		    __atomic_load_n(exit_hook_table + nr, __ATOMIC_ACQUIRE);
+
+		if (chain != NULL) {
+			for (unsigned i = 0; i < chain->count; ++i) {
+				intercept_exit_hook_fn hook =
+				    (intercept_exit_hook_fn)
+				    chain->entries[i].hook;
+
+				hook(desc->nr,
+				    desc->args[0],
+				    desc->args[1],
+				    desc->args[2],
+				    desc->args[3],
+				    desc->args[4],
+				    desc->args[5],
+				    result);
+			}
+		}
+	}
+
+	if (intercept_hook_point_exit != NULL &&
+	    is_syscall_selected(desc->nr))
+		intercept_hook_point_exit(desc->nr,
+		    desc->args[0],
+		    desc->args[1],
+		    desc->args[2],
+		    desc->args[3],
+		    desc->args[4],
+		    desc->args[5],
+		    result);
+}
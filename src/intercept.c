@@ -36,6 +36,8 @@
  *
  * intercept() - the library entry point
  * intercept_routine() - the entry point for each hooked syscall
+ * intercept_routine_known_nr() - the entry point for hooked syscalls with
+ *  syscall numbers known at patch time
  */
 
 #include <assert.h>
@@ -107,11 +109,11 @@ void __attribute__((noreturn)) xlongjmp(long rip, long rsp, long rax);
  * Kernel can clobber rcx and r11 while serving a syscall, those are ignored
  * The layout of this struct depends on the way the assembly wrapper saves
  * register on the stack.
- * Note: don't expect the SIMD array to be aligned for efficient use with
- * AVX instructions.
+ * The SIMD registers are only found in the fxsave_area on CPUs without
+ * XSAVE support, otherwise they are saved at a location below this struct.
  */
 struct context {
-	struct patch_desc *patch_desc;
+	const struct patch_site *site;
 	long rip;
 	long r15;
 	long r14;
@@ -128,7 +130,7 @@ struct context {
 	long rdx;
 	long rax;
 	char padd[0x200 - 0x168]; /* see: stack layout in intercept_wrapper.s */
-	long SIMD[16][8]; /* 8 SSE, 8 AVX, or 16 AVX512 registers */
+	char fxsave_area[0x200];
 };
 
 struct wrapper_ret {
@@ -139,6 +141,16 @@ struct wrapper_ret {
 /* Should all objects be patched, or only libc and libpthread? */
 static bool patch_all_objs;
 
+/*
+ * Should objects loaded after startup be patched? See watch_loader_syscall.
+ * The dynamic loader itself is patched in this case, and its address, and
+ * path are stored here -- the latter is the containing_lib_path of its
+ * patch_site instances.
+ */
+static bool patch_dlopen_objs;
+static uintptr_t loader_addr;
+static const char *loader_path;
+
 /*
  * Information collected during disassemble phase, and anything else
  * needed for hotpatching are stored in this dynamically allocated
@@ -148,6 +160,34 @@ static bool patch_all_objs;
 static struct intercept_desc *objs;
 static unsigned objs_count;
 
+/*
+ * The objects before prepared_count are already disassembled, and have
+ * their wrappers generated -- the rest were found while the patches were
+ * deactivated, see patch_objects.
+ */
+static unsigned prepared_count;
+
+/*
+ * Are the patches written into the objects? This is false before the
+ * first call to intercept_activate in lazy mode, and after
+ * intercept_deactivate. The objects found at startup are only looked for
+ * once, before they are first patched -- objects_found is set then.
+ */
+static bool patches_active;
+static bool lazy_patching;
+static bool objects_found;
+
+/*
+ * Is intercept done? The process might have multiple threads from then
+ * on, see live_patch.c
+ */
+static bool startup_done;
+
+/*
+ * Held while patching, see intercept_activate, and watch_loader_syscall
+ */
+static int patching_lock;
+
 /* was libc found while looking for loaded objects? */
 static bool libc_found;
 
@@ -313,6 +353,53 @@ get_object_path(const struct dl_phdr_info *info)
 	}
 }
 
+/*
+ * find_build_id - look for the GNU build-id note in the PT_NOTE segments
+ * of a loaded object. Returns NULL if there is no such note.
+ *
+ * Each note consists of an Elf64_Nhdr, followed by the name, and the
+ * descriptor -- both padded to the alignment of the segment.
+ */
+static const unsigned char *
+find_build_id(const struct dl_phdr_info *info, size_t *size)
+{
+	const Elf64_Phdr *pheaders = info->dlpi_phdr;
+
+	for (Elf64_Word i = 0; i < info->dlpi_phnum; ++i) {
+		if (pheaders[i].p_type != PT_NOTE)
+			continue;
+
+		size_t align = pheaders[i].p_align == 8 ? 8 : 4;
+		const unsigned char *note = (const unsigned char *)
+		    (info->dlpi_addr + pheaders[i].p_vaddr);
+		const unsigned char *end = note + pheaders[i].p_memsz;
+
+		while (note + sizeof(Elf64_Nhdr) <= end) {
+			const Elf64_Nhdr *nhdr = (const Elf64_Nhdr *)note;
+			const unsigned char *name = note + sizeof(*nhdr);
+			const unsigned char *desc = name +
+			    ((nhdr->n_namesz + align - 1) & ~(align - 1));
+			const unsigned char *next = desc +
+			    ((nhdr->n_descsz + align - 1) & ~(align - 1));
+
+			if (next > end)
+				break;
+
+			if (nhdr->n_type == NT_GNU_BUILD_ID &&
+			    nhdr->n_namesz == sizeof(ELF_NOTE_GNU) &&
+			    memcmp(name, ELF_NOTE_GNU,
+				sizeof(ELF_NOTE_GNU)) == 0) {
+				*size = nhdr->n_descsz;
+				return desc;
+			}
+
+			note = next;
+		}
+	}
+
+	return NULL;
+}
+
 static bool
 is_vdso(uintptr_t addr, const char *path)
 {
@@ -326,10 +413,11 @@ is_vdso(uintptr_t addr, const char *path)
  * Always skipped: [vdso], and the syscall_intercept library itself.
  * Besides these two, if patch_all_objs is true, everything object is
  * a target. When patch_all_objs is false, only libraries that are parts of
- * the glibc implementation are targeted, i.e.: libc and libpthread.
+ * the glibc implementation are targeted, i.e.: libc and libpthread -- and
+ * with patch_dlopen_objs, the dynamic loader, and every object loaded later.
  */
 static bool
-should_patch_object(uintptr_t addr, const char *path)
+should_patch_object(uintptr_t addr, const char *path, bool loaded_later)
 {
 	static uintptr_t self_addr;
 	if (self_addr == 0) {
@@ -371,9 +459,14 @@ should_patch_object(uintptr_t addr, const char *path)
 		return true;
 	}
 
-	if (patch_all_objs)
+	if (patch_all_objs || loaded_later)
 		return true;
 
+	if (patch_dlopen_objs && addr == loader_addr) {
+		debug_dump(" - dynamic loader found\n");
+		return true;
+	}
+
 	if (str_match(name, len, pthr)) {
 		debug_dump(" - libpthread found\n");
 		return true;
@@ -383,10 +476,38 @@ should_patch_object(uintptr_t addr, const char *path)
 	return false;
 }
 
+/*
+ * find_stale_desc
+ * An object found at the same address as one seen earlier means the
+ * earlier one was unloaded since then. The code kept for its patches is
+ * released. Returns the struct intercept_desc of the earlier object if it
+ * was never patched, to be reused for the new one.
+ */
+static struct intercept_desc *
+find_stale_desc(uintptr_t addr)
+{
+	for (unsigned i = 0; i < objs_count; ++i) {
+		struct intercept_desc *desc = objs + i;
+
+		if (desc->base_addr != (unsigned char *)addr)
+			continue;
+
+		if (i >= prepared_count) {
+			memset(desc, 0, sizeof(*desc));
+			return desc;
+		}
+
+		forget_patches(desc);
+	}
+
+	return NULL;
+}
+
 /*
  * analyze_object
- * Look at a library loaded into the current process, and determine as much as
- * possible about it. The disassembling, allocations are initiated here.
+ * Look at a library loaded into the current process, and decide whether
+ * it is to be patched. The disassembling is done later for all such
+ * objects at once, see find_syscalls_in_objects.
  *
  * This is a callback function, passed to dl_iterate_phdr(3).
  * data and size are just unused callback arguments.
@@ -405,10 +526,8 @@ should_patch_object(uintptr_t addr, const char *path)
  *
  */
 static int
-analyze_object(struct dl_phdr_info *info, size_t size, void *data)
+add_object(struct dl_phdr_info *info, bool loaded_later)
 {
-	(void) data;
-	(void) size;
 	const char *path;
 
 	debug_dump("analyze_object called on \"%s\" at 0x%016" PRIxPTR "\n",
@@ -419,20 +538,359 @@ analyze_object(struct dl_phdr_info *info, size_t size, void *data)
 
 	debug_dump("analyze %s\n", path);
 
-	if (!should_patch_object(info->dlpi_addr, path))
+	if (!should_patch_object(info->dlpi_addr, path, loaded_later))
 		return 0;
 
-	struct intercept_desc *patches = allocate_next_obj_desc();
+	struct intercept_desc *patches = find_stale_desc(info->dlpi_addr);
+
+	if (patches == NULL)
+		patches = allocate_next_obj_desc();
 
 	patches->base_addr = (unsigned char *)info->dlpi_addr;
 	patches->path = path;
-	find_syscalls(patches);
-	allocate_trampoline_table(patches);
-	create_patch_wrappers(patches);
+	patches->build_id = find_build_id(info, &patches->build_id_size);
+	patches->uses_live_patching = startup_done;
+
+	if (patch_dlopen_objs && info->dlpi_addr == loader_addr)
+		loader_path = path;
+
+	return 0;
+}
+
+static int
+analyze_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void) data;
+	(void) size;
+
+	return add_object(info, false);
+}
+
+/*
+ * Objects loaded after startup are recognized by their executable segments
+ * being mapped by the dynamic loader since the last look at the list of
+ * loaded objects. The loader maps all segments of an object before adding
+ * it to the list, so the mappings are remembered until the object appears,
+ * or the mapping is unmapped ( e.g. when dlopen fails ).
+ */
+#define MAX_FRESH_EXEC_MAPPINGS 0x10
+
+static struct range fresh_exec_mappings[MAX_FRESH_EXEC_MAPPINGS];
+static unsigned fresh_exec_mapping_count;
+
+static int loader_syscall_lock;
+
+static bool
+overlaps(const struct range *r, unsigned char *address, size_t size)
+{
+	return r->address < address + size && address < r->address + r->size;
+}
+
+static void
+remember_fresh_exec_mapping(unsigned char *address, size_t size)
+{
+	if (fresh_exec_mapping_count == MAX_FRESH_EXEC_MAPPINGS) {
+		/* forget the oldest one */
+		for (unsigned i = 1; i < MAX_FRESH_EXEC_MAPPINGS; ++i)
+			fresh_exec_mappings[i - 1] = fresh_exec_mappings[i];
+		--fresh_exec_mapping_count;
+	}
+
+	fresh_exec_mappings[fresh_exec_mapping_count++] =
+		(struct range){address, size};
+}
+
+/*
+ * forget_fresh_exec_mappings
+ * Removes the fresh mappings overlapping with the range, returns true if
+ * there were any.
+ */
+static bool
+forget_fresh_exec_mappings(unsigned char *address, size_t size)
+{
+	bool found = false;
+
+	for (unsigned i = 0; i < fresh_exec_mapping_count; ) {
+		if (overlaps(fresh_exec_mappings + i, address, size)) {
+			fresh_exec_mappings[i] = fresh_exec_mappings[
+			    --fresh_exec_mapping_count];
+			found = true;
+		} else {
+			++i;
+		}
+	}
+
+	return found;
+}
+
+/*
+ * analyze_new_object
+ * The dl_iterate_phdr callback used after startup, only considers objects
+ * with an executable segment in a fresh mapping.
+ */
+static int
+analyze_new_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void) data;
+	(void) size;
+	bool is_new = false;
+
+	for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+		const ElfW(Phdr) *phdr = info->dlpi_phdr + i;
+
+		if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_X) == 0)
+			continue;
+
+		if (forget_fresh_exec_mappings((unsigned char *)
+		    (info->dlpi_addr + phdr->p_vaddr), phdr->p_memsz))
+			is_new = true;
+	}
+
+	if (!is_new)
+		return 0;
+
+	return add_object(info, true);
+}
+
+/*
+ * patch_objects
+ * Disassembles the objects found since the last call, generates their
+ * wrappers, and activates the patches. After startup, the process might
+ * have other threads running while this is done -- see live_patch.c
+ */
+static void
+patch_objects(void)
+{
+	unsigned first = prepared_count;
+
+	if (first == objs_count)
+		return;
+
+	find_syscalls_in_objects(objs + first, objs_count - first);
+	for (unsigned i = first; i < objs_count; ++i)
+		create_patch_wrappers(objs + i);
+
+	mprotect_asm_wrappers();
+	for (unsigned i = first; i < objs_count; ++i) {
+		activate_patches(objs + i);
+		release_patching_tables(objs + i);
+	}
+
+	prepared_count = objs_count;
+}
+
+/*
+ * patch_new_objects
+ * Patches the objects loaded since the last call, the same way as the
+ * objects found at startup are patched in the intercept routine. While the
+ * patches are deactivated, the new objects are only remembered, and
+ * patched by intercept_activate.
+ * This runs on a new thread, see watch_loader_syscall.
+ */
+static void
+patch_new_objects(void *arg)
+{
+	(void) arg;
+
+	dl_iterate_phdr(analyze_new_object, NULL);
+
+	if (patches_active)
+		patch_objects();
+}
+
+/*
+ * watch_loader_syscall
+ * Called after each syscall of the dynamic loader, when patch_dlopen_objs
+ * is on. The mmap syscalls mapping executable segments of files are
+ * remembered, and once such a mapping is seen, the list of loaded objects
+ * is checked on each following syscall of the loader -- objects loaded
+ * using dlopen are patched this way after being added to the list, while
+ * the dynamic loader is still relocating them, before their constructors
+ * are called. The mprotect syscall making the RELRO segment of the new
+ * object read-only is the one expected to trigger this, thus mprotect is
+ * intercepted in the loader even if the syscall filter does not select it.
+ *
+ * The work is done on a new thread, as intercept_wrapper might not preserve
+ * the SIMD registers, while the code used for patching, e.g. capstone, is
+ * not restricted to general purpose registers.
+ *
+ * The loader issues these syscalls while holding its own lock, so they are
+ * not expected to happen on multiple threads at once. If they still do,
+ * the syscalls seen while another thread is busy here are ignored, rather
+ * than waiting for it. The new objects are also left for a later syscall,
+ * while intercept_activate, or intercept_deactivate is running.
+ */
+static void
+watch_loader_syscall(const struct patch_site *site,
+			const struct syscall_desc *desc, long result)
+{
+	if (site->containing_lib_path != loader_path)
+		return;
+
+	if (!spin_try_lock(&loader_syscall_lock))
+		return;
+
+	if (fresh_exec_mapping_count > 0 && spin_try_lock(&patching_lock)) {
+		run_on_new_thread(patch_new_objects, NULL);
+		spin_unlock(&patching_lock);
+	}
+
+	if (syscall_error_code(result) == 0) {
+		if (desc->nr == SYS_mmap && (desc->args[2] & PROT_EXEC) &&
+		    (int)desc->args[4] >= 0)
+			remember_fresh_exec_mapping((unsigned char *)result,
+			    (size_t)desc->args[1]);
+		else if (desc->nr == SYS_munmap)
+			forget_fresh_exec_mappings(
+			    (unsigned char *)desc->args[0],
+			    (size_t)desc->args[1]);
+	}
+
+	spin_unlock(&loader_syscall_lock);
+}
+
+/*
+ * is_loader_bypassed
+ * With patch_dlopen_objs, the patches of the dynamic loader are kept
+ * active while the rest is deactivated, to notice the objects loaded in the
+ * meantime. Its syscalls are not seen by the hooks in that case.
+ */
+static bool
+is_loader_bypassed(const struct patch_site *site)
+{
+	return site->containing_lib_path == loader_path &&
+	    !__atomic_load_n(&patches_active, __ATOMIC_RELAXED);
+}
+
+/*
+ * find_startup_objects
+ * Looks for the objects to patch among those loaded at startup -- or
+ * before the first call to intercept_activate in lazy mode.
+ */
+static void
+find_startup_objects(void)
+{
+	dl_iterate_phdr(analyze_object, NULL);
+	if (!libc_found)
+		xabort("libc not found");
+
+	objects_found = true;
+}
+
+/*
+ * set_object_active
+ * The dl_iterate_phdr callback used by intercept_activate, and
+ * intercept_deactivate. Only the objects still in the list of loaded objects
+ * are patched, the list does not change while this callback runs -- thus
+ * the code can not be unmapped while it is being written.
+ */
+static int
+set_object_active(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void) size;
+	bool activate = *(bool *)data;
+
+	for (unsigned i = 0; i < prepared_count; ++i) {
+		struct intercept_desc *desc = objs + i;
+
+		if (desc->base_addr != (unsigned char *)info->dlpi_addr)
+			continue;
+
+		if (activate)
+			activate_patches(desc);
+		else if (!(patch_dlopen_objs && desc->path == loader_path))
+			deactivate_patches(desc);
+	}
 
 	return 0;
 }
 
+static void
+activate_objects(void *arg)
+{
+	(void) arg;
+	bool activate = true;
+
+	if (!objects_found)
+		find_startup_objects();
+
+	dl_iterate_phdr(set_object_active, &activate);
+	patch_objects();
+
+	__atomic_store_n(&patches_active, true, __ATOMIC_RELAXED);
+}
+
+static void
+deactivate_objects(void *arg)
+{
+	(void) arg;
+	bool activate = false;
+
+	__atomic_store_n(&patches_active, false, __ATOMIC_RELAXED);
+
+	dl_iterate_phdr(set_object_active, &activate);
+
+	if (jit_enabled)
+		jit_deactivate_regions();
+}
+
+static void
+lock_patching(void)
+{
+	spin_lock(&patching_lock);
+}
+
+int
+intercept_activate(void)
+	__attribute__((visibility("default")));
+
+int
+intercept_deactivate(void)
+	__attribute__((visibility("default")));
+
+/*
+ * intercept_activate, intercept_deactivate
+ * The patching is done on a new thread, the same way as in
+ * watch_loader_syscall -- these might be called from a hook function.
+ */
+int
+intercept_activate(void)
+{
+	if (!startup_done)
+		return -1;
+
+	lock_patching();
+	run_on_new_thread(activate_objects, NULL);
+	spin_unlock(&patching_lock);
+
+	return 0;
+}
+
+int
+intercept_deactivate(void)
+{
+	if (!startup_done)
+		return -1;
+
+	lock_patching();
+	run_on_new_thread(deactivate_objects, NULL);
+	spin_unlock(&patching_lock);
+
+	return 0;
+}
+
+/*
+ * hook_registered
+ * Called when a hook function is registered -- in lazy mode, the first one
+ * activates the patches.
+ */
+void
+hook_registered(void)
+{
+	if (lazy_patching && !__atomic_load_n(&objects_found, __ATOMIC_RELAXED))
+		intercept_activate();
+}
+
 const char *cmdline;
 
 /*
@@ -458,18 +916,41 @@ intercept(int argc, char **argv)
 	vdso_addr = (void *)(uintptr_t)getauxval(AT_SYSINFO_EHDR);
 	debug_dumps_on = getenv("INTERCEPT_DEBUG_DUMP") != NULL;
 	patch_all_objs = (getenv("INTERCEPT_ALL_OBJS") != NULL);
+	patch_dlopen_objs = (getenv("INTERCEPT_DLOPEN_OBJS") != NULL);
+	lazy_patching = (getenv("INTERCEPT_LAZY") != NULL);
+	loader_addr = (uintptr_t)getauxval(AT_BASE);
+	if (loader_addr == 0)
+		patch_dlopen_objs = false;
+	scan_windows = (getenv("INTERCEPT_SCAN_WINDOWS") != NULL);
+	syscall_filter_setup(getenv("INTERCEPT_SYSCALL_FILTER"));
+	dispatch_setup(getenv("INTERCEPT_USER_DISPATCH"));
+	jit_setup(getenv("INTERCEPT_JIT"));
+	live_patch_setup();
+	if (patch_dlopen_objs) {
+		syscall_filter_require(SYS_mmap);
+		syscall_filter_require(SYS_munmap);
+		syscall_filter_require(SYS_mprotect);
+	}
+	plan_cache_setup(getenv("INTERCEPT_PLAN_CACHE"));
+	workers_setup(getenv("INTERCEPT_WORKERS"));
 	intercept_setup_log(getenv("INTERCEPT_LOG"),
 			getenv("INTERCEPT_LOG_TRUNC"));
 	log_header();
 	init_patcher();
 
-	dl_iterate_phdr(analyze_object, NULL);
-	if (!libc_found)
-		xabort("libc not found");
+	if (!lazy_patching) {
+		find_startup_objects();
+		patch_objects();
+		patches_active = true;
+	}
 
-	mprotect_asm_wrappers();
 	for (unsigned i = 0; i < objs_count; ++i)
-		activate_patches(objs + i);
+		objs[i].uses_live_patching = true;
+
+	if (dispatch_enabled)
+		dispatch_enter(patches_active);
+
+	startup_done = true;
 }
 
 /*
@@ -570,6 +1051,194 @@ get_syscall_in_context(struct context *context, struct syscall_desc *sys)
 	sys->args[5] = context->r9;
 }
 
+/*
+ * set_syscall_in_context
+ * The inverse of get_syscall_in_context: stores the syscall arguments
+ * into the saved registers, which are restored by the asm wrapper before
+ * executing a syscall in its original context. The arguments might have
+ * been modified by intercept_hook_point_desc.
+ */
+static void
+set_syscall_in_context(struct context *context, const struct syscall_desc *sys)
+{
+	context->rdi = sys->args[0];
+	context->rsi = sys->args[1];
+	context->rdx = sys->args[2];
+	context->r10 = sys->args[3];
+	context->r8 = sys->args[4];
+	context->r9 = sys->args[5];
+}
+
+/*
+ * get_context_view
+ * Fills the struct passed to intercept_hook_point_context. This is only
+ * done when there is such a hook, otherwise NULL is returned.
+ */
+static const struct intercept_context *
+get_context_view(const struct context *context,
+		const struct syscall_desc *sys, struct intercept_context *view)
+{
+	if (__atomic_load_n(&intercept_hook_point_context,
+	    __ATOMIC_RELAXED) == NULL)
+		return NULL;
+
+	view->size = sizeof(*view);
+	view->syscall.nr = sys->nr;
+	for (unsigned i = 0; i < ARRAY_SIZE(sys->args); ++i)
+		view->syscall.args[i] = sys->args[i];
+	view->site = context->site;
+	view->rip = (const void *)context->rip;
+	view->object_path = context->site->containing_lib_path;
+	view->object_offset = context->site->syscall_offset;
+	view->rsp = context->rsp;
+	view->rbp = context->rbp;
+	view->rbx = context->rbx;
+	view->r12 = context->r12;
+	view->r13 = context->r13;
+	view->r14 = context->r14;
+	view->r15 = context->r15;
+
+	return view;
+}
+
+/*
+ * watch_jit_syscall_before, watch_jit_syscall_after
+ * Called around each syscall executed by intercept_routine with
+ * INTERCEPT_JIT set, see jit.c. Unlike in watch_loader_syscall, the
+ * syscalls of other threads are waited for while patching -- any thread
+ * might be changing the code generated.
+ */
+static void
+watch_jit_syscall_before(const struct syscall_desc *desc)
+{
+	struct range range;
+
+	if (!jit_region_changes(desc, &range))
+		return;
+
+	lock_patching();
+	run_on_new_thread(jit_forget_regions, &range);
+	spin_unlock(&patching_lock);
+}
+
+static void
+watch_jit_syscall_after(const struct syscall_desc *desc, long result)
+{
+	struct range range;
+
+	if (!jit_code_added(desc, result, &range))
+		return;
+
+	lock_patching();
+	if (__atomic_load_n(&patches_active, __ATOMIC_RELAXED))
+		run_on_new_thread(jit_patch_region, &range);
+	spin_unlock(&patching_lock);
+}
+
+/*
+ * execute_syscall -- executes a syscall using syscall_no_intercept, or
+ * using dispatch_syscall when Syscall User Dispatch is on. The syscalls
+ * changing code generated at runtime are watched with INTERCEPT_JIT. The
+ * handler of SIGTRAP is not changed, see live_patch.c
+ */
+static long
+execute_syscall(const struct syscall_desc *desc)
+{
+	long result;
+
+	if (jit_enabled)
+		watch_jit_syscall_before(desc);
+
+	if (desc->nr == SYS_rt_sigaction && desc->args[0] == SIGTRAP)
+		result = replace_sigtrap_action(desc->args[1],
+				desc->args[2], desc->args[3]);
+	else if (!dispatch_enabled || !dispatch_syscall(desc, &result))
+		result = syscall_no_intercept(desc->nr,
+				desc->args[0],
+				desc->args[1],
+				desc->args[2],
+				desc->args[3],
+				desc->args[4],
+				desc->args[5]);
+
+	if (jit_enabled)
+		watch_jit_syscall_after(desc, result);
+
+	return result;
+}
+
+/*
+ * forward_syscall
+ * The part of intercept_routine after calling the hooks, which might have
+ * modified the syscall described by desc -- including the syscall number.
+ * Syscalls that can't be executed on the stack of this routine are
+ * executed by the asm wrapper in the original context, using the possibly
+ * modified arguments.
+ */
+static struct wrapper_ret
+forward_syscall(struct context *context, struct syscall_desc *desc,
+		int forward_to_kernel, long result)
+{
+	if (desc->nr == SYS_vfork || desc->nr == SYS_rt_sigreturn) {
+		/* can't handle these syscalls the normal way */
+		set_syscall_in_context(context, desc);
+		if (dispatch_enabled)
+			dispatch_original_context(context->site, desc->nr,
+			    context->rsp);
+
+		return (struct wrapper_ret){ .rax = desc->nr, .rdx = 0 };
+	}
+
+	if (forward_to_kernel) {
+		/*
+		 * The clone syscall's arg1 is a pointer to a memory region
+		 * that serves as the stack space of a new child thread.
+		 * If this is zero, the child thread uses the same address
+		 * as stack pointer as the parent does (e.g.: a copy of
+		 * of the memory area after fork).
+		 *
+		 * The code at clone_wrapper only returns to this routine
+		 * in the parent thread. In the child thread, it calls
+		 * the clone_child_intercept_routine instead, executing
+		 * it on the new child threads stack, then returns to libc.
+		 */
+		if (desc->nr == SYS_clone && desc->args[1] != 0) {
+			set_syscall_in_context(context, desc);
+			if (dispatch_enabled)
+				dispatch_original_context(context->site,
+				    desc->nr, context->rsp);
+
+			return (struct wrapper_ret){
+				.rax = desc->nr, .rdx = 2 };
+		}
+
+		/*
+		 * The clone3 syscall's stack is specified in a struct
+		 * pointed to by arg0. There is no need to look at it, such a
+		 * clone3 syscall is always executed in the original context.
+		 */
+		if (desc->nr == SYS_clone3) {
+			set_syscall_in_context(context, desc);
+			if (dispatch_enabled)
+				dispatch_original_context(context->site,
+				    desc->nr, context->rsp);
+
+			return (struct wrapper_ret){
+				.rax = desc->nr, .rdx = 2 };
+		}
+
+		result = execute_syscall(desc);
+
+		call_exit_hooks(desc, &result);
+	}
+
+	watch_loader_syscall(context->site, desc, result);
+
+	intercept_log_syscall(context->site, desc, KNOWN, result);
+
+	return (struct wrapper_ret){ .rax = result, .rdx = 1 };
+}
+
 /*
  * intercept_routine(...)
  * This is the function called from the asm wrappers,
@@ -607,76 +1276,187 @@ intercept_routine(struct context *context)
 	long result;
 	int forward_to_kernel = true;
 	struct syscall_desc desc;
-	struct patch_desc *patch = context->patch_desc;
+	const struct patch_site *site = context->site;
+
+	if (dispatch_enabled)
+		dispatch_enter(__atomic_load_n(&patches_active,
+				__ATOMIC_RELAXED));
 
 	get_syscall_in_context(context, &desc);
 
 	if (handle_magic_syscalls(&desc, &result) == 0)
 		return (struct wrapper_ret){.rax = result, .rdx = 1 };
 
-	intercept_log_syscall(patch, &desc, UNKNOWN, 0);
+	if (is_loader_bypassed(site)) {
+		result = syscall_no_intercept(desc.nr,
+				desc.args[0],
+				desc.args[1],
+				desc.args[2],
+				desc.args[3],
+				desc.args[4],
+				desc.args[5]);
 
-	if (intercept_hook_point != NULL)
-		forward_to_kernel = intercept_hook_point(desc.nr,
-		    desc.args[0],
-		    desc.args[1],
-		    desc.args[2],
-		    desc.args[3],
-		    desc.args[4],
-		    desc.args[5],
-		    &result);
+		watch_loader_syscall(site, &desc, result);
 
-	if (desc.nr == SYS_vfork || desc.nr == SYS_rt_sigreturn) {
-		/* can't handle these syscalls the normal way */
-		return (struct wrapper_ret){.rax = context->rax, .rdx = 0 };
+		return (struct wrapper_ret){ .rax = result, .rdx = 1 };
 	}
 
+	intercept_log_syscall(site, &desc, UNKNOWN, 0);
+
+	/*
+	 * Syscalls not selected by the syscall filter only get here while
+	 * logging, they are not forwarded to intercept_hook_point.
+	 */
+	struct intercept_context view;
+
+	forward_to_kernel = call_hooks(&desc,
+			get_context_view(context, &desc, &view), &result);
+
+	return forward_syscall(context, &desc, forward_to_kernel, result);
+}
+
+/*
+ * intercept_routine_known_nr
+ * A leaner version of intercept_routine, called from the asm wrappers
+ * created for syscall instructions with a syscall number known at patch
+ * time ( see uses_known_nr_wrapper in patcher.c ). These are never
+ * used for syscalls that need special treatment in intercept_routine,
+ * and are only called for syscalls selected by the syscall filter. Thus
+ * there is no need to check for magic syscalls, clone, vfork, etc...
+ * unless a hook changes the syscall number. Only while logging, the
+ * generic intercept_routine is used.
+ */
+struct wrapper_ret
+intercept_routine_known_nr(struct context *context)
+{
+	long result;
+	struct syscall_desc desc;
+
+	if (intercept_log_is_enabled() || is_loader_bypassed(context->site))
+		return intercept_routine(context);
+
+	if (dispatch_enabled)
+		dispatch_enter(__atomic_load_n(&patches_active,
+				__ATOMIC_RELAXED));
+
+	get_syscall_in_context(context, &desc);
+
+	struct intercept_context view;
+	int forward_to_kernel = call_hooks(&desc,
+			get_context_view(context, &desc, &view), &result);
+
+	/*
+	 * A hook might have changed the syscall number to one that needs
+	 * special treatment, e.g.: clone with a new stack, or vfork.
+	 */
+	if (desc.nr != (int)context->rax)
+		return forward_syscall(context, &desc, forward_to_kernel,
+				result);
+
 	if (forward_to_kernel) {
-		/*
-		 * The clone syscall's arg1 is a pointer to a memory region
-		 * that serves as the stack space of a new child thread.
-		 * If this is zero, the child thread uses the same address
-		 * as stack pointer as the parent does (e.g.: a copy of
-		 * of the memory area after fork).
-		 *
-		 * The code at clone_wrapper only returns to this routine
-		 * in the parent thread. In the child thread, it calls
-		 * the clone_child_intercept_routine instead, executing
-		 * it on the new child threads stack, then returns to libc.
-		 */
-		if (desc.nr == SYS_clone && desc.args[1] != 0)
-			return (struct wrapper_ret){
-				.rax = context->rax, .rdx = 2 };
-		else
-			result = syscall_no_intercept(desc.nr,
-					desc.args[0],
-					desc.args[1],
-					desc.args[2],
-					desc.args[3],
-					desc.args[4],
-					desc.args[5]);
+		result = execute_syscall(&desc);
+
+		call_exit_hooks(&desc, &result);
 	}
 
-	intercept_log_syscall(patch, &desc, KNOWN, result);
+	watch_loader_syscall(context->site, &desc, result);
 
 	return (struct wrapper_ret){ .rax = result, .rdx = 1 };
 }
 
 /*
  * intercept_routine_post_clone
- * The routine called by an assembly wrapper when a clone syscall returns zero,
- * and a new stack pointer is used in the child thread.
+ * The routine called by an assembly wrapper after executing a clone syscall
+ * in its original context, both in the parent, and in the child thread
+ * ( where a new stack pointer is used ).
+ *
+ * At this point RAX contains the result of the syscall, and the syscall number
+ * is only known if the patched syscall instruction is never used for anything
+ * else ( see check_syscall_numbers in intercept_desc.c ), as in the clone
+ * and clone3 functions in libc. The exit hooks are only called in that case.
  */
 struct wrapper_ret
 intercept_routine_post_clone(struct context *context)
 {
-	if (context->rax == 0) {
+	long result = context->rax;
+
+	if (dispatch_enabled)
+		dispatch_enter(__atomic_load_n(&patches_active,
+				__ATOMIC_RELAXED));
+
+	if (result == 0) {
 		if (intercept_hook_point_clone_child != NULL)
 			intercept_hook_point_clone_child();
 	} else {
 		if (intercept_hook_point_clone_parent != NULL)
-			intercept_hook_point_clone_parent(context->rax);
+			intercept_hook_point_clone_parent(result);
 	}
 
-	return (struct wrapper_ret){.rax = context->rax, .rdx = 1 };
+	/*
+	 * The syscall number known at patch time is not the one executed,
+	 * if a hook changed it to clone.
+	 */
+	if (context->site->syscall_nr == SYS_clone ||
+	    context->site->syscall_nr == SYS_clone3) {
+		struct syscall_desc desc;
+
+		get_syscall_in_context(context, &desc);
+		desc.nr = (int)context->site->syscall_nr;
+		call_exit_hooks(&desc, &result);
+	}
+
+	return (struct wrapper_ret){.rax = result, .rdx = 1 };
+}
+
+/*
+ * intercept_routine_dispatched
+ * Called by the SIGSYS handler in syscall_dispatch.c, with the registers
+ * saved at a syscall instruction that is not patched. These are passed to
+ * intercept_routine the same way the asm wrappers pass them. Returns false
+ * if the syscall instruction must be executed again, in its original
+ * context -- with the arguments updated in the saved registers.
+ * While the patches are deactivated, the setting is turned off for the
+ * thread, and the syscall is executed without calling the hooks.
+ */
+bool
+intercept_routine_dispatched(const struct patch_site *site, greg_t *regs)
+{
+	struct context context;
+
+	if (!__atomic_load_n(&patches_active, __ATOMIC_RELAXED)) {
+		dispatch_thread_stop();
+		return false;
+	}
+
+	context.site = site;
+	context.rip = (long)site->syscall_addr;
+	context.r15 = regs[REG_R15];
+	context.r14 = regs[REG_R14];
+	context.r13 = regs[REG_R13];
+	context.r12 = regs[REG_R12];
+	context.r10 = regs[REG_R10];
+	context.r9 = regs[REG_R9];
+	context.r8 = regs[REG_R8];
+	context.rsp = regs[REG_RSP];
+	context.rbp = regs[REG_RBP];
+	context.rdi = regs[REG_RDI];
+	context.rsi = regs[REG_RSI];
+	context.rbx = regs[REG_RBX];
+	context.rdx = regs[REG_RDX];
+	context.rax = regs[REG_RAX];
+
+	struct wrapper_ret ret = intercept_routine(&context);
+
+	regs[REG_RAX] = ret.rax;
+	if (ret.rdx == 1)
+		return true;
+
+	regs[REG_RDI] = context.rdi;
+	regs[REG_RSI] = context.rsi;
+	regs[REG_RDX] = context.rdx;
+	regs[REG_R10] = context.r10;
+	regs[REG_R8] = context.r8;
+	regs[REG_R9] = context.r9;
+
+	return false;
 }
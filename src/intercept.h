@@ -38,10 +38,14 @@
 #define INTERCEPT_INTERCEPT_H
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <elf.h>
 #include <unistd.h>
 #include <dlfcn.h>
 #include <link.h>
+#include <signal.h>
+#include <syscall.h>
+#include <ucontext.h>
 
 #include "disasm_wrapper.h"
 
@@ -62,6 +66,11 @@ void intercept_patch_with_postfix(unsigned char *syscall_addr,
 
 #define INTERCEPTOR_EXIT_CODE 111
 
+/* missing from old kernel headers */
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+
 __attribute__((noreturn)) void xabort_errno(int error_code, const char *msg);
 
 __attribute__((noreturn)) void xabort(const char *msg);
@@ -78,6 +87,68 @@ struct range {
 	size_t size;
 };
 
+/*
+ * patch_site -- what is needed about a patched syscall instruction while
+ * intercepting syscalls. The wrapper of the syscall refers to this, and it
+ * is seen by hooks as the site of the syscall ( see struct
+ * intercept_context ). These records are kept packed together, while
+ * the struct patch_desc instances they are created from are released once
+ * the patches are activated.
+ */
+struct patch_site {
+	/*
+	 * the original syscall instruction -- this must be the first field,
+	 * intercept_wrapper loads it as the return address seen by unwinders
+	 */
+	unsigned char *syscall_addr;
+
+	const char *containing_lib_path;
+
+	/* the offset of the original syscall instruction */
+	uint32_t syscall_offset;
+
+	/* the syscall number if known, -1 otherwise, see struct patch_desc */
+	int32_t syscall_nr;
+};
+
+/*
+ * Overwriting code while other threads might be executing it, see
+ * live_patch.c
+ */
+struct code_write {
+	unsigned char *address;
+
+	/* where a thread reaching address continues while this is written */
+	unsigned char *redirect;
+
+	const unsigned char *code;
+	unsigned length;
+};
+
+struct resume_point {
+	unsigned char *address;
+	unsigned char *target;
+};
+
+struct resume_block;
+
+/*
+ * A patch written at startup, that can not be written again the same way
+ * while other threads are running, see keep_live_patchable in patcher.c
+ */
+struct live_fixup {
+	const struct patch_site *site;
+	unsigned write_index;
+
+	/* the number of bytes to move the jump by, zero to drop it */
+	unsigned skip;
+};
+
+/*
+ * The patches are written in rounds, see collect_writes in patcher.c
+ */
+#define PATCH_ROUNDS 3
+
 /*
  * The patch_list array stores some information on
  * whereabouts of patches made to glibc.
@@ -101,6 +172,15 @@ struct patch_desc {
 	/* the new asm wrapper created */
 	unsigned char *asm_wrapper;
 
+	/*
+	 * where the wrapper continues after the syscall, i.e. the copy
+	 * of the following instruction, or the jump to return_address
+	 */
+	unsigned char *wrapper_after_syscall;
+
+	/* the record the asm wrapper refers to */
+	struct patch_site *site;
+
 	/* the first byte overwritten in the code */
 	unsigned char *dst_jmp_patch;
 
@@ -124,6 +204,17 @@ struct patch_desc {
 	bool uses_nop_trampoline;
 
 	struct range nop_trampoline;
+
+	/*
+	 * The syscall number, if it is known without executing the code,
+	 * i.e. it is loaded into RAX as a constant in the same basic block
+	 * as the syscall instruction. It is -1 when it is not known.
+	 * The syscall_nr_distance field is the number of bytes between
+	 * the end of the instruction loading the syscall number, and the
+	 * syscall instruction.
+	 */
+	long syscall_nr;
+	unsigned syscall_nr_distance;
 };
 
 void patch_apply(struct patch_desc *patch);
@@ -142,16 +233,57 @@ struct section_list {
 	Elf64_Shdr headers[0x10];
 };
 
+/*
+ * A part of a text section, disassembled separately from the rest of it,
+ * possibly in parallel with other parts -- see split_text in
+ * intercept_desc.c
+ * Disassembling starts at begin, but patches and NOPs are only collected
+ * from record_begin, up to end ( inclusive ). The instructions between begin
+ * and record_begin only serve as preceding instructions of a syscall near
+ * record_begin.
+ */
+struct text_part {
+	unsigned char *begin;
+	unsigned char *record_begin;
+	unsigned char *end;
+
+	struct patch_desc *items;
+	unsigned count;
+	unsigned max_count;
+
+	struct range *nop_table;
+	size_t nop_count;
+	size_t max_nop_count;
+};
+
 struct intercept_desc {
 
 	/*
-	 * uses_trampoline_table - For now this is decided runtime
-	 * to make it easy to compare the operation of the library
-	 * with and without it. If it is OK, we can remove this
-	 * flag, and just always use the trampoline table.
+	 * uses_trampoline_table - Jump from the patched text to the
+	 * asm wrappers via a table of absolute jumps. Since the wrappers
+	 * are generated close to the text (see create_wrapper in patcher.c),
+	 * this is only used by the asm_pattern tests.
 	 */
 	bool uses_trampoline_table;
 
+	/*
+	 * uses_live_patching - Other threads might be running while
+	 * the patches are activated, or deactivated, see live_patch.c
+	 */
+	bool uses_live_patching;
+
+	/*
+	 * is_jit_region - the text is code generated at runtime, not part
+	 * of any object, see jit.c
+	 */
+	bool is_jit_region;
+
+	/*
+	 * is_active - the patches are currently written into the text,
+	 * see activate_patches, and deactivate_patches in patcher.c
+	 */
+	bool is_active;
+
 	/*
 	 * delta between vmem addresses and addresses in symbol tables,
 	 * non-zero for dynamic objects
@@ -161,6 +293,13 @@ struct intercept_desc {
 	/* where the object is in fs */
 	const char *path;
 
+	/*
+	 * The GNU build-id of the object, pointing into its loaded
+	 * notes, NULL if it has none.
+	 */
+	const unsigned char *build_id;
+	size_t build_id_size;
+
 	/*
 	 * Some sections of the library from which information
 	 * needs to be extracted.
@@ -187,10 +326,37 @@ struct intercept_desc {
 	unsigned char *text_end;
 
 
+	/*
+	 * The patches, these are only used while patching, and released
+	 * by release_patching_tables.
+	 */
 	struct patch_desc *items;
 	unsigned count;
+	unsigned max_count;
+
+	/*
+	 * The number of syscall instructions left unpatched for lack of
+	 * space around them, see create_patch_wrappers
+	 */
+	unsigned unpatched_count;
+
+	/*
+	 * Jump destinations around syscall instructions, see has_jump,
+	 * and allocate_jump_blocks in intercept_desc.c
+	 */
+	uint32_t *jump_blocks;
+	size_t jump_block_count;
+	uint32_t tracked_block_count;
 	unsigned char *jump_table;
 
+	/*
+	 * Sorted offsets in the text section known to be instruction
+	 * boundaries, used while splitting the text section into parts.
+	 */
+	uint32_t *boundaries;
+	size_t boundary_count;
+	size_t max_boundary_count;
+
 	size_t nop_count;
 	size_t max_nop_count;
 	struct range *nop_table;
@@ -199,34 +365,185 @@ struct intercept_desc {
 	size_t trampoline_table_size;
 
 	unsigned char *next_trampoline;
+
+	/*
+	 * The code written to the text by activate_patches, kept after
+	 * patching, to be able to restore the original code, and to write
+	 * the patches again later. The writes are ordered by the round they
+	 * are done in, see collect_writes in patcher.c. These, and the
+	 * bytes written all reside in a single mapping of
+	 * patched_code_size bytes.
+	 */
+	struct code_write *writes;
+	unsigned write_count;
+	unsigned round_ends[PATCH_ROUNDS];
+	size_t patched_code_size;
+
+	struct live_fixup *live_fixups;
+	unsigned live_fixup_count;
+
+	/* the resume points of the patches, see add_resume_points */
+	struct resume_block *resume_block;
+
+	/*
+	 * The state of find_syscalls between its steps: the object file,
+	 * mapped read-only, and the parts of the text section yet to be
+	 * disassembled.
+	 */
+	int fd;
+	const unsigned char *file;
+	size_t file_size;
+	struct text_part *parts;
+	unsigned part_count;
 };
 
 bool has_jump(const struct intercept_desc *desc, unsigned char *addr);
 void mark_jump(const struct intercept_desc *desc, const unsigned char *addr);
+void track_jumps_around(struct intercept_desc *desc, const unsigned char *addr);
+void allocate_jump_table(struct intercept_desc *desc);
+void release_patching_tables(struct intercept_desc *desc);
 
-void allocate_trampoline_table(struct intercept_desc *desc);
+unsigned char *find_unmapped_near(const struct intercept_desc *desc,
+					size_t size, size_t align);
 void find_syscalls(struct intercept_desc *desc);
+void find_syscalls_in_objects(struct intercept_desc *descs, unsigned count);
+void find_syscalls_in_region(struct intercept_desc *desc);
+
+/*
+ * Only disassemble the code around syscall instructions,
+ * set from INTERCEPT_SCAN_WINDOWS -- see crawl_text_windows
+ */
+extern bool scan_windows;
+
+/*
+ * Storing the results of find_syscalls in the directory specified
+ * by INTERCEPT_PLAN_CACHE -- see plan_cache.c
+ */
+void plan_cache_setup(const char *dir);
+bool plan_cache_load(struct intercept_desc *desc, int fd);
+void plan_cache_store(const struct intercept_desc *desc, int fd);
+
+/*
+ * Running find_syscalls_in_objects on multiple threads, the number of
+ * threads set from INTERCEPT_WORKERS -- see workers.c
+ */
+void workers_setup(const char *count);
+void run_workers(void (*func)(void *arg, unsigned index), void *arg,
+		unsigned count);
+void run_on_new_thread(void (*func)(void *arg), void *arg);
+
+void live_patch_setup(void);
+void live_patch(const struct code_write *writes, unsigned count);
+long replace_sigtrap_action(long new, long old, long set_size);
+struct resume_block *add_resume_points(const struct resume_point *points,
+		unsigned count);
+void remove_resume_points(struct resume_block *block);
+
+/* the struct sigaction expected by the rt_sigaction syscall */
+struct kernel_sigaction {
+	union {
+		void (*handler)(int);
+		void (*sigaction)(int, siginfo_t *, void *);
+	} u;
+	unsigned long flags;
+	void (*restorer)(void);
+	uint64_t mask;
+};
+
+#ifndef SA_RESTORER
+#define SA_RESTORER 0x04000000
+#endif
+
+/* see util.S */
+void intercept_restore_rt(void);
+
+/*
+ * Intercepting the syscall instructions not patched using Syscall User
+ * Dispatch, enabled by INTERCEPT_USER_DISPATCH -- see syscall_dispatch.c
+ */
+extern bool dispatch_enabled;
+
+void dispatch_setup(const char *value);
+void dispatch_register_site(const struct patch_site *site);
+void dispatch_enter(bool patches_active);
+void dispatch_thread_stop(void);
+void dispatch_original_context(const struct patch_site *site,
+				long syscall_number, long rsp);
+bool dispatch_syscall(const struct syscall_desc *desc, long *result);
+bool intercept_routine_dispatched(const struct patch_site *site,
+				greg_t *regs);
+
+/*
+ * Patching code generated at runtime, enabled by INTERCEPT_JIT -- see
+ * jit.c. The routines taking a struct range are run on a new thread,
+ * while holding the patching lock in intercept.c
+ */
+extern bool jit_enabled;
+
+void jit_setup(const char *value);
+bool jit_region_changes(const struct syscall_desc *desc, struct range *range);
+bool jit_code_added(const struct syscall_desc *desc, long result,
+			struct range *range);
+void jit_forget_regions(void *range);
+void jit_patch_region(void *range);
+void jit_deactivate_regions(void);
 
 void init_patcher(void);
 void create_patch_wrappers(struct intercept_desc *desc);
 void mprotect_asm_wrappers(void);
+size_t asm_wrapper_space(void);
 
 /*
- * Actually overwrite instructions in glibc.
+ * Actually overwrite instructions in glibc -- and restore them, see
+ * intercept_deactivate.
  */
 void activate_patches(struct intercept_desc *desc);
+void deactivate_patches(struct intercept_desc *desc);
+void forget_patches(struct intercept_desc *desc);
 
 #define SYSCALL_INS_SIZE 2
 #define JUMP_INS_SIZE 5
 #define CALL_OPCODE 0xe8
 #define JMP_OPCODE 0xe9
 #define SHORT_JMP_OPCODE 0xeb
+#define SHORT_JNZ_OPCODE 0x75
+#define JRCXZ_OPCODE 0xe3
 #define PUSH_IMM_OPCODE 0x68
 #define NOP_OPCODE 0x90
 #define INT3_OPCODE 0xCC
 
 bool is_overwritable_nop(const struct intercept_disasm_result *ins);
 
+/*
+ * The syscall filter -- see syscall_filter.c
+ * The size must match the bound checked in intercept_template.S
+ */
+#define SYSCALL_FILTER_SIZE 512
+
+extern uint64_t syscall_filter_bitmap[SYSCALL_FILTER_SIZE / 64];
+
+bool is_syscall_selected(long syscall_number);
+void syscall_filter_select_all(bool all);
+void syscall_filter_set_registered(long syscall_number, bool registered);
+void syscall_filter_require(long syscall_number);
+void syscall_filter_require_all(void);
+void syscall_filter_setup(const char *spec);
+bool should_patch_syscall(long syscall_number);
+
+/*
+ * call_hooks, call_exit_hooks -- forward a syscall to the hook functions,
+ * see hook_registry.c
+ */
+struct intercept_context;
+int call_hooks(struct syscall_desc *desc,
+		const struct intercept_context *context, long *result);
+void call_exit_hooks(const struct syscall_desc *desc, long *result);
+
+/*
+ * hook_registered -- activates the patches in lazy mode, see intercept.c
+ */
+void hook_registered(void);
+
 void create_jump(unsigned char opcode, unsigned char *from, void *to);
 
 const char *cmdline;
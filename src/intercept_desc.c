@@ -37,14 +37,17 @@
 #include <stdint.h>
 #include <inttypes.h>
 #include <string.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <emmintrin.h>
 
 #include "intercept.h"
 #include "intercept_util.h"
 #include "disasm_wrapper.h"
 
+bool scan_windows;
+
 /*
  * open_orig_file
  *
@@ -69,6 +72,59 @@ open_orig_file(const struct intercept_desc *desc)
 	return fd;
 }
 
+/*
+ * map_orig_file
+ * The file is mapped read-only as a whole, and the section headers, symbol
+ * tables, relocation tables are examined in place, without copying them.
+ * Only the pages of the file actually looked at are read from the FS.
+ */
+static void
+map_orig_file(struct intercept_desc *desc)
+{
+	struct stat st;
+
+	desc->fd = open_orig_file(desc);
+
+	xabort_on_syserror(syscall_no_intercept(SYS_fstat, desc->fd, &st),
+	    "fstat");
+
+	if (st.st_size < (off_t)sizeof(Elf64_Ehdr))
+		xabort("invalid ELF file");
+
+	desc->file_size = (size_t)st.st_size;
+
+	long addr = syscall_no_intercept(SYS_mmap, NULL, desc->file_size,
+				PROT_READ, MAP_PRIVATE, desc->fd, (off_t)0);
+
+	xabort_on_syserror(addr, "mmap of ELF file");
+
+	desc->file = (const unsigned char *)addr;
+}
+
+/*
+ * unmap_orig_file -- undo map_orig_file, closing the file
+ */
+static void
+unmap_orig_file(struct intercept_desc *desc)
+{
+	xmunmap((void *)desc->file, desc->file_size);
+	syscall_no_intercept(SYS_close, desc->fd);
+	desc->file = NULL;
+	desc->fd = -1;
+}
+
+/*
+ * file_part -- returns a pointer to size bytes at offset in the mapped file
+ */
+static const void *
+file_part(const struct intercept_desc *desc, uint64_t offset, uint64_t size)
+{
+	if (offset > desc->file_size || size > desc->file_size - offset)
+		xabort("invalid ELF file");
+
+	return desc->file + offset;
+}
+
 static void
 add_table_info(struct section_list *list, const Elf64_Shdr *header)
 {
@@ -102,31 +158,32 @@ add_text_info(struct intercept_desc *desc, const Elf64_Shdr *header,
  * See: man elf
  */
 static void
-find_sections(struct intercept_desc *desc, int fd)
+find_sections(struct intercept_desc *desc)
 {
-	Elf64_Ehdr elf_header;
+	const Elf64_Ehdr *elf_header = file_part(desc, 0, sizeof(*elf_header));
 
 	desc->symbol_tables.count = 0;
 	desc->rela_tables.count = 0;
 
-	xread(fd, &elf_header, sizeof(elf_header));
+	const Elf64_Shdr *sec_headers = file_part(desc, elf_header->e_shoff,
+	    elf_header->e_shnum * sizeof(Elf64_Shdr));
 
-	Elf64_Shdr sec_headers[elf_header.e_shnum];
+	if (elf_header->e_shstrndx >= elf_header->e_shnum)
+		xabort("invalid ELF file");
 
-	xlseek(fd, elf_header.e_shoff, SEEK_SET);
-	xread(fd, sec_headers, elf_header.e_shnum * sizeof(Elf64_Shdr));
-
-	char sec_string_table[sec_headers[elf_header.e_shstrndx].sh_size];
-
-	xlseek(fd, sec_headers[elf_header.e_shstrndx].sh_offset, SEEK_SET);
-	xread(fd, sec_string_table,
-	    sec_headers[elf_header.e_shstrndx].sh_size);
+	const Elf64_Shdr *strings = sec_headers + elf_header->e_shstrndx;
+	const char *sec_string_table =
+	    file_part(desc, strings->sh_offset, strings->sh_size);
 
 	bool text_section_found = false;
 
-	for (Elf64_Half i = 0; i < elf_header.e_shnum; ++i) {
+	for (Elf64_Half i = 0; i < elf_header->e_shnum; ++i) {
 		const Elf64_Shdr *section = &sec_headers[i];
-		char *name = sec_string_table + section->sh_name;
+
+		if (section->sh_name >= strings->sh_size)
+			xabort("invalid ELF file");
+
+		const char *name = sec_string_table + section->sh_name;
 
 		debug_dump("looking at section: \"%s\" type: %ld\n",
 		    name, (long)section->sh_type);
@@ -148,21 +205,130 @@ find_sections(struct intercept_desc *desc, int fd)
 }
 
 /*
- * allocate_jump_table
- *
- * Allocates a bitmap, where each bit represents a unique address in
- * the text section.
+ * The jump table -- see has_jump -- has a bit for each byte of the text
+ * section, but only in the blocks of JUMP_BLOCK_SIZE bytes around syscall
+ * instructions, as jump destinations are only of interest there. The
+ * desc->jump_blocks array maps each block of the text section to its bitmap
+ * in desc->jump_table, zero meaning that the block is not tracked.
+ */
+#define JUMP_BLOCK_SHIFT 10
+#define JUMP_BLOCK_SIZE ((uint64_t)1 << JUMP_BLOCK_SHIFT)
+#define JUMP_BLOCK_BITMAP_SIZE (JUMP_BLOCK_SIZE / 8)
+
+/*
+ * Jump destinations are tracked at least this far from a syscall
+ * instruction in both directions. This covers the instructions examined by
+ * check_surrounding_instructions in patcher.c, and in most cases the
+ * instruction loading the syscall number, see check_syscall_numbers.
+ */
+#define JUMP_TRACK_MARGIN 0x100
+
+/*
+ * allocate_jump_blocks
+ * Allocates the index of blocks, with no block tracked yet. Only the pages
+ * of the index actually used are backed by memory.
  */
 static void
-allocate_jump_table(struct intercept_desc *desc)
+allocate_jump_blocks(struct intercept_desc *desc)
 {
-	/* How many bytes need to be addressed? */
 	assert(desc->text_start < desc->text_end);
 	size_t bytes = (size_t)(desc->text_end - desc->text_start + 1);
 
-	/* Allocate 1 bit for each addressable byte */
-	/* Plus one -- integer division can result a number too low */
-	desc->jump_table = xmmap_anon(bytes / 8 + 1);
+	if (bytes > UINT32_MAX)
+		xabort("text section too large");
+
+	desc->jump_block_count = (bytes >> JUMP_BLOCK_SHIFT) + 1;
+	desc->jump_blocks = xmmap_anon(desc->jump_block_count *
+	    sizeof(desc->jump_blocks[0]));
+	desc->tracked_block_count = 0;
+	desc->jump_table = NULL;
+}
+
+/*
+ * track_jumps_around
+ * Selects the blocks around a syscall instruction, for tracking jump
+ * destinations in them. Must be called for each syscall instruction before
+ * allocate_jump_table.
+ */
+void
+track_jumps_around(struct intercept_desc *desc, const unsigned char *addr)
+{
+	uint64_t offset = (uint64_t)(addr - desc->text_start);
+	uint64_t first = 0;
+	uint64_t last = (offset + JUMP_TRACK_MARGIN) >> JUMP_BLOCK_SHIFT;
+
+	if (offset > JUMP_TRACK_MARGIN)
+		first = (offset - JUMP_TRACK_MARGIN) >> JUMP_BLOCK_SHIFT;
+
+	if (last >= desc->jump_block_count)
+		last = desc->jump_block_count - 1;
+
+	for (uint64_t block = first; block <= last; ++block) {
+		if (desc->jump_blocks[block] == 0)
+			desc->jump_blocks[block] = ++desc->tracked_block_count;
+	}
+}
+
+/*
+ * allocate_jump_table -- allocates the bitmaps of the blocks tracked
+ */
+void
+allocate_jump_table(struct intercept_desc *desc)
+{
+	if (desc->tracked_block_count > 0)
+		desc->jump_table = xmmap_anon(desc->tracked_block_count *
+		    JUMP_BLOCK_BITMAP_SIZE);
+}
+
+/*
+ * release_patching_tables
+ * The patches, the jump table, and the NOP table are not needed once the
+ * patches are activated -- only the struct patch_site instances, and the
+ * wrappers are used from that point on.
+ */
+void
+release_patching_tables(struct intercept_desc *desc)
+{
+	size_t released = 0;
+
+	if (desc->items != NULL) {
+		released += desc->max_count * sizeof(desc->items[0]);
+		xmunmap(desc->items,
+		    desc->max_count * sizeof(desc->items[0]));
+	}
+
+	if (desc->jump_table != NULL) {
+		released += desc->tracked_block_count * JUMP_BLOCK_BITMAP_SIZE;
+		xmunmap(desc->jump_table,
+		    desc->tracked_block_count * JUMP_BLOCK_BITMAP_SIZE);
+	}
+
+	if (desc->jump_blocks != NULL) {
+		released +=
+		    desc->jump_block_count * sizeof(desc->jump_blocks[0]);
+		xmunmap(desc->jump_blocks,
+		    desc->jump_block_count * sizeof(desc->jump_blocks[0]));
+	}
+
+	if (desc->nop_table != NULL) {
+		released += desc->max_nop_count * sizeof(desc->nop_table[0]);
+		xmunmap(desc->nop_table,
+		    desc->max_nop_count * sizeof(desc->nop_table[0]));
+	}
+
+	debug_dump("%s: %u syscalls patched, %zu bytes kept for them, "
+	    "%zu bytes released after patching\n",
+	    desc->path, desc->count,
+	    desc->count * sizeof(struct patch_site) +
+	    desc->patched_code_size, released);
+
+	desc->items = NULL;
+	desc->count = 0;
+	desc->max_count = 0;
+	desc->jump_table = NULL;
+	desc->jump_blocks = NULL;
+	desc->nop_table = NULL;
+	desc->nop_count = 0;
 }
 
 /*
@@ -206,16 +372,30 @@ allocate_nop_table(struct intercept_desc *desc)
 
 /*
  * mark_nop - mark an address in a text section as overwritable nop instruction
+ * The NOPs are collected separately in each part of the text section, and
+ * copied to desc->nop_table later, see merge_text_parts.
  */
 static void
-mark_nop(struct intercept_desc *desc, unsigned char *address, size_t size)
+mark_nop(struct text_part *part, unsigned char *address, size_t size)
 {
-	if (desc->nop_count == desc->max_nop_count)
-		return;
+	if (part->nop_count == part->max_nop_count) {
+		size_t old_size =
+		    part->max_nop_count * sizeof(part->nop_table[0]);
+
+		if (part->max_nop_count == 0) {
+			part->max_nop_count = 0x100;
+			part->nop_table = xmmap_anon(part->max_nop_count *
+			    sizeof(part->nop_table[0]));
+		} else {
+			part->max_nop_count *= 2;
+			part->nop_table = xmremap(part->nop_table,
+			    old_size, 2 * old_size);
+		}
+	}
 
-	desc->nop_table[desc->nop_count].address = address;
-	desc->nop_table[desc->nop_count].size = size;
-	desc->nop_count++;
+	part->nop_table[part->nop_count].address = address;
+	part->nop_table[part->nop_count].size = size;
+	part->nop_count++;
 }
 
 /*
@@ -229,12 +409,30 @@ is_bit_set(const unsigned char *table, uint64_t offset)
 
 /*
  * set_bit - set a bit in a bitmap
+ * The jump table is written by multiple threads at the same time while
+ * disassembling parts of a text section in parallel, so the bits are set
+ * atomically.
  */
 static void
 set_bit(unsigned char *table, uint64_t offset)
 {
 	unsigned char tmp = (unsigned char)(1 << (offset % 8));
-	table[offset / 8] |= tmp;
+	__atomic_fetch_or(table + offset / 8, tmp, __ATOMIC_RELAXED);
+}
+
+/*
+ * jump_bitmap -- the bitmap of the block containing offset in the text
+ * section, NULL if the block is not tracked
+ */
+static unsigned char *
+jump_bitmap(const struct intercept_desc *desc, uint64_t offset)
+{
+	uint32_t block = desc->jump_blocks[offset >> JUMP_BLOCK_SHIFT];
+
+	if (block == 0)
+		return NULL;
+
+	return desc->jump_table + (block - 1) * JUMP_BLOCK_BITMAP_SIZE;
 }
 
 /*
@@ -242,25 +440,141 @@ set_bit(unsigned char *table, uint64_t offset)
  * jump ( or subroutine call ) in the code. The address must be
  * the one seen by the current process, not the offset in the original
  * ELF file.
+ * Outside of the blocks tracked, any address might be a jump destination.
  */
 bool
 has_jump(const struct intercept_desc *desc, unsigned char *addr)
 {
-	if (addr >= desc->text_start && addr <= desc->text_end)
-		return is_bit_set(desc->jump_table,
-		    (uint64_t)(addr - desc->text_start));
-	else
+	if (addr < desc->text_start || addr > desc->text_end)
 		return false;
+
+	uint64_t offset = (uint64_t)(addr - desc->text_start);
+	const unsigned char *bitmap = jump_bitmap(desc, offset);
+
+	if (bitmap == NULL)
+		return true;
+
+	return is_bit_set(bitmap, offset % JUMP_BLOCK_SIZE);
 }
 
 /*
  * mark_jump - Mark an address as a jump destination, see has_jump above.
+ * Addresses outside of the blocks tracked are ignored.
  */
 void
 mark_jump(const struct intercept_desc *desc, const unsigned char *addr)
 {
-	if (addr >= desc->text_start && addr <= desc->text_end)
-		set_bit(desc->jump_table, (uint64_t)(addr - desc->text_start));
+	if (addr < desc->text_start || addr > desc->text_end)
+		return;
+
+	uint64_t offset = (uint64_t)(addr - desc->text_start);
+	unsigned char *bitmap = jump_bitmap(desc, offset);
+
+	if (bitmap != NULL)
+		set_bit(bitmap, offset % JUMP_BLOCK_SIZE);
+}
+
+/*
+ * add_boundary
+ * Remembers an address in the text section known to be an instruction
+ * boundary, see jump_dest_before.
+ */
+static void
+add_boundary(struct intercept_desc *desc, const unsigned char *addr)
+{
+	if (addr < desc->text_start || addr > desc->text_end)
+		return;
+
+	assert(desc->boundary_count < desc->max_boundary_count);
+	desc->boundaries[desc->boundary_count++] =
+	    (uint32_t)(addr - desc->text_start);
+}
+
+/*
+ * allocate_boundaries
+ * Allocates space for the boundaries found in symbol tables and relocation
+ * tables, at most two for each symbol, and one for each relocation entry.
+ */
+static void
+allocate_boundaries(struct intercept_desc *desc)
+{
+	size_t count = 0;
+
+	for (Elf64_Half i = 0; i < desc->symbol_tables.count; ++i)
+		count += 2 * (desc->symbol_tables.headers[i].sh_size /
+		    sizeof(Elf64_Sym));
+
+	for (Elf64_Half i = 0; i < desc->rela_tables.count; ++i)
+		count += desc->rela_tables.headers[i].sh_size /
+		    sizeof(Elf64_Rela);
+
+	desc->boundary_count = 0;
+	desc->max_boundary_count = count + 1;
+	desc->boundaries = xmmap_anon(desc->max_boundary_count *
+	    sizeof(desc->boundaries[0]));
+}
+
+/*
+ * sort_boundaries
+ * Sorts desc->boundaries, and removes duplicates. This is a radix sort, as
+ * qsort might allocate memory, which is not allowed on the worker threads,
+ * see workers.c
+ */
+static void
+sort_boundaries(struct intercept_desc *desc)
+{
+	size_t count = desc->boundary_count;
+	size_t size = count * sizeof(desc->boundaries[0]);
+
+	if (count == 0)
+		return;
+
+	uint32_t *src = desc->boundaries;
+	uint32_t *dst = xmmap_anon(size);
+
+	for (unsigned shift = 0; shift < 32; shift += 8) {
+		size_t positions[0x100] = {0, };
+
+		for (size_t i = 0; i < count; ++i)
+			positions[(src[i] >> shift) & 0xff]++;
+
+		size_t position = 0;
+		for (unsigned digit = 0; digit < 0x100; ++digit) {
+			size_t digit_count = positions[digit];
+
+			positions[digit] = position;
+			position += digit_count;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+			dst[positions[(src[i] >> shift) & 0xff]++] = src[i];
+
+		uint32_t *tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* after an even number of passes, the result is in place */
+	assert(src == desc->boundaries);
+	xmunmap(dst, size);
+
+	desc->boundary_count = 1;
+	for (size_t i = 1; i < count; ++i) {
+		if (src[i] != src[desc->boundary_count - 1])
+			src[desc->boundary_count++] = src[i];
+	}
+}
+
+/*
+ * release_boundaries -- they are only needed for splitting the text section
+ */
+static void
+release_boundaries(struct intercept_desc *desc)
+{
+	xmunmap(desc->boundaries,
+	    desc->max_boundary_count * sizeof(desc->boundaries[0]));
+	desc->boundaries = NULL;
+	desc->boundary_count = 0;
 }
 
 /*
@@ -288,18 +602,15 @@ mark_jump(const struct intercept_desc *desc, const unsigned char *addr)
  * The field st_value is offset of the symbol in the object file.
  */
 static void
-find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
-				int fd)
+find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section)
 {
 	assert(section->sh_type == SHT_SYMTAB ||
 		section->sh_type == SHT_DYNSYM);
 
 	size_t sym_count = section->sh_size / sizeof(Elf64_Sym);
 
-	Elf64_Sym syms[sym_count];
-
-	xlseek(fd, section->sh_offset, SEEK_SET);
-	xread(fd, &syms, section->sh_size);
+	const Elf64_Sym *syms =
+	    file_part(desc, section->sh_offset, section->sh_size);
 
 	for (size_t i = 0; i < sym_count; ++i) {
 		if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC)
@@ -315,10 +626,13 @@ find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
 
 		/* a function entry point in .text, mark it */
 		mark_jump(desc, address);
+		add_boundary(desc, address);
 
 		/* a function's end in .text, mark it */
-		if (syms[i].st_size != 0)
+		if (syms[i].st_size != 0) {
 			mark_jump(desc, address + syms[i].st_size);
+			add_boundary(desc, address + syms[i].st_size);
+		}
 	}
 }
 
@@ -339,17 +653,14 @@ find_jumps_in_section_syms(struct intercept_desc *desc, Elf64_Shdr *section,
  *
  */
 static void
-find_jumps_in_section_rela(struct intercept_desc *desc, Elf64_Shdr *section,
-				int fd)
+find_jumps_in_section_rela(struct intercept_desc *desc, Elf64_Shdr *section)
 {
 	assert(section->sh_type == SHT_RELA);
 
 	size_t sym_count = section->sh_size / sizeof(Elf64_Rela);
 
-	Elf64_Rela syms[sym_count];
-
-	xlseek(fd, section->sh_offset, SEEK_SET);
-	xread(fd, &syms, section->sh_size);
+	const Elf64_Rela *syms =
+	    file_part(desc, section->sh_offset, section->sh_size);
 
 	for (size_t i = 0; i < sym_count; ++i) {
 		switch (ELF64_R_TYPE(syms[i].r_info)) {
@@ -364,45 +675,39 @@ find_jumps_in_section_rela(struct intercept_desc *desc, Elf64_Shdr *section,
 				    desc->base_addr + syms[i].r_addend;
 
 				mark_jump(desc, address);
+				add_boundary(desc, address);
 
 				break;
 		}
 	}
 }
 
-/*
- * has_pow2_count
- * Checks if the positive number of patches in a struct intercept_desc
- * is a power of two or not.
- */
-static bool
-has_pow2_count(const struct intercept_desc *desc)
-{
-	return (desc->count & (desc->count - 1)) == 0;
-}
-
 /*
  * add_new_patch
- * Acquires a new patch entry, and allocates memory for it if
- * needed.
+ * Acquires a new patch entry in a part of the text section, and allocates
+ * memory for it if needed. The patches are copied to desc->items later,
+ * see merge_text_parts.
  */
 static struct patch_desc *
-add_new_patch(struct intercept_desc *desc)
+add_new_patch(struct text_part *part)
 {
-	if (desc->count == 0) {
+	if (part->max_count == 0) {
 
 		/* initial allocation */
-		desc->items = xmmap_anon(sizeof(desc->items[0]));
+		part->max_count = 0x10;
+		part->items =
+		    xmmap_anon(part->max_count * sizeof(part->items[0]));
 
-	} else if (has_pow2_count(desc)) {
+	} else if (part->count == part->max_count) {
 
-		/* if count is a power of two, double the allocate space */
-		size_t size = desc->count * sizeof(desc->items[0]);
+		/* double the allocated space */
+		size_t size = part->max_count * sizeof(part->items[0]);
 
-		desc->items = xmremap(desc->items, size, 2 * size);
+		part->max_count *= 2;
+		part->items = xmremap(part->items, size, 2 * size);
 	}
 
-	return &(desc->items[desc->count++]);
+	return &(part->items[part->count++]);
 }
 
 /*
@@ -435,8 +740,8 @@ is_overwritable_nop(const struct intercept_disasm_result *ins)
 }
 
 /*
- * crawl_text
- * Crawl the text section, disassembling it all.
+ * crawl_part
+ * Crawl a part of the text section, disassembling it all.
  * This routine collects information about potential addresses to patch.
  *
  * The addresses of all syscall instructions are stored, together with
@@ -452,9 +757,11 @@ is_overwritable_nop(const struct intercept_disasm_result *ins)
  * as it is not known in advance, which addresses are jump destinations.
  */
 static void
-crawl_text(struct intercept_desc *desc)
+crawl_part(const struct intercept_desc *desc,
+		struct intercept_disasm_context *context,
+		struct text_part *part)
 {
-	unsigned char *code = desc->text_start;
+	unsigned char *code = part->begin;
 
 	/*
 	 * Remember the previous three instructions, while
@@ -470,15 +777,33 @@ crawl_text(struct intercept_desc *desc)
 	 * has no previous instruction.
 	 */
 	unsigned has_prevs = 0;
-	struct intercept_disasm_context *context =
-	    intercept_disasm_init(desc->text_start, desc->text_end);
 
-	while (code <= desc->text_end) {
+	/*
+	 * The value of RAX, if it is known to be a constant loaded
+	 * into RAX in the current basic block, and the address right after
+	 * the instruction loading it. The value of RAX is remembered at
+	 * each syscall instruction in syscall_nr, as a patch description
+	 * is only generated at the instruction following the syscall.
+	 */
+	long rax_value = -1;
+	const unsigned char *rax_set_end = NULL;
+	long syscall_nr = -1;
+	unsigned syscall_nr_distance = 0;
+
+	/*
+	 * A syscall instruction at the end of the part is followed by
+	 * an instruction in the next part, which also needs to be decoded
+	 * for the patch description.
+	 */
+	while (code <= part->end ||
+	    (prevs[2].is_syscall && code <= desc->text_end &&
+	    code - SYSCALL_INS_SIZE <= part->end)) {
 		struct intercept_disasm_result result;
 
 		result = intercept_disasm_next_instruction(context, code);
 
 		if (result.length == 0) {
+			rax_value = -1;
 			++code;
 			continue;
 		}
@@ -486,8 +811,9 @@ crawl_text(struct intercept_desc *desc)
 		if (result.has_ip_relative_opr)
 			mark_jump(desc, result.rip_ref_addr);
 
-		if (is_overwritable_nop(&result))
-			mark_nop(desc, code, result.length);
+		if (is_overwritable_nop(&result) &&
+		    code >= part->record_begin && code <= part->end)
+			mark_nop(part, code, result.length);
 
 		/*
 		 * Generate a new patch description, if:
@@ -516,8 +842,10 @@ crawl_text(struct intercept_desc *desc)
 		 * These implausible edge cases don't seem to be very important
 		 * right now.
 		 */
-		if (has_prevs >= 1 && prevs[2].is_syscall) {
-			struct patch_desc *patch = add_new_patch(desc);
+		if (has_prevs >= 1 && prevs[2].is_syscall &&
+		    code - SYSCALL_INS_SIZE >= part->record_begin &&
+		    code - SYSCALL_INS_SIZE <= part->end) {
+			struct patch_desc *patch = add_new_patch(part);
 
 			patch->containing_lib_path = desc->path;
 			patch->preceding_ins_2 = prevs[0];
@@ -531,6 +859,22 @@ crawl_text(struct intercept_desc *desc)
 			assert(syscall_offset >= 0);
 
 			patch->syscall_offset = (unsigned long)syscall_offset;
+			patch->syscall_nr = syscall_nr;
+			patch->syscall_nr_distance = syscall_nr_distance;
+		}
+
+		if (result.is_syscall) {
+			syscall_nr = rax_value;
+			if (rax_value >= 0)
+				syscall_nr_distance =
+				    (unsigned)(code - rax_set_end);
+		}
+
+		if (result.sets_rax_imm && result.rax_imm >= 0) {
+			rax_value = result.rax_imm;
+			rax_set_end = code + result.length;
+		} else if (!result.preserves_rax) {
+			rax_value = -1;
 		}
 
 		prevs[0] = prevs[1];
@@ -541,14 +885,458 @@ crawl_text(struct intercept_desc *desc)
 
 		code += result.length;
 	}
+}
+
+/*
+ * crawl_text_part -- disassemble a part of the text section
+ */
+static void
+crawl_text_part(const struct intercept_desc *desc, struct text_part *part)
+{
+	struct intercept_disasm_context *context =
+	    intercept_disasm_init(desc->text_start, desc->text_end);
+
+	crawl_part(desc, context, part);
 
 	intercept_disasm_destroy(context);
 }
 
+/*
+ * add_text_part -- append a part to desc->parts, see struct text_part
+ */
+static void
+add_text_part(struct intercept_desc *desc, unsigned char *begin,
+		unsigned char *record_begin, unsigned char *end)
+{
+	struct text_part *part = desc->parts + desc->part_count++;
+
+	part->begin = begin;
+	part->record_begin = record_begin;
+	part->end = end;
+}
+
+/*
+ * jump_dest_before
+ * Looks for an address known to be a jump destination, at the offset in
+ * the text section, or before it. These are the entry points of functions
+ * found in the symbol tables, and addresses found in relocation entries,
+ * which are also assumed to be instruction boundaries.
+ * Returns the start of the text section if there is no such address.
+ */
+static unsigned char *
+jump_dest_before(const struct intercept_desc *desc, uint64_t offset)
+{
+	size_t low = 0;
+	size_t high = desc->boundary_count;
+
+	/* the first boundary larger than offset is at high */
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+
+		if (desc->boundaries[middle] <= offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (high == 0)
+		return desc->text_start;
+
+	return desc->text_start + desc->boundaries[high - 1];
+}
+
+/*
+ * jump_dest_after
+ * The counterpart of jump_dest_before, returns the end of the text section
+ * if there is no such address at offset, or after it.
+ */
+static unsigned char *
+jump_dest_after(const struct intercept_desc *desc, uint64_t offset)
+{
+	size_t low = 0;
+	size_t high = desc->boundary_count;
+
+	/* the first boundary not less than offset is at high */
+	while (low < high) {
+		size_t middle = low + (high - low) / 2;
+
+		if (desc->boundaries[middle] < offset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+
+	if (high == desc->boundary_count)
+		return desc->text_end;
+
+	return desc->text_start + desc->boundaries[high];
+}
+
+/*
+ * The size of the parts a text section is split into, allowing multiple
+ * threads to disassemble a large text section -- see split_text.
+ */
+#define TEXT_PART_SIZE 0x40000
+
+/*
+ * Disassembling a part starts at least this many bytes before the
+ * addresses where patches are collected in it, to see the two instructions
+ * preceding a syscall instruction at the start of the part.
+ */
+#define TEXT_PART_LEAD 0x40
+
+/*
+ * split_text
+ * Splits the text section into parts of about TEXT_PART_SIZE bytes, at
+ * jump destinations. Each part is disassembled starting at a jump
+ * destination before it, so the same instructions are seen as while
+ * disassembling the whole text section at once.
+ * A syscall number loaded into RAX before the start of a part is not seen
+ * in the part, but it would not be valid anyway, as the start of the part
+ * is a jump destination -- see check_syscall_numbers.
+ *
+ * Returns the number of parts, only counting them if desc->parts is NULL.
+ */
+static unsigned
+split_text(struct intercept_desc *desc)
+{
+	uint64_t size = (uint64_t)(desc->text_end - desc->text_start + 1);
+	unsigned char *begin = desc->text_start;
+	unsigned char *record_begin = desc->text_start;
+	unsigned count = 0;
+
+	for (uint64_t offset = TEXT_PART_SIZE; offset < size;
+	    offset += TEXT_PART_SIZE) {
+		unsigned char *next = jump_dest_before(desc, offset);
+
+		if (next <= record_begin + TEXT_PART_LEAD)
+			continue; /* no jump destination in this part */
+
+		if (desc->parts != NULL)
+			add_text_part(desc, begin, record_begin, next - 1);
+		++count;
+
+		record_begin = next;
+		begin = jump_dest_before(desc,
+		    (uint64_t)(next - desc->text_start) - TEXT_PART_LEAD);
+	}
+
+	if (desc->parts != NULL)
+		add_text_part(desc, begin, record_begin, desc->text_end);
+
+	return count + 1;
+}
+
+/*
+ * next_syscall_candidate
+ * Looks for the next 0x0f 0x05 byte pair -- the encoding of the syscall
+ * instruction -- starting at the address code, comparing sixteen bytes at
+ * a time. Not all of these are syscall instructions, the bytes can appear
+ * inside other instructions, or in data embedded in the text section, but
+ * there is no syscall instruction anywhere else.
+ * Returns NULL if there are no more such byte pairs in the text section.
+ */
+static unsigned char *
+next_syscall_candidate(const struct intercept_desc *desc, unsigned char *code)
+{
+	const __m128i first = _mm_set1_epi8(0x0f);
+	const __m128i second = _mm_set1_epi8(0x05);
+
+	while (code + 16 <= desc->text_end) {
+		__m128i a = _mm_loadu_si128((const __m128i *)code);
+		__m128i b = _mm_loadu_si128((const __m128i *)(code + 1));
+		unsigned mask = (unsigned)_mm_movemask_epi8(_mm_and_si128(
+		    _mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, second)));
+
+		if (mask != 0)
+			return code + __builtin_ctz(mask);
+
+		code += 16;
+	}
+
+	for (; code < desc->text_end; ++code) {
+		if (code[0] == 0x0f && code[1] == 0x05)
+			return code;
+	}
+
+	return NULL;
+}
+
+/*
+ * The windows disassembled around the syscall candidates extend at least
+ * this far in both directions, which is more than the range of a jump with
+ * an 8 bit displacement. Thus any short jump to an instruction around a
+ * syscall is seen while disassembling the window, and so is any NOP that
+ * can be reached by the short jump placed at the syscall, see
+ * assign_nop_trampoline in patcher.c.
+ */
+#define SCAN_WINDOW_MARGIN 0x100
+
+/*
+ * window_start, window_end
+ * A window must start and end at an instruction boundary, i.e. at an
+ * address known to be a jump destination, see jump_dest_before.
+ */
+static unsigned char *
+window_start(const struct intercept_desc *desc, unsigned char *candidate)
+{
+	if (candidate - desc->text_start <= SCAN_WINDOW_MARGIN)
+		return desc->text_start;
+
+	return jump_dest_before(desc,
+	    (uint64_t)(candidate - desc->text_start) - SCAN_WINDOW_MARGIN);
+}
+
+static unsigned char *
+window_end(const struct intercept_desc *desc, unsigned char *candidate)
+{
+	if (desc->text_end - candidate <= SCAN_WINDOW_MARGIN)
+		return desc->text_end;
+
+	return jump_dest_after(desc,
+	    (uint64_t)(candidate - desc->text_start) + SCAN_WINDOW_MARGIN);
+}
+
+/*
+ * mark_far_jump
+ * Marks the destination of a call, jmp, or conditional jump instruction
+ * with a 32 bit displacement at the address ins. The destination is ignored
+ * by mark_jump, unless it is near a syscall instruction.
+ */
+static void
+mark_far_jump(struct intercept_desc *desc, unsigned char *ins)
+{
+	int32_t disp;
+	unsigned char *dst;
+
+	if (ins[0] == 0x0f) {
+		memcpy(&disp, ins + 2, sizeof(disp));
+		dst = ins + 6 + disp;
+	} else {
+		memcpy(&disp, ins + 1, sizeof(disp));
+		dst = ins + 5 + disp;
+	}
+
+	mark_jump(desc, dst);
+}
+
+/*
+ * mark_far_jumps
+ * Jumps and calls with a 32 bit displacement might come into a window from
+ * anywhere in the text section. Every byte of the text section is examined
+ * as a possible opcode of such an instruction, sixteen bytes at a time,
+ * without disassembling the code. This might mark some addresses that are
+ * not jump destinations, which only means some instructions are not
+ * overwritten, even though they could be.
+ */
+static void
+mark_far_jumps(struct intercept_desc *desc)
+{
+	const __m128i call = _mm_set1_epi8((char)CALL_OPCODE);
+	const __m128i jmp = _mm_set1_epi8((char)JMP_OPCODE);
+	const __m128i two_byte = _mm_set1_epi8(0x0f);
+	const __m128i jcc_mask = _mm_set1_epi8((char)0xf0);
+	const __m128i jcc = _mm_set1_epi8((char)0x80);
+
+	unsigned char *code;
+
+	for (code = desc->text_start;
+	    code + 16 + 6 <= desc->text_end; code += 16) {
+		__m128i a = _mm_loadu_si128((const __m128i *)code);
+		__m128i b = _mm_loadu_si128((const __m128i *)(code + 1));
+		__m128i opcodes = _mm_or_si128(
+		    _mm_or_si128(_mm_cmpeq_epi8(a, call),
+			_mm_cmpeq_epi8(a, jmp)),
+		    _mm_and_si128(_mm_cmpeq_epi8(a, two_byte),
+			_mm_cmpeq_epi8(_mm_and_si128(b, jcc_mask), jcc)));
+		unsigned mask = (unsigned)_mm_movemask_epi8(opcodes);
+
+		while (mask != 0) {
+			mark_far_jump(desc, code + __builtin_ctz(mask));
+			mask &= mask - 1;
+		}
+	}
+
+	for (; code + 6 <= desc->text_end; ++code) {
+		if (code[0] == CALL_OPCODE || code[0] == JMP_OPCODE ||
+		    (code[0] == 0x0f && (code[1] & 0xf0) == 0x80))
+			mark_far_jump(desc, code);
+	}
+}
+
+/*
+ * split_text_windows
+ * The alternative of split_text, used when the INTERCEPT_SCAN_WINDOWS
+ * environment variable is set. Instead of disassembling the whole text
+ * section, only windows around the 0x0f 0x05 byte pairs are disassembled,
+ * each window being a part of the text section.
+ *
+ * Overlapping windows are merged, so each instruction is disassembled at
+ * most once, and the patches are found in the order of their addresses,
+ * just as with split_text.
+ *
+ * Jump destinations are found in the windows as usual, and by
+ * mark_far_jumps outside them. A reference to an instruction
+ * via a RIP relative operand ( e.g. a lea instruction loading the address
+ * of some code ) outside of the windows is not noticed.
+ */
+static void
+split_text_windows(struct intercept_desc *desc)
+{
+	size_t size = (size_t)(desc->text_end - desc->text_start + 1);
+	size_t max_window_count = size / SCAN_WINDOW_MARGIN + 1;
+	size_t windows_size = max_window_count * sizeof(struct range);
+	struct range *windows = xmmap_anon(windows_size);
+	size_t window_count = 0;
+
+	unsigned char *candidate = next_syscall_candidate(desc,
+	    desc->text_start);
+
+	while (candidate != NULL) {
+		struct range *last = windows + window_count - 1;
+
+		if (window_count > 0 && candidate <=
+		    last->address + last->size + SCAN_WINDOW_MARGIN) {
+			/* extend the last window */
+			unsigned char *end = window_end(desc, candidate);
+
+			last->size = (size_t)(end - last->address + 1);
+		} else {
+			unsigned char *start = window_start(desc, candidate);
+			unsigned char *end = window_end(desc, candidate);
+
+			assert(window_count < max_window_count);
+			windows[window_count].address = start;
+			windows[window_count].size = (size_t)(end - start + 1);
+			++window_count;
+		}
+
+		candidate = next_syscall_candidate(desc, candidate + 1);
+	}
+
+	debug_dump("%s: %zu windows to disassemble\n",
+	    desc->path, window_count);
+
+	mark_far_jumps(desc);
+
+	desc->parts = xmmap_anon(window_count * sizeof(desc->parts[0]));
+
+	for (size_t i = 0; i < window_count; ++i) {
+		add_text_part(desc, windows[i].address, windows[i].address,
+		    windows[i].address + windows[i].size - 1);
+	}
+
+	xmunmap(windows, windows_size);
+}
+
+/*
+ * merge_text_parts
+ * Collects the patches and NOPs found in the parts of the text section,
+ * which are in the order of their addresses, and releases the parts.
+ */
+static void
+merge_text_parts(struct intercept_desc *desc)
+{
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < desc->part_count; ++i)
+		count += desc->parts[i].count;
+
+	if (count > 0)
+		desc->items = xmmap_anon(count * sizeof(desc->items[0]));
+	desc->max_count = count;
+
+	for (unsigned i = 0; i < desc->part_count; ++i) {
+		struct text_part *part = desc->parts + i;
+		size_t nop_count = part->nop_count;
+
+		if (nop_count > desc->max_nop_count - desc->nop_count)
+			nop_count = desc->max_nop_count - desc->nop_count;
+
+		if (part->max_count > 0) {
+			memcpy(desc->items + desc->count, part->items,
+			    part->count * sizeof(part->items[0]));
+			desc->count += part->count;
+			xmunmap(part->items,
+			    part->max_count * sizeof(part->items[0]));
+		}
+
+		if (part->max_nop_count > 0) {
+			memcpy(desc->nop_table + desc->nop_count,
+			    part->nop_table,
+			    nop_count * sizeof(part->nop_table[0]));
+			desc->nop_count += nop_count;
+			xmunmap(part->nop_table,
+			    part->max_nop_count * sizeof(part->nop_table[0]));
+		}
+	}
+
+	if (desc->part_count > 0)
+		xmunmap(desc->parts,
+		    desc->part_count * sizeof(desc->parts[0]));
+
+	desc->parts = NULL;
+	desc->part_count = 0;
+}
+
+/*
+ * check_syscall_numbers
+ * The syscall numbers found by crawl_part are only valid, if there
+ * is no jump to any instruction between the one loading the syscall number
+ * into RAX, and the syscall instruction ( including the syscall instruction
+ * itself ). This can only be checked after crawling the whole text section,
+ * as jumps destinations are collected during the crawl.
+ */
+static void
+check_syscall_numbers(struct intercept_desc *desc)
+{
+	for (unsigned i = 0; i < desc->count; ++i) {
+		struct patch_desc *patch = desc->items + i;
+
+		if (patch->syscall_nr < 0)
+			continue;
+
+		unsigned char *addr =
+		    patch->syscall_addr - patch->syscall_nr_distance;
+
+		for (; addr <= patch->syscall_addr; ++addr) {
+			if (has_jump(desc, addr)) {
+				patch->syscall_nr = -1;
+				break;
+			}
+		}
+
+		debug_dump("syscall at 0x%016" PRIxPTR " nr: %ld\n",
+		    (uintptr_t)patch->syscall_addr, patch->syscall_nr);
+	}
+}
+
+/*
+ * remove_unselected_patches
+ * Forget about syscall instructions that are known to be used only for
+ * syscalls not selected for patching, see should_patch_syscall in
+ * syscall_filter.c
+ */
+static void
+remove_unselected_patches(struct intercept_desc *desc)
+{
+	unsigned count = 0;
+
+	for (unsigned i = 0; i < desc->count; ++i) {
+		if (should_patch_syscall(desc->items[i].syscall_nr))
+			desc->items[count++] = desc->items[i];
+	}
+
+	debug_dump("%u syscalls not patched in %s\n",
+	    desc->count - count, desc->path);
+
+	desc->count = count;
+}
+
 /*
  * get_min_address
  * Looks for the lowest address that might be mmap-ed. This is
- * useful while looking for space for a trampoline table close
+ * useful while looking for space for the asm wrappers close
  * to some text section.
  */
 static uintptr_t
@@ -580,30 +1368,105 @@ get_min_address(void)
 }
 
 /*
- * allocate_trampoline_table
- * Allocates memory close to a text section (close enough
- * to be reachable with 32 bit displacements in jmp instructions).
- * Using mmap syscall with MAP_FIXED flag.
+ * A reader of /proc/self/maps, using syscall_no_intercept instead of stdio,
+ * so it does not allocate memory, and can be used while other threads
+ * are running intercepted code.
  */
-void
-allocate_trampoline_table(struct intercept_desc *desc)
+struct maps_reader {
+	long fd;
+	size_t pos;
+	size_t len;
+	char buffer[0x1000];
+};
+
+static int
+maps_getc(struct maps_reader *reader)
 {
-	char *e = getenv("INTERCEPT_NO_TRAMPOLINE");
+	if (reader->pos == reader->len) {
+		long r = syscall_no_intercept(SYS_read, reader->fd,
+				reader->buffer, sizeof(reader->buffer));
 
-	/* Use the extra trampoline table by default */
-	desc->uses_trampoline_table = (e == NULL) || (e[0] == '0');
+		xabort_on_syserror(r, "read /proc/self/maps");
 
-	if (!desc->uses_trampoline_table) {
-		desc->trampoline_table = NULL;
-		desc->trampoline_table_size = 0;
-		desc->trampoline_table = NULL;
-		return;
+		if (r == 0)
+			return -1;
+
+		reader->pos = 0;
+		reader->len = (size_t)r;
+	}
+
+	return (unsigned char)reader->buffer[reader->pos++];
+}
+
+/*
+ * maps_read_hex
+ * Reads a hexadecimal number, and the character following it.
+ */
+static uintptr_t
+maps_read_hex(struct maps_reader *reader, int *next)
+{
+	uintptr_t value = 0;
+	int c;
+
+	while (true) {
+		c = maps_getc(reader);
+
+		if (c >= '0' && c <= '9')
+			value = value * 16 + (uintptr_t)(c - '0');
+		else if (c >= 'a' && c <= 'f')
+			value = value * 16 + (uintptr_t)(c - 'a' + 10);
+		else
+			break;
 	}
 
-	FILE *maps;
-	char line[0x100];
-	unsigned char *guess; /* Where we would like to allocate the table */
-	size_t size;
+	*next = c;
+	return value;
+}
+
+/*
+ * maps_next
+ * Reads the address range of the next line in /proc/self/maps.
+ * Returns false at the end of the file.
+ */
+static bool
+maps_next(struct maps_reader *reader, unsigned char **start,
+		unsigned char **end)
+{
+	int c;
+
+	*start = (unsigned char *)maps_read_hex(reader, &c);
+	if (c == -1)
+		return false;
+
+	if (c != '-')
+		xabort("unexpected format of /proc/self/maps");
+
+	*end = (unsigned char *)maps_read_hex(reader, &c);
+
+	/* skip the rest of the line */
+	while (c != '\n' && c != -1)
+		c = maps_getc(reader);
+
+	return true;
+}
+
+/*
+ * find_unmapped_near
+ * Looks for an unmapped range of memory close to a text section (close
+ * enough to be reachable with 32 bit displacements in jmp instructions from
+ * anywhere in the text section). The start of the range is aligned
+ * to align bytes, which must be a power of two, and at least a page.
+ * Returns NULL if no such range is found.
+ */
+unsigned char *
+find_unmapped_near(const struct intercept_desc *desc, size_t size,
+			size_t align)
+{
+	struct maps_reader reader;
+	unsigned char *guess; /* Where we would like to allocate the range */
+	unsigned char *start;
+	unsigned char *end;
+	unsigned char *result = NULL;
 
 	if ((uintptr_t)desc->text_end < INT32_MAX) {
 		/* start from the bottom of memory */
@@ -612,34 +1475,32 @@ allocate_trampoline_table(struct intercept_desc *desc)
 		/*
 		 * start from the lowest possible address, that can be reached
 		 * from the text segment using a 32 bit displacement.
-		 * Round up to a memory page boundary, as this address must be
-		 * mappable.
 		 */
 		guess = desc->text_end - INT32_MAX;
-		guess = (unsigned char *)(((uintptr_t)guess)
-				& ~((uintptr_t)(0xfff))) + 0x1000;
 	}
 
 	if ((uintptr_t)guess < get_min_address())
 		guess = (void *)get_min_address();
 
-	size = 64 * 0x1000; /* XXX: don't just guess */
-
-	if ((maps = fopen("/proc/self/maps", "r")) == NULL)
-		xabort("fopen /proc/self/maps");
-
-	while ((fgets(line, sizeof(line), maps)) != NULL) {
-		unsigned char *start;
-		unsigned char *end;
+	/*
+	 * Round up to the alignment required, as this address
+	 * must be mappable.
+	 */
+	guess = (unsigned char *)
+	    (((uintptr_t)guess + align - 1) & ~((uintptr_t)align - 1));
 
-		if (sscanf(line, "%p-%p", (void **)&start, (void **)&end) != 2)
-			xabort("sscanf from /proc/self/maps");
+	reader.fd = syscall_no_intercept(SYS_open, "/proc/self/maps",
+					O_RDONLY);
+	xabort_on_syserror(reader.fd, "open /proc/self/maps");
+	reader.pos = 0;
+	reader.len = 0;
 
+	while (maps_next(&reader, &start, &end)) {
 		/*
 		 * Let's see if an existing mapping overlaps
 		 * with the guess!
 		 */
-		if (end < guess)
+		if (end <= guess)
 			continue; /* No overlap, let's see the next mapping */
 
 		if (start >= guess + size) {
@@ -648,43 +1509,33 @@ allocate_trampoline_table(struct intercept_desc *desc)
 		}
 
 		/*
-		 * The next guess is the page following the mapping seen
-		 * just now.
+		 * The next guess is the first aligned address following
+		 * the mapping seen just now.
 		 */
-		guess = end;
+		guess = (unsigned char *)
+		    (((uintptr_t)end + align - 1) & ~((uintptr_t)align - 1));
 
-		if (guess + size >= desc->text_start + INT32_MAX) {
-			/* Too far away */
-			xabort("unable to find place for trampoline table");
-		}
+		if (guess + size >= desc->text_start + INT32_MAX)
+			break; /* Too far away */
 	}
 
-	fclose(maps);
+	syscall_no_intercept(SYS_close, reader.fd);
 
-	desc->trampoline_table = mmap(guess, size,
-					PROT_READ | PROT_WRITE | PROT_EXEC,
-					MAP_FIXED | MAP_PRIVATE | MAP_ANON,
-					-1, 0);
+	if (guess + size < desc->text_start + INT32_MAX)
+		result = guess;
 
-	if (desc->trampoline_table == MAP_FAILED)
-		xabort("unable to allocate space for trampoline table");
-
-	desc->trampoline_table_size = size;
-
-	desc->next_trampoline = desc->trampoline_table;
+	return result;
 }
 
 /*
- * find_syscalls
- * The routine that disassembles a text section. Here is some higher level
- * logic for finding syscalls, finding overwritable NOP instructions, and
- * finding out what instructions around syscalls can be overwritten or not.
- * This code is intentionally independent of the disassembling library used,
- * such specific code is in wrapper functions in the disasm_wrapper.c source
- * file.
+ * find_syscalls_begin
+ * The first step of find_syscalls: reading information about the object
+ * from its file, and splitting its text section into parts to disassemble.
+ * Nothing is left for the other steps if the information about the
+ * syscalls is found in the plan cache, or if there are no syscalls.
  */
-void
-find_syscalls(struct intercept_desc *desc)
+static void
+find_syscalls_begin(struct intercept_desc *desc)
 {
 	debug_dump("find_syscalls in %s "
 	    "at base_addr 0x%016" PRIxPTR "\n",
@@ -692,27 +1543,218 @@ find_syscalls(struct intercept_desc *desc)
 	    (uintptr_t)desc->base_addr);
 
 	desc->count = 0;
-
-	int fd = open_orig_file(desc);
-
-	find_sections(desc, fd);
+	desc->parts = NULL;
+	desc->part_count = 0;
+	map_orig_file(desc);
+	find_sections(desc);
 	debug_dump(
 	    "%s .text mapped at 0x%016" PRIxPTR " - 0x%016" PRIxPTR " \n",
 	    desc->path,
 	    (uintptr_t)desc->text_start,
 	    (uintptr_t)desc->text_end);
-	allocate_jump_table(desc);
+	allocate_jump_blocks(desc);
 	allocate_nop_table(desc);
 
+	if (plan_cache_load(desc, desc->fd)) {
+		unmap_orig_file(desc);
+		remove_unselected_patches(desc);
+		return;
+	}
+
+	unsigned char *candidate = next_syscall_candidate(desc,
+	    desc->text_start);
+
+	if (candidate == NULL) {
+		debug_dump("no syscall instruction in %s\n", desc->path);
+		unmap_orig_file(desc);
+		return;
+	}
+
+	while (candidate != NULL) {
+		track_jumps_around(desc, candidate);
+		candidate = next_syscall_candidate(desc, candidate + 1);
+	}
+
+	allocate_jump_table(desc);
+	allocate_boundaries(desc);
+
 	for (Elf64_Half i = 0; i < desc->symbol_tables.count; ++i)
 		find_jumps_in_section_syms(desc,
-		    desc->symbol_tables.headers + i, fd);
+		    desc->symbol_tables.headers + i);
 
 	for (Elf64_Half i = 0; i < desc->rela_tables.count; ++i)
 		find_jumps_in_section_rela(desc,
-		    desc->rela_tables.headers + i, fd);
+		    desc->rela_tables.headers + i);
+
+	sort_boundaries(desc);
+
+	if (scan_windows) {
+		split_text_windows(desc);
+	} else {
+		unsigned count = split_text(desc);
+
+		desc->parts = xmmap_anon(count * sizeof(desc->parts[0]));
+		split_text(desc);
+	}
 
-	syscall_no_intercept(SYS_close, fd);
+	release_boundaries(desc);
+
+	debug_dump("%s: %u parts to disassemble, "
+	    "jumps tracked in %u blocks\n",
+	    desc->path, desc->part_count, desc->tracked_block_count);
+}
+
+/*
+ * find_syscalls_end
+ * The last step of find_syscalls, after all parts of the text section
+ * are disassembled.
+ */
+static void
+find_syscalls_end(struct intercept_desc *desc)
+{
+	if (desc->fd < 0)
+		return;
+
+	merge_text_parts(desc);
+	check_syscall_numbers(desc);
+	plan_cache_store(desc, desc->fd);
+	unmap_orig_file(desc);
+	remove_unselected_patches(desc);
+}
+
+/*
+ * find_syscalls
+ * The routine that disassembles a text section. Here is some higher level
+ * logic for finding syscalls, finding overwritable NOP instructions, and
+ * finding out what instructions around syscalls can be overwritten or not.
+ * This code is intentionally independent of the disassembling library used,
+ * such specific code is in wrapper functions in the disasm_wrapper.c source
+ * file.
+ */
+void
+find_syscalls(struct intercept_desc *desc)
+{
+	find_syscalls_begin(desc);
+
+	for (unsigned i = 0; i < desc->part_count; ++i)
+		crawl_text_part(desc, desc->parts + i);
+
+	find_syscalls_end(desc);
+}
+
+/*
+ * find_syscalls_in_region
+ * The variant of find_syscalls used for code generated at runtime, see
+ * jit.c. There is no file to read symbols, or relocation entries from, so
+ * the jump destinations known are the ones seen while disassembling, and
+ * the ones found by mark_far_jumps. Any instruction might be an entry point
+ * called through a pointer, thus each syscall instruction is marked as a
+ * jump destination as well -- the instructions preceding it are never
+ * overwritten, and its syscall number is not known. An entry point right
+ * after a syscall instruction is not seen. The region is disassembled as
+ * a single part, starting at its first byte.
+ */
+void
+find_syscalls_in_region(struct intercept_desc *desc)
+{
+	desc->count = 0;
+	desc->parts = NULL;
+	desc->part_count = 0;
+	desc->fd = -1;
+	allocate_jump_blocks(desc);
+	allocate_nop_table(desc);
+
+	unsigned char *candidate = next_syscall_candidate(desc,
+	    desc->text_start);
+
+	if (candidate == NULL) {
+		debug_dump("no syscall instruction in %s at 0x%016" PRIxPTR
+		    "\n", desc->path, (uintptr_t)desc->text_start);
+		return;
+	}
+
+	while (candidate != NULL) {
+		track_jumps_around(desc, candidate);
+		candidate = next_syscall_candidate(desc, candidate + 1);
+	}
+
+	allocate_jump_table(desc);
+	mark_far_jumps(desc);
+
+	desc->parts = xmmap_anon(sizeof(desc->parts[0]));
+	add_text_part(desc, desc->text_start, desc->text_start,
+	    desc->text_end);
+	crawl_text_part(desc, desc->parts);
+
+	merge_text_parts(desc);
+	for (unsigned i = 0; i < desc->count; ++i)
+		mark_jump(desc, desc->items[i].syscall_addr);
+	check_syscall_numbers(desc);
+	remove_unselected_patches(desc);
+}
+
+/*
+ * The steps of find_syscalls_in_objects, called by run_workers.
+ */
+struct part_ref {
+	const struct intercept_desc *desc;
+	struct text_part *part;
+};
+
+static void
+find_syscalls_begin_step(void *descs, unsigned i)
+{
+	find_syscalls_begin((struct intercept_desc *)descs + i);
+}
+
+static void
+crawl_text_part_step(void *refs, unsigned i)
+{
+	struct part_ref *ref = (struct part_ref *)refs + i;
+
+	crawl_text_part(ref->desc, ref->part);
+}
+
+static void
+find_syscalls_end_step(void *descs, unsigned i)
+{
+	find_syscalls_end((struct intercept_desc *)descs + i);
+}
+
+/*
+ * find_syscalls_in_objects
+ * The same as calling find_syscalls on each object, but using multiple
+ * threads -- see workers.c. The first, and last steps of find_syscalls
+ * are done for different objects in parallel, and all parts of all text
+ * sections are disassembled in parallel between them. Each step is
+ * finished for all objects before the next one starts.
+ */
+void
+find_syscalls_in_objects(struct intercept_desc *descs, unsigned count)
+{
+	run_workers(find_syscalls_begin_step, descs, count);
+
+	unsigned part_count = 0;
+
+	for (unsigned i = 0; i < count; ++i)
+		part_count += descs[i].part_count;
+
+	if (part_count > 0) {
+		size_t size = part_count * sizeof(struct part_ref);
+		struct part_ref *refs = xmmap_anon(size);
+		struct part_ref *ref = refs;
+
+		for (unsigned i = 0; i < count; ++i) {
+			for (unsigned p = 0; p < descs[i].part_count; ++p) {
+				ref->desc = descs + i;
+				ref->part = descs[i].parts + p;
+				++ref;
+			}
+		}
+
+		run_workers(crawl_text_part_step, refs, part_count);
+		xmunmap(refs, size);
+	}
 
-	crawl_text(desc);
+	run_workers(find_syscalls_end_step, descs, count);
 }
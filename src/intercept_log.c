@@ -833,6 +833,9 @@ intercept_setup_log(const char *path, const char *trunc)
 	log_fd = (int)syscall_no_intercept(SYS_open, full_path, flags, 0700);
 
 	xabort_on_syserror(log_fd, "opening log");
+
+	/* every syscall must reach intercept_routine to be logged */
+	syscall_filter_select_all(true);
 }
 
 static char *
@@ -907,7 +910,7 @@ print_syscall(char *c, const struct syscall_desc *desc,
  * logged as well.
  */
 void
-intercept_log_syscall(const struct patch_desc *patch,
+intercept_log_syscall(const struct patch_site *site,
 			const struct syscall_desc *desc,
 			enum intercept_log_result result_known, long result)
 {
@@ -918,9 +921,9 @@ intercept_log_syscall(const struct patch_desc *patch,
 	char *c = buffer;
 
 	/* prefix: "/lib/libc.so 0x1234 -- " */
-	c = print_cstr(c, patch->containing_lib_path);
+	c = print_cstr(c, site->containing_lib_path);
 	c = print_cstr(c, " ");
-	c = print_hex(c, patch->syscall_offset);
+	c = print_hex(c, site->syscall_offset);
 	c = print_cstr(c, " -- ");
 
 	c = print_syscall(c, desc, result_known, result);
@@ -942,6 +945,16 @@ intercept_log(const char *buffer, size_t len)
 		syscall_no_intercept(SYS_write, log_fd, buffer, len);
 }
 
+/*
+ * intercept_log_is_enabled
+ * Is there a log file open?
+ */
+bool
+intercept_log_is_enabled(void)
+{
+	return log_fd >= 0;
+}
+
 /*
  * intercept_log_close
  * Closes the log, if one was open.
@@ -952,5 +965,6 @@ intercept_log_close(void)
 	if (log_fd >= 0) {
 		syscall_no_intercept(SYS_close, log_fd);
 		log_fd = -1;
+		syscall_filter_select_all(false);
 	}
 }
@@ -33,9 +33,10 @@
 #ifndef INTERCEPT_LOG_H
 #define INTERCEPT_LOG_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
-struct patch_desc;
+struct patch_site;
 struct syscall_desc;
 
 void intercept_setup_log(const char *path_base, const char *trunc);
@@ -43,11 +44,13 @@ void intercept_log(const char *buffer, size_t len);
 
 enum intercept_log_result { KNOWN, UNKNOWN };
 
-void intercept_log_syscall(const struct patch_desc *,
+void intercept_log_syscall(const struct patch_site *,
 				const struct syscall_desc *,
 				enum intercept_log_result result_known,
 				long result);
 
 void intercept_log_close(void);
 
+bool intercept_log_is_enabled(void);
+
 #endif
@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <syscall.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
@@ -101,6 +102,118 @@ xread(long fd, void *buffer, size_t size)
 		xabort_errno(syscall_error_code(result), __func__);
 }
 
+/* the number of times spin_lock executes pause before yielding */
+#define SPIN_PAUSE_COUNT 100
+
+bool
+spin_try_lock(int *lock)
+{
+	return __atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE) == 0;
+}
+
+void
+spin_lock(int *lock)
+{
+	unsigned spins = 0;
+
+	while (!spin_try_lock(lock)) {
+		if (spins < SPIN_PAUSE_COUNT) {
+			__builtin_ia32_pause();
+			++spins;
+		} else {
+			syscall_no_intercept(SYS_sched_yield);
+		}
+	}
+}
+
+void
+spin_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * copy_using_process_vm
+ * Copies memory using process_vm_readv, or process_vm_writev on the
+ * process itself. Returns the error code if the kernel refused, or zero.
+ */
+static long
+copy_using_process_vm(long nr, void *local, long remote, size_t size)
+{
+	struct iovec local_iov = { .iov_base = local, .iov_len = size };
+	struct iovec remote_iov = {
+		.iov_base = (void *)remote,
+		.iov_len = size
+	};
+
+	long result = syscall_no_intercept(nr,
+			syscall_no_intercept(SYS_getpid),
+			&local_iov, 1, &remote_iov, 1, 0);
+
+	if (result == (long)size)
+		return 0;
+
+	if (result >= 0)
+		return EFAULT;
+
+	return syscall_error_code(result);
+}
+
+/*
+ * copy_using_pipe
+ * Copies memory by writing it into a new pipe, and reading it back, used
+ * where process_vm_readv is not allowed, e.g. by a seccomp filter. Only
+ * used for a few bytes, less than the size of a pipe's buffer.
+ */
+static bool
+copy_using_pipe(void *dst, const void *src, size_t size)
+{
+	int fds[2];
+
+	if (syscall_no_intercept(SYS_pipe2, fds, O_CLOEXEC) != 0)
+		return false;
+
+	bool result =
+	    syscall_no_intercept(SYS_write, fds[1], src, size) ==
+		(long)size &&
+	    syscall_no_intercept(SYS_read, fds[0], dst, size) == (long)size;
+
+	syscall_no_intercept(SYS_close, fds[0]);
+	syscall_no_intercept(SYS_close, fds[1]);
+
+	return result;
+}
+
+bool
+read_user_memory(void *dst, long src, size_t size)
+{
+	long error = copy_using_process_vm(SYS_process_vm_readv,
+				dst, src, size);
+
+	if (error == 0)
+		return true;
+
+	if (error == EFAULT)
+		return false;
+
+	return copy_using_pipe(dst, (const void *)src, size);
+}
+
+bool
+write_user_memory(long dst, const void *src, size_t size)
+{
+	long error = copy_using_process_vm(SYS_process_vm_writev,
+				(void *)src, dst, size);
+
+	if (error == 0)
+		return true;
+
+	if (error == EFAULT)
+		return false;
+
+	return copy_using_pipe((void *)dst, src, size);
+}
+
 /* BEGIN CSTYLED */
 static const char *const error_strings[] = {
 #ifdef EPERM
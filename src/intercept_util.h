@@ -33,6 +33,7 @@
 #ifndef INTERCEPT_UTIL_H
 #define INTERCEPT_UTIL_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
@@ -81,6 +82,25 @@ long xlseek(long fd, unsigned long off, int whence);
  */
 void xread(long fd, void *buffer, size_t size);
 
+/*
+ * spin_try_lock, spin_lock, spin_unlock -- the spinlock used in the
+ * library, for an int initialized to zero. A thread waiting for it spins
+ * using the pause instruction for a while, then yields the CPU, as the
+ * thread holding it might not be running.
+ */
+bool spin_try_lock(int *lock);
+void spin_lock(int *lock);
+void spin_unlock(int *lock);
+
+/*
+ * read_user_memory, write_user_memory -- copy memory between a buffer of
+ * the library, and one whose address was passed to a syscall. The kernel
+ * checks the address, so an invalid one makes these return false, instead
+ * of crashing the process.
+ */
+bool read_user_memory(void *dst, long src, size_t size);
+bool write_user_memory(long dst, const void *src, size_t size);
+
 /*
  * strerror_no_intercept - returns a pointer to a C string associated with
  * an errno value.
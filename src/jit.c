@@ -0,0 +1,405 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * jit.c -- patching syscall instructions in code generated at runtime,
+ * when the INTERCEPT_JIT environment variable is set.
+ *
+ * JIT compilers emit code into anonymous memory, which is not part of any
+ * object listed by dl_iterate_phdr. In this mode, the mprotect syscalls
+ * making memory executable, and not writable, are watched: such a range of
+ * memory is scanned for the syscall instruction's bytes, and if any are
+ * found, it is disassembled, and patched the same way as an object loaded
+ * after startup. Each such range is a JIT region, with its own struct
+ * intercept_desc. An anonymous mmap with PROT_EXEC is not scanned, the new
+ * memory is filled with zeros -- code written into memory that is writable,
+ * and executable at the same time is not seen at all.
+ *
+ * A region is forgotten, without restoring its original code, before it is
+ * unmapped, replaced, moved, or made writable ( usually for writing new
+ * code into it ), as the code kept for deactivating the patches would
+ * overwrite whatever is there later. The patches already written stay in
+ * place until the JIT compiler overwrites them, their wrappers are never
+ * released -- a thread might still return into one. Once the wrappers of
+ * the regions take up MAX_JIT_WRAPPER_SPACE bytes, new regions are skipped.
+ * The regions are also forgotten by intercept_deactivate, after
+ * restoring their code -- the code generated before intercept_activate is
+ * only patched again once it is made executable again.
+ *
+ * Syscall instructions without enough space around them for a jump are
+ * not patched, only counted, and reported in the log. These are still
+ * intercepted with INTERCEPT_USER_DISPATCH, see syscall_dispatch.c
+ *
+ * Unlike an object file, a JIT region has no symbols, or relocation
+ * entries marking jump destinations, see find_syscalls_in_region.
+ */
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syscall.h>
+
+#include "intercept.h"
+#include "intercept_log.h"
+#include "intercept_util.h"
+#include "libsyscall_intercept_hook_point.h"
+
+bool jit_enabled;
+
+/*
+ * The regions patched, a region is in use while its text_start is not
+ * NULL. Only the first region_limit entries were ever used. The text_start,
+ * and text_end fields are read by jit_region_changes without holding the
+ * patching lock, the rest is only accessed while holding it.
+ */
+#define MAX_JIT_REGIONS 0x100
+
+static struct intercept_desc *regions;
+static unsigned region_limit;
+
+/*
+ * Larger ranges are not scanned, only counted as skipped -- JIT compilers
+ * make code executable in much smaller pieces.
+ */
+#define MAX_JIT_REGION_SIZE (16 * 1024 * 1024)
+
+/*
+ * The wrapper space used by regions, at least a page per region, or a huge
+ * page with hugetlb pages, see mprotect_asm_wrappers in patcher.c.
+ */
+#define MAX_JIT_WRAPPER_SPACE ((size_t)64 * 1024 * 1024)
+
+static size_t wrapper_space_used;
+
+static const char jit_path[] = "[jit]";
+
+/* The totals written to the log with each region patched */
+static unsigned long patched_total;
+static unsigned long unpatched_total;
+static unsigned long skipped_total;
+
+/*
+ * jit_setup -- turns the mode on if value is not NULL, i.e. the
+ * INTERCEPT_JIT environment variable is set. The syscalls watched are
+ * intercepted even if the syscall filter does not select them.
+ */
+void
+jit_setup(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	regions = xmmap_anon(MAX_JIT_REGIONS * sizeof(regions[0]));
+
+	syscall_filter_require(SYS_mmap);
+	syscall_filter_require(SYS_mprotect);
+	syscall_filter_require(SYS_munmap);
+	syscall_filter_require(SYS_mremap);
+
+	jit_enabled = true;
+}
+
+static unsigned char *
+region_start(const struct intercept_desc *region)
+{
+	return __atomic_load_n(&region->text_start, __ATOMIC_ACQUIRE);
+}
+
+static bool
+overlaps_region(const struct intercept_desc *region,
+		const struct range *range)
+{
+	unsigned char *start = region_start(region);
+
+	return start != NULL &&
+	    start < range->address + range->size &&
+	    range->address <= region->text_end;
+}
+
+/*
+ * jit_region_changes
+ * Called before executing a syscall, returns true if it might unmap,
+ * replace, move, or make writable any of the regions patched -- the range
+ * affected is returned in range, to be passed to jit_forget_regions.
+ */
+bool
+jit_region_changes(const struct syscall_desc *desc, struct range *range)
+{
+	switch (desc->nr) {
+		case SYS_munmap:
+		case SYS_mremap:
+			break;
+		case SYS_mprotect:
+			if ((desc->args[2] & PROT_EXEC) &&
+			    !(desc->args[2] & PROT_WRITE))
+				return false;
+			break;
+		case SYS_mmap:
+			if (!(desc->args[3] & MAP_FIXED))
+				return false;
+			break;
+		default:
+			return false;
+	}
+
+	range->address = (unsigned char *)desc->args[0];
+	range->size = (size_t)desc->args[1];
+
+	unsigned limit = __atomic_load_n(&region_limit, __ATOMIC_ACQUIRE);
+
+	for (unsigned i = 0; i < limit; ++i) {
+		if (overlaps_region(regions + i, range))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * jit_code_added
+ * Called after executing a syscall, returns true if it made memory
+ * containing the bytes of a syscall instruction executable, and not
+ * writable. The range is returned in range, to be passed to
+ * jit_patch_region. This runs on the thread issuing the syscall, so the
+ * bytes are compared one by one, without using SIMD registers, see
+ * SOURCES_C_INTERCEPTING in CMakeLists.txt -- ranges too large for
+ * scanning are passed to jit_patch_region as well, to be counted there.
+ */
+bool
+jit_code_added(const struct syscall_desc *desc, long result,
+		struct range *range)
+{
+	if (desc->nr != SYS_mprotect || syscall_error_code(result) != 0)
+		return false;
+
+	long prot = desc->args[2];
+
+	if (!(prot & PROT_EXEC) || !(prot & PROT_READ) || (prot & PROT_WRITE))
+		return false;
+
+	range->address = (unsigned char *)desc->args[0];
+	range->size = (size_t)desc->args[1];
+
+	if (range->size < SYSCALL_INS_SIZE)
+		return false;
+
+	if (range->size > MAX_JIT_REGION_SIZE)
+		return true;
+
+	for (size_t i = 0; i + 1 < range->size; ++i) {
+		if (range->address[i] == 0x0f && range->address[i + 1] == 0x05)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+release_region(struct intercept_desc *region)
+{
+	forget_patches(region);
+	__atomic_store_n(&region->text_start, NULL, __ATOMIC_RELEASE);
+}
+
+/*
+ * jit_forget_regions -- forgets the regions overlapping the range, see
+ * jit_region_changes
+ */
+void
+jit_forget_regions(void *arg)
+{
+	const struct range *range = arg;
+
+	for (unsigned i = 0; i < region_limit; ++i) {
+		struct intercept_desc *region = regions + i;
+
+		if (!overlaps_region(region, range))
+			continue;
+
+		debug_dump("forget jit region at 0x%016" PRIxPTR "\n",
+		    (uintptr_t)region->text_start);
+
+		release_region(region);
+	}
+}
+
+/*
+ * The dl_iterate_phdr callback checking if a range is in an executable
+ * segment of a loaded object, e.g. the dynamic loader making a text
+ * segment executable again after applying text relocations to it.
+ */
+static int
+check_loaded_object(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void) size;
+	const struct range *range = data;
+
+	for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+		const ElfW(Phdr) *phdr = info->dlpi_phdr + i;
+		unsigned char *start = (unsigned char *)
+		    (info->dlpi_addr + phdr->p_vaddr);
+
+		if (phdr->p_type != PT_LOAD || (phdr->p_flags & PF_X) == 0)
+			continue;
+
+		if (start < range->address + range->size &&
+		    range->address < start + phdr->p_memsz)
+			return 1;
+	}
+
+	return 0;
+}
+
+static struct intercept_desc *
+allocate_region(void)
+{
+	for (unsigned i = 0; i < region_limit; ++i) {
+		if (region_start(regions + i) == NULL)
+			return regions + i;
+	}
+
+	if (region_limit == MAX_JIT_REGIONS)
+		return NULL;
+
+	__atomic_store_n(&region_limit, region_limit + 1, __ATOMIC_RELEASE);
+
+	return regions + region_limit - 1;
+}
+
+static void
+log_region(const struct intercept_desc *region, const char *what)
+{
+	char buffer[0x100];
+
+	int l = snprintf(buffer, sizeof(buffer),
+		"jit region 0x%lx - 0x%lx %s, %lu syscalls patched, "
+		"%lu not patched, %lu regions skipped\n",
+		(unsigned long)region->text_start,
+		(unsigned long)region->text_end + 1, what,
+		patched_total, unpatched_total, skipped_total);
+
+	intercept_log(buffer, (size_t)l);
+	debug_dump("%s", buffer);
+}
+
+/*
+ * jit_patch_region
+ * Patches the syscall instructions found in a range of memory made
+ * executable, see jit_code_added. The regions overlapping the range are
+ * forgotten first, unless the range is inside one of them -- i.e. the
+ * same code was made executable again.
+ */
+void
+jit_patch_region(void *arg)
+{
+	const struct range *range = arg;
+	struct intercept_desc *region;
+
+	if (dl_iterate_phdr(check_loaded_object, (void *)range) != 0)
+		return;
+
+	for (unsigned i = 0; i < region_limit; ++i) {
+		region = regions + i;
+
+		if (overlaps_region(region, range) &&
+		    region->text_start <= range->address &&
+		    range->address + range->size <= region->text_end + 1)
+			return;
+	}
+
+	jit_forget_regions(arg);
+
+	bool out_of_space = wrapper_space_used >= MAX_JIT_WRAPPER_SPACE;
+
+	if (out_of_space || range->size > MAX_JIT_REGION_SIZE ||
+	    (region = allocate_region()) == NULL) {
+		struct intercept_desc skipped = {
+			.text_start = range->address,
+			.text_end = range->address + range->size - 1,
+		};
+
+		++skipped_total;
+		log_region(&skipped, out_of_space ?
+		    "skipped, wrapper space limit reached" : "skipped");
+		return;
+	}
+
+	size_t space_before = asm_wrapper_space();
+
+	memset(region, 0, sizeof(*region));
+	region->path = jit_path;
+	region->base_addr = range->address;
+	region->text_end = range->address + range->size - 1;
+	__atomic_store_n(&region->text_start, range->address,
+	    __ATOMIC_RELEASE);
+	region->is_jit_region = true;
+	region->uses_live_patching = true;
+
+	find_syscalls_in_region(region);
+	create_patch_wrappers(region);
+	mprotect_asm_wrappers();
+	activate_patches(region);
+
+	wrapper_space_used += asm_wrapper_space() - space_before;
+
+	patched_total += region->count;
+	unpatched_total += region->unpatched_count;
+	log_region(region, "patched");
+
+	release_patching_tables(region);
+
+	if (region->writes == NULL)
+		release_region(region);
+}
+
+/*
+ * jit_deactivate_regions
+ * Restores the original code of all regions, and forgets them, called
+ * by intercept_deactivate.
+ */
+void
+jit_deactivate_regions(void)
+{
+	for (unsigned i = 0; i < region_limit; ++i) {
+		struct intercept_desc *region = regions + i;
+
+		if (region_start(region) == NULL)
+			continue;
+
+		deactivate_patches(region);
+		release_region(region);
+	}
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * live_patch.c -- overwriting instructions while other threads might be
+ * executing them.
+ *
+ * The objects found at startup are patched before any other thread exists,
+ * those loaded later ( see patch_new_objects in intercept.c ) are patched in
+ * a process that might have any number of threads running -- as are all
+ * objects by intercept_activate, and intercept_deactivate. Modifying code
+ * another CPU might be executing at the same time is only safe in a few
+ * well defined ways on x86, so each instruction is written as follows:
+ *
+ *  1) An int3 instruction replaces the first byte of the original code.
+ *  2) The rest of the new instruction is written, after each CPU executing
+ *     a thread of the process went through a serializing instruction --
+ *     i.e. no CPU can be executing the original instruction anymore.
+ *  3) The first byte of the new instruction replaces the int3, again
+ *     after serializing each CPU.
+ *
+ * A thread reaching an int3 written in step 1 gets a SIGTRAP, and is
+ * redirected by handle_sigtrap to the address where it would continue
+ * after executing the new instruction. Threads continuing at one of the bytes
+ * after the first one, e.g. a thread blocked in a syscall being patched,
+ * are not handled here in general: the patcher only writes jumps covering a
+ * single original instruction this way, and the original instructions
+ * after the jump are handled using resume points -- see add_resume_points,
+ * and is_live_patchable in patcher.c.
+ *
+ * As a thread might reach a resume point any time later, handle_sigtrap is
+ * installed at startup, and stays installed: the rt_sigaction syscalls of
+ * the program for SIGTRAP are emulated by replace_sigtrap_action, the
+ * handler set by the program is called from forward_sigtrap.
+ */
+
+#include <errno.h>
+#include <linux/membarrier.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <syscall.h>
+#include <ucontext.h>
+
+#include "intercept.h"
+#include "intercept_util.h"
+#include "libsyscall_intercept_hook_point.h"
+
+#ifndef SYS_membarrier
+#define SYS_membarrier 324
+#endif
+
+/*
+ * The instructions being written by live_patch, published for
+ * handle_sigtrap. The handlers_running counter is used for making sure
+ * no signal handler reads these, when live_patch returns -- or a block
+ * of resume points, when remove_resume_points returns.
+ */
+static const struct code_write *active_writes;
+static unsigned active_write_count;
+static unsigned handlers_running;
+
+/*
+ * The resume points of the patches made so far, a block for each object,
+ * or JIT region. The list is only changed while holding the patching lock
+ * ( see lock_patching in intercept.c ), but read by handle_sigtrap on any
+ * thread.
+ */
+struct resume_block {
+	struct resume_block *next;
+	size_t size;
+	unsigned count;
+	struct resume_point points[];
+};
+
+static struct resume_block *resume_blocks;
+
+/*
+ * The SIGTRAP handler set by the program, or the one in effect before the
+ * one installed here. A new one is published by replacing the pointer, the
+ * old ones are not unmapped, see previous_action in syscall_dispatch.c
+ */
+static struct kernel_sigaction initial_action;
+static struct kernel_sigaction *previous_action = &initial_action;
+
+/* serializes replacing the handler, and previous_action */
+static int sigtrap_lock;
+
+static const struct kernel_sigaction *
+load_previous_action(void)
+{
+	return __atomic_load_n(&previous_action, __ATOMIC_ACQUIRE);
+}
+
+static const struct kernel_sigaction *
+publish_previous_action(const struct kernel_sigaction *action)
+{
+	struct kernel_sigaction *copy = xmmap_anon(sizeof(*copy));
+
+	*copy = *action;
+
+	return __atomic_exchange_n(&previous_action, copy, __ATOMIC_ACQ_REL);
+}
+
+static bool use_membarrier;
+static unsigned char *serializing_page;
+
+#define SERIALIZING_PAGE_SIZE ((size_t)0x1000)
+
+/*
+ * find_redirect -- is the address that of an instruction being written?
+ */
+static unsigned char *
+find_redirect(const unsigned char *address)
+{
+	const struct code_write *writes =
+		__atomic_load_n(&active_writes, __ATOMIC_SEQ_CST);
+
+	if (writes == NULL)
+		return NULL;
+
+	for (unsigned i = 0; i < active_write_count; ++i) {
+		if (writes[i].address == address)
+			return writes[i].redirect;
+	}
+
+	return NULL;
+}
+
+static unsigned char *
+find_resume_point(const unsigned char *address)
+{
+	const struct resume_block *block =
+		__atomic_load_n(&resume_blocks, __ATOMIC_ACQUIRE);
+
+	for (; block != NULL;
+	    block = __atomic_load_n(&block->next, __ATOMIC_ACQUIRE)) {
+		for (unsigned i = 0; i < block->count; ++i) {
+			if (block->points[i].address == address)
+				return block->points[i].target;
+		}
+	}
+
+	return NULL;
+}
+
+static void
+set_sigtrap_action(const struct kernel_sigaction *action,
+			struct kernel_sigaction *old)
+{
+	long result = syscall_no_intercept(SYS_rt_sigaction, SIGTRAP,
+			action, old, sizeof(action->mask));
+
+	xabort_on_syserror(result, "rt_sigaction SIGTRAP");
+}
+
+/*
+ * forward_sigtrap -- a SIGTRAP not caused by live_patch is handled the
+ * way it would be without this library.
+ */
+static void
+forward_sigtrap(int sig, siginfo_t *info, void *context)
+{
+	const struct kernel_sigaction *action = load_previous_action();
+
+	if (action->u.handler == SIG_IGN)
+		return;
+
+	if (action->u.handler == SIG_DFL) {
+		/*
+		 * Raised again, with the default action in effect once
+		 * this handler returns.
+		 */
+		set_sigtrap_action(action, NULL);
+		syscall_no_intercept(SYS_tgkill,
+			syscall_no_intercept(SYS_getpid),
+			syscall_no_intercept(SYS_gettid), SIGTRAP);
+		return;
+	}
+
+	if (action->flags & SA_SIGINFO)
+		action->u.sigaction(sig, info, context);
+	else
+		action->u.handler(sig);
+}
+
+/*
+ * handle_sigtrap
+ * A thread executing an int3 instruction written by live_patch continues at
+ * the address where it would after executing the instruction being written
+ * there. If the int3 is not there anymore, the thread just executes the
+ * new instruction.
+ */
+static void
+handle_sigtrap(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	unsigned char *trap;
+	unsigned char *target;
+
+	if (info->si_code != SI_KERNEL) {
+		forward_sigtrap(sig, info, context);
+		return;
+	}
+
+	trap = (unsigned char *)uc->uc_mcontext.gregs[REG_RIP] - 1;
+
+	__atomic_add_fetch(&handlers_running, 1, __ATOMIC_SEQ_CST);
+	target = find_redirect(trap);
+
+	if (target == NULL &&
+	    __atomic_load_n(trap, __ATOMIC_RELAXED) != INT3_OPCODE)
+		target = trap;
+
+	if (target == NULL)
+		target = find_resume_point(trap);
+	__atomic_sub_fetch(&handlers_running, 1, __ATOMIC_SEQ_CST);
+
+	if (target == NULL) {
+		forward_sigtrap(sig, info, context);
+		return;
+	}
+
+	uc->uc_mcontext.gregs[REG_RIP] = (greg_t)target;
+}
+
+/*
+ * install_sigtrap_handler -- done at startup, and again before each
+ * live_patch call, in case the program replaced the handler using a syscall
+ * not intercepted since then.
+ */
+static void
+install_sigtrap_handler(void)
+{
+	struct kernel_sigaction action = {
+		.u.sigaction = handle_sigtrap,
+		.flags = SA_SIGINFO | SA_RESTART | SA_RESTORER,
+		.restorer = intercept_restore_rt,
+		.mask = 0,
+	};
+	struct kernel_sigaction old;
+
+	spin_lock(&sigtrap_lock);
+
+	set_sigtrap_action(&action, &old);
+
+	if (old.u.sigaction != handle_sigtrap)
+		publish_previous_action(&old);
+
+	spin_unlock(&sigtrap_lock);
+}
+
+/*
+ * live_patch_setup -- installs handle_sigtrap, called at startup. The
+ * rt_sigaction syscalls are seen by intercept_routine, even when not
+ * selected by the syscall filter.
+ */
+void
+live_patch_setup(void)
+{
+	install_sigtrap_handler();
+	syscall_filter_require(SYS_rt_sigaction);
+}
+
+/*
+ * replace_sigtrap_action
+ * Executes rt_sigaction for SIGTRAP, without changing the handler installed
+ * here -- the program's handler is only stored, and called from
+ * forward_sigtrap. Fails the way the kernel would, on an invalid set size,
+ * or address.
+ */
+long
+replace_sigtrap_action(long new, long old, long set_size)
+{
+	struct kernel_sigaction action;
+	const struct kernel_sigaction *previous;
+
+	if (set_size != sizeof(action.mask))
+		return -EINVAL;
+
+	if (new != 0 && !read_user_memory(&action, new, sizeof(action)))
+		return -EFAULT;
+
+	spin_lock(&sigtrap_lock);
+
+	if (new != 0)
+		previous = publish_previous_action(&action);
+	else
+		previous = load_previous_action();
+
+	spin_unlock(&sigtrap_lock);
+
+	if (old != 0 && !write_user_memory(old, previous, sizeof(*previous)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * serialize_cores
+ * Makes sure every CPU running a thread of the process executes a
+ * serializing instruction before this returns. The membarrier syscall does
+ * exactly this on Linux 4.16 and newer. On older kernels, changing the
+ * permissions of a page in use interrupts such CPUs, returning from the
+ * interrupt serializes them.
+ */
+static void
+serialize_cores(void)
+{
+	if (use_membarrier) {
+		long result = syscall_no_intercept(SYS_membarrier,
+			MEMBARRIER_CMD_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+
+		xabort_on_syserror(result, "membarrier");
+		return;
+	}
+
+	long result = syscall_no_intercept(SYS_mprotect, serializing_page,
+			SERIALIZING_PAGE_SIZE, PROT_READ | PROT_WRITE);
+
+	xabort_on_syserror(result, "mprotect serializing page");
+	__atomic_store_n(serializing_page, 1, __ATOMIC_SEQ_CST);
+
+	result = syscall_no_intercept(SYS_mprotect, serializing_page,
+			SERIALIZING_PAGE_SIZE, PROT_NONE);
+
+	xabort_on_syserror(result, "mprotect serializing page");
+}
+
+static void
+setup_serialize_cores(void)
+{
+	static bool done;
+
+	if (done)
+		return;
+
+	done = true;
+
+	long result = syscall_no_intercept(SYS_membarrier,
+		MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_SYNC_CORE, 0);
+
+	if (syscall_error_code(result) == 0) {
+		use_membarrier = true;
+		return;
+	}
+
+	serializing_page = xmmap_anon(SERIALIZING_PAGE_SIZE);
+}
+
+/*
+ * add_resume_points
+ * A resume point is an address in the original code, which a thread might
+ * continue at after the code around a syscall is patched, i.e. the address
+ * of an instruction overwritten with int3 instructions: the one following
+ * the syscall instruction, when a thread is blocked in the syscall, or the
+ * syscall instruction itself, and the one before it, when a thread is
+ * preempted there. Such a thread is redirected to the target address, i.e.
+ * to the copy of the same instruction in the asm wrapper. These are kept
+ * as long as the code patched, as a thread can be blocked in a syscall for
+ * any amount of time. Returns the block to be passed to
+ * remove_resume_points, once the code is gone.
+ */
+struct resume_block *
+add_resume_points(const struct resume_point *points, unsigned count)
+{
+	if (count == 0)
+		return NULL;
+
+	size_t size = sizeof(struct resume_block) +
+			count * sizeof(points[0]);
+	struct resume_block *block = xmmap_anon(size);
+
+	block->size = size;
+	block->count = count;
+	memcpy(block->points, points, count * sizeof(points[0]));
+	block->next = resume_blocks;
+
+	__atomic_store_n(&resume_blocks, block, __ATOMIC_RELEASE);
+
+	return block;
+}
+
+/*
+ * wait_for_handlers -- waits for the handle_sigtrap calls that might
+ * have seen something just unpublished.
+ */
+static void
+wait_for_handlers(void)
+{
+	while (__atomic_load_n(&handlers_running, __ATOMIC_SEQ_CST) != 0)
+		syscall_no_intercept(SYS_sched_yield);
+}
+
+/*
+ * remove_resume_points
+ * Drops a block returned by add_resume_points, when the code patched is
+ * unmapped, or overwritten -- an int3 written there later is not one of
+ * ours. The block is unmapped once no handle_sigtrap call can be reading it.
+ */
+void
+remove_resume_points(struct resume_block *block)
+{
+	struct resume_block **link = &resume_blocks;
+
+	if (block == NULL)
+		return;
+
+	while (*link != block) {
+		if (*link == NULL)
+			return;
+		link = &(*link)->next;
+	}
+
+	__atomic_store_n(link, block->next, __ATOMIC_SEQ_CST);
+	wait_for_handlers();
+	xmunmap(block, block->size);
+}
+
+/*
+ * live_patch
+ * Writes the instructions, following the steps described at the top of this
+ * file. The code must be writable, and each address must be the beginning
+ * of an instruction in the original code. Every write is done in each step,
+ * before moving on to the next step, so the number of syscalls used
+ * does not depend on the number of instructions written.
+ */
+void
+live_patch(const struct code_write *writes, unsigned count)
+{
+	if (count == 0)
+		return;
+
+	setup_serialize_cores();
+	install_sigtrap_handler();
+
+	active_write_count = count;
+	__atomic_store_n(&active_writes, writes, __ATOMIC_SEQ_CST);
+
+	for (unsigned i = 0; i < count; ++i)
+		__atomic_store_n(writes[i].address, INT3_OPCODE,
+				__ATOMIC_RELAXED);
+
+	serialize_cores();
+
+	for (unsigned i = 0; i < count; ++i)
+		memcpy(writes[i].address + 1, writes[i].code + 1,
+		    writes[i].length - 1);
+
+	serialize_cores();
+
+	for (unsigned i = 0; i < count; ++i)
+		__atomic_store_n(writes[i].address, writes[i].code[0],
+				__ATOMIC_RELAXED);
+
+	serialize_cores();
+
+	__atomic_store_n(&active_writes, NULL, __ATOMIC_SEQ_CST);
+	wait_for_handlers();
+}
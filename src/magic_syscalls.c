@@ -32,14 +32,35 @@
 
 #ifndef SYSCALL_INTERCEPT_WITHOUT_MAGIC_SYSCALLS
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
-#include <string.h>
 
 #include "magic_syscalls.h"
 #include "intercept.h"
 #include "intercept_util.h"
 #include "intercept_log.h"
 
+/*
+ * message_equals - a replacement for strncmp, as this code is called from
+ * the asm wrappers, and must not call into libc. Functions in libc are
+ * free to use SIMD registers, which might not be saved by the asm wrappers,
+ * see select_wrapper_level1 in patcher.c
+ */
+static bool
+message_equals(const char *message, const char *expected, size_t len)
+{
+	for (size_t i = 0; i < len; ++i) {
+		if (message[i] != expected[i])
+			return false;
+
+		if (message[i] == '\0')
+			break;
+	}
+
+	return true;
+}
+
 /*
  * handle_magic_syscalls - this routine performs two tasks:
  * recognizes 'magic' syscalls, and, if executes commands based
@@ -59,7 +80,7 @@ handle_magic_syscalls(struct syscall_desc *desc, long *result)
 	const char *message = (void *)(uintptr_t)desc->args[1];
 	size_t len = (size_t)desc->args[2];
 
-	if (strncmp(message, start_log_message, len) == 0) {
+	if (message_equals(message, start_log_message, len)) {
 		const char *path = (const void *)(uintptr_t)desc->args[3];
 		const char *trunc = (const void *)(uintptr_t)desc->args[4];
 		intercept_setup_log(path, trunc);
@@ -67,7 +88,7 @@ handle_magic_syscalls(struct syscall_desc *desc, long *result)
 		return 0;
 	}
 
-	if (strncmp(message, stop_log_message, len) == 0) {
+	if (message_equals(message, stop_log_message, len)) {
 		intercept_log_close();
 		*result = (long)len;
 		return 0;
@@ -38,47 +38,51 @@
  *     /--------------------------\
  *     |               subject.so |
  *     |                          |
- *     |  jmp to_trampoline_table |  patched by activate_patches()
+ *     |  jmp wrapper             |  patched by activate_patches()
  *  /->|   |                      |
  *  |  \___|______________________/
  *  |      |
  *  |  /---|--------------------------\
- *  |  | movabs %r11, wrapper_address | jmp generated by activate_patches()
- *  |  | jmp *%r11                    | This allows subject.so and
- *  |  |   |                          | libsyscall_intercept.so to be farther
- *  |  \___|__________________________/ than 2 gigabytes from each other
- *  |      |
- *  |  /---|-----------------------------\
- *  |  |   |  libsyscall_intercept.so    |
- *  |  |   |                             |
- *  |  | /-|--------------------------\  |
- *  |  | | |  static unsigned char    |  |
- *  |  | | |  asm_wrapper_space[]     |  |
- *  |  | | |    in BSS                |  | wrapper routine
- *  |  | | |                          |  | generated into asm_wrapper_space
- *  |  | | |                          |  | by create_wrapper()
- *  |  | |wrapper routine             |  |
- *  |  | |calls C hook function  ----------> intercept_routine in intercept.c
- *  |  | |movabs %r11, return_address |  |
- *  |  | |jmp *%r11                   |  |
- *  |  | \_|__________________________/  |
- *  |  \___|_____________________________/
+ *  |  |   |  anonymous memory mapped  |
+ *  |  |   |  within 2 gigabytes of    | wrapper routine generated by
+ *  |  |   |  subject.so               | create_wrapper(), into a chunk
+ *  |  |   |                           | allocated by get_wrapper_chunk()
+ *  |  |wrapper routine                |
+ *  |  |movabs %r11, intercept_wrapper |
+ *  |  |call *%r11  ---------------------> intercept_wrapper in
+ *  |  |   |                           |   libsyscall_intercept.so,
+ *  |  |   |                           |   calling intercept_routine
+ *  |  |jmp return_address             |
+ *  |  \___|___________________________/
  *  |      |
  *  \______/
  *
+ * Both jumps are direct jumps with 32 bit displacements, only the call
+ * into libsyscall_intercept.so -- which can be farther than 2 gigabytes
+ * from subject.so -- is an indirect one.
+ *
+ * The asm_pattern tests use a table of trampoline jumps to reach
+ * the wrappers instead:
+ *
+ *     jmp to_trampoline_table  -->  movabs %r11, wrapper_address
+ *                                   jmp *%r11
+ *
  */
 
 #include "intercept.h"
 #include "intercept_util.h"
 #include "intercept_log.h"
+#include "libsyscall_intercept_hook_point.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdint.h>
 #include <syscall.h>
 #include <sys/mman.h>
 #include <string.h>
 
 #include <stdio.h>
+#include <stdlib.h>
 
 #define PAGE_SIZE ((size_t)0x1000)
 
@@ -91,12 +95,14 @@ round_down_address(unsigned char *address)
 	return (unsigned char *)(((uintptr_t)address) & ~(PAGE_SIZE - 1));
 }
 
-
-static unsigned char asm_wrapper_space[0x100000];
-
-static unsigned char *next_asm_wrapper_space = asm_wrapper_space + PAGE_SIZE;
-
-static void create_wrapper(struct patch_desc *patch);
+static void create_wrapper(struct intercept_desc *desc,
+				struct patch_desc *patch);
+static void create_compact_wrapper(struct intercept_desc *desc,
+				struct patch_desc *patch);
+static void encode_jump(unsigned char *code, unsigned char opcode,
+				unsigned char *from, void *to);
+static void encode_short_branch(unsigned char *code, unsigned char opcode,
+				unsigned char *from, unsigned char *to);
 
 /*
  * create_absolute_jump(from, to)
@@ -138,6 +144,18 @@ create_absolute_jump(unsigned char *from, void *to)
  */
 void
 create_jump(unsigned char opcode, unsigned char *from, void *to)
+{
+	encode_jump(from, opcode, from, to);
+}
+
+/*
+ * encode_jump(code, opcode, from, to)
+ * Same as create_jump, except the instruction is stored at code, to be
+ * copied to the from address later.
+ */
+static void
+encode_jump(unsigned char *code, unsigned char opcode,
+		unsigned char *from, void *to)
 {
 	/*
 	 * The operand is the difference between the
@@ -153,11 +171,11 @@ create_jump(unsigned char opcode, unsigned char *from, void *to)
 	int32_t delta32 = (int32_t)delta;
 	unsigned char *d = (unsigned char *)&delta32;
 
-	from[0] = opcode;
-	from[1] = d[0];
-	from[2] = d[1];
-	from[3] = d[2];
-	from[4] = d[3];
+	code[0] = opcode;
+	code[1] = d[0];
+	code[2] = d[1];
+	code[3] = d[2];
+	code[4] = d[3];
 }
 
 /*
@@ -235,12 +253,7 @@ assign_nop_trampoline(struct intercept_desc *desc,
 		struct patch_desc *patch,
 		size_t *next_nop_i)
 {
-	struct range *nop = desc->nop_table + *next_nop_i;
-
-	if (*next_nop_i >= desc->nop_count) {
-		patch->uses_nop_trampoline = false;
-		return; /* no more nops available */
-	}
+	patch->uses_nop_trampoline = false;
 
 	/*
 	 * Consider a nop instruction, to use as trampoline, but only
@@ -249,23 +262,28 @@ assign_nop_trampoline(struct intercept_desc *desc,
 	 *  1) at an address too low
 	 *  2) close enough for a two byte jump
 	 *  3) at an address too high
+	 *
+	 * This is a loop rather than recursion, as a large text section can
+	 * have tens of thousands of NOPs before the first syscall, and this
+	 * might run on a thread with a small stack ( see workers.c ).
 	 */
+	for (; *next_nop_i < desc->nop_count; ++(*next_nop_i)) {
+		struct range *nop = desc->nop_table + *next_nop_i;
+
+		if (is_nop_in_range(patch->syscall_addr, nop)) {
+			patch->uses_nop_trampoline = true;
+			patch->nop_trampoline = *nop;
+			++(*next_nop_i);
+			return; /* found a nop in range to use as trampoline */
+		}
 
-	if (is_nop_in_range(patch->syscall_addr, nop)) {
-		patch->uses_nop_trampoline = true;
-		patch->nop_trampoline = *nop;
-		++(*next_nop_i);
-		return; /* found a nop in range to use as trampoline */
-	}
+		if (nop->address > patch->syscall_addr)
+			return; /* nop is too far ahead */
 
-	if (nop->address > patch->syscall_addr) {
-		patch->uses_nop_trampoline = false;
-		return; /* nop is too far ahead */
+		/* nop is too far behind, try the next nop */
 	}
 
-	/* nop is too far behind, try the next nop */
-	++(*next_nop_i);
-	assign_nop_trampoline(desc, patch, next_nop_i);
+	/* no more nops available */
 }
 
 /*
@@ -341,6 +359,120 @@ check_surrounding_instructions(struct intercept_desc *desc,
 		patch->syscall_addr + SYSCALL_INS_SIZE);
 }
 
+/*
+ * allocate_patch_sites
+ * The struct patch_site instances of all objects are allocated one after
+ * the other, from pages used for nothing else. These are never released,
+ * the asm wrappers refer to them.
+ */
+static struct patch_site *
+allocate_patch_sites(unsigned count)
+{
+	static struct patch_site *next;
+	static size_t available;
+	struct patch_site *result;
+
+	if (count == 0)
+		return NULL;
+
+	if (count > available) {
+		size_t size = count * sizeof(*next);
+
+		size = (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+		next = xmmap_anon(size);
+		available = size / sizeof(*next);
+	}
+
+	result = next;
+	next += count;
+	available -= count;
+
+	return result;
+}
+
+/*
+ * is_live_patchable
+ * Can the patch be written while other threads are running? A thread can be
+ * at the beginning of any of the original instructions being overwritten,
+ * e.g. one preempted right before the syscall instruction, or one blocked
+ * in the syscall. A thread at the beginning of an instruction overwritten by
+ * the int3 instructions after the jump continues at the copy of the same
+ * instruction in the wrapper -- see add_resume_point. But a thread returning
+ * into the middle of the jump would execute the bytes of its displacement,
+ * so the jump must not cover the beginning of any other instruction.
+ *
+ * A short jump to a NOP trampoline only replaces the syscall instruction.
+ */
+static bool
+is_live_patchable(const struct patch_desc *patch)
+{
+	unsigned char *jump_end = patch->dst_jmp_patch + JUMP_INS_SIZE;
+
+	if (patch->uses_nop_trampoline)
+		return true;
+
+	if (patch->uses_prev_ins_2 &&
+	    patch->syscall_addr - patch->preceding_ins.length < jump_end)
+		return false;
+
+	if (patch->uses_prev_ins && patch->syscall_addr < jump_end)
+		return false;
+
+	return patch->syscall_addr + SYSCALL_INS_SIZE >= jump_end;
+}
+
+/*
+ * make_live_patchable
+ * Moves the jump from the second preceding instruction to the preceding
+ * one, if that makes the patch live patchable, i.e. when the preceding
+ * instruction alone is long enough for the jump. Returns false, if the
+ * patch can not be written while other threads are running.
+ */
+static bool
+make_live_patchable(struct patch_desc *patch)
+{
+	if (is_live_patchable(patch))
+		return true;
+
+	if (!patch->uses_prev_ins_2)
+		return false;
+
+	struct patch_desc shorter = *patch;
+
+	shorter.uses_prev_ins_2 = false;
+	shorter.dst_jmp_patch += patch->preceding_ins_2.length;
+
+	if (shorter.return_address - shorter.dst_jmp_patch < JUMP_INS_SIZE ||
+	    !is_live_patchable(&shorter))
+		return false;
+
+	*patch = shorter;
+
+	return true;
+}
+
+/*
+ * leave_unpatched
+ * Logs a syscall instruction not patched, which is then either intercepted
+ * using Syscall User Dispatch ( see syscall_dispatch.c ), or only counted.
+ */
+static void
+leave_unpatched(struct intercept_desc *desc, const struct patch_site *site)
+{
+	char buffer[0x1000];
+
+	int l = snprintf(buffer, sizeof(buffer),
+		"unintercepted syscall at: %s 0x%lx\n",
+		desc->path,
+		(unsigned long)site->syscall_offset);
+
+	intercept_log(buffer, (size_t)l);
+
+	++desc->unpatched_count;
+	if (dispatch_enabled)
+		dispatch_register_site(site);
+}
+
 /*
  * create_patch_wrappers - create the custom assembly wrappers
  * around each syscall to be intercepted. Well, actually, the
@@ -360,10 +492,21 @@ void
 create_patch_wrappers(struct intercept_desc *desc)
 {
 	size_t next_nop_i = 0;
+	unsigned patched_count = 0;
+	struct patch_site *sites = allocate_patch_sites(desc->count);
 
 	for (unsigned patch_i = 0; patch_i < desc->count; ++patch_i) {
 		struct patch_desc *patch = desc->items + patch_i;
 
+		if (patch->syscall_offset > UINT32_MAX)
+			xabort("syscall offset out of range");
+
+		patch->site = sites + patch_i;
+		patch->site->syscall_addr = patch->syscall_addr;
+		patch->site->containing_lib_path = patch->containing_lib_path;
+		patch->site->syscall_offset = (uint32_t)patch->syscall_offset;
+		patch->site->syscall_nr = (int32_t)patch->syscall_nr;
+
 		assign_nop_trampoline(desc, patch, &next_nop_i);
 
 		if (patch->uses_nop_trampoline) {
@@ -479,26 +622,41 @@ create_patch_wrappers(struct intercept_desc *desc)
 			 * If the length is at least 5, then a jump instruction
 			 * with a 32 bit displacement can fit.
 			 *
-			 * Otherwise give up
+			 * Otherwise give up -- unless the syscall can be
+			 * intercepted without patching, see
+			 * syscall_dispatch.c, or it is in code generated
+			 * at runtime, where it is only counted, see jit.c
 			 */
 			if (length < JUMP_INS_SIZE) {
-				char buffer[0x1000];
+				leave_unpatched(desc, patch->site);
 
-				int l = snprintf(buffer, sizeof(buffer),
-					"unintercepted syscall at: %s 0x%lx\n",
-					desc->path,
-					patch->syscall_offset);
+				if (!dispatch_enabled && !desc->is_jit_region)
+					xabort("not enough space for patching"
+					    " around syscal");
+				continue;
+			}
 
-				intercept_log(buffer, (size_t)l);
-				xabort("not enough space for patching"
-				    " around syscal");
+			/*
+			 * Other threads might be running while the patch is
+			 * written, see is_live_patchable. The patches written
+			 * at startup are checked the same way once these are
+			 * deactivated, see keep_live_patchable.
+			 */
+			if (desc->uses_live_patching &&
+			    !make_live_patchable(patch)) {
+				leave_unpatched(desc, patch->site);
+				continue;
 			}
 		}
 
 		mark_jump(desc, patch->return_address);
 
-		create_wrapper(patch);
+		create_wrapper(desc, patch);
+
+		desc->items[patched_count++] = *patch;
 	}
+
+	desc->count = patched_count;
 }
 
 /*
@@ -506,23 +664,410 @@ create_patch_wrappers(struct intercept_desc *desc)
  */
 extern unsigned char intercept_asm_wrapper_tmpl[];
 extern unsigned char intercept_asm_wrapper_tmpl_end;
-extern unsigned char intercept_asm_wrapper_patch_desc_addr;
+extern unsigned char intercept_asm_wrapper_patch_site_addr;
 extern unsigned char intercept_asm_wrapper_wrapper_level1_addr;
+extern unsigned char intercept_asm_wrapper_syscall_filter_addr;
+extern unsigned char intercept_asm_wrapper_known_nr_tmpl[];
+extern unsigned char intercept_asm_wrapper_known_nr_filter_addr;
+extern unsigned char intercept_asm_wrapper_known_nr_filter_mask_end;
+extern unsigned char intercept_asm_dispatcher_tmpl[];
+extern unsigned char intercept_asm_dispatcher_tmpl_end;
+extern unsigned char intercept_asm_dispatcher_known_nr;
+extern unsigned char intercept_asm_dispatcher_post_clone;
+extern unsigned char intercept_asm_dispatcher_syscall_filter_addr;
+extern unsigned char intercept_asm_dispatcher_syscall_filter_addr2;
+extern unsigned char intercept_asm_dispatcher_patch_sites_addr;
+extern unsigned char intercept_asm_dispatcher_wrapper_level1_addr;
 extern unsigned char intercept_wrapper;
+extern unsigned char intercept_wrapper_general_regs_only;
+
+/*
+ * A weak reference to a variable defined by hook libraries, see
+ * libsyscall_intercept_hook_point.h. Its address is NULL, if no such
+ * library is loaded.
+ */
+extern const int intercept_hook_general_regs_only
+	__attribute__((weak, visibility("default")));
+
+/*
+ * The address of the intercept_wrapper variant called from
+ * the asm wrappers, see select_wrapper_level1 below.
+ */
+static unsigned char *wrapper_level1;
 
 static size_t tmpl_size;
-static ptrdiff_t o_patch_desc_addr;
+static ptrdiff_t o_patch_site_addr;
 static ptrdiff_t o_wrapper_level1_addr;
+static ptrdiff_t o_syscall_filter_addr;
+
+/*
+ * Offsets in the copies of the template starting at
+ * intercept_asm_wrapper_known_nr_tmpl. The o_known_nr_tmpl offset is where
+ * the generic template starts in such a copy, the other offsets above
+ * are relative to that.
+ */
+static size_t known_nr_tmpl_size;
+static ptrdiff_t o_known_nr_tmpl;
+static ptrdiff_t o_known_nr_filter_addr;
+static ptrdiff_t o_known_nr_filter_mask;
+
+/*
+ * Offsets in the copies of the dispatcher used by compact wrappers,
+ * see create_compact_wrapper.
+ */
+static size_t dispatcher_size;
+static ptrdiff_t o_dispatcher_known_nr;
+static ptrdiff_t o_dispatcher_post_clone;
+static ptrdiff_t o_dispatcher_filter_addr;
+static ptrdiff_t o_dispatcher_filter_addr2;
+static ptrdiff_t o_dispatcher_patch_sites_addr;
+static ptrdiff_t o_dispatcher_wrapper_level1_addr;
+
+/*
+ * Compact wrappers are turned on by the INTERCEPT_COMPACT_WRAPPERS
+ * environment variable. These refer to their struct patch_site instances
+ * via an index into the patch_sites array.
+ */
+static bool use_compact_wrappers;
+
+#define MAX_COMPACT_WRAPPERS 0x100000
+
+static struct patch_site **patch_sites;
+static unsigned patch_site_count;
+
+/*
+ * Can wrappers specialised to a syscall number be used?
+ * Setting the INTERCEPT_GENERIC_WRAPPERS environment variable turns
+ * this off, which is useful for comparing the two.
+ */
+static bool use_known_nr_wrappers;
+
+/*
+ * The parameters of saving the extended processor state in intercept_wrapper,
+ * see intercept_wrapper.S and init_xsave below.
+ * A zero intercept_xsave_mask means using FXSAVE instead of XSAVE.
+ */
+uint64_t intercept_xsave_mask;
+uint64_t intercept_xsave_size;
+bool intercept_xsave_compacted;
+
+/*
+ * asm_wrapper_max_size
+ * An upper bound on the size of a single wrapper generated by create_wrapper:
+ * the template, and the relocated instructions around the syscall
+ * along with the jump back to the patched text, and the padding aligning
+ * the wrapper.
+ */
+static size_t
+asm_wrapper_max_size(void)
+{
+	return known_nr_tmpl_size + 256 + 16;
+}
+
+/*
+ * The asm wrappers are generated into chunks of anonymous memory, each
+ * allocated close to the text of the object it was first needed for, and
+ * shared with any other object whose text is within 2 gigabytes.
+ * More chunks are allocated as needed.
+ *
+ * A chunk is writable while wrappers are generated into it, the pages
+ * holding the wrappers are made executable (and not writable) by
+ * mprotect_asm_wrappers -- more wrappers are only generated into the pages
+ * after those, e.g. for code generated at runtime, see jit.c. With huge
+ * pages mapped using MAP_HUGETLB, the whole chunk is made executable at
+ * once.
+ *
+ * Chunks are aligned to their size, which is the size of a huge page. With
+ * INTERCEPT_HUGE_PAGES set in the environment, chunks are mapped using
+ * MAP_HUGETLB, or -- if no such pages are available -- marked with
+ * MADV_HUGEPAGE, to make the wrappers use fewer iTLB entries.
+ */
+#define WRAPPER_CHUNK_SIZE ((size_t)0x200000)
+
+struct wrapper_chunk {
+	unsigned char *start;
+	unsigned char *next;
 
-bool intercept_routine_must_save_ymm;
+	/* the end of the pages made executable so far */
+	unsigned char *sealed_end;
 
+	/* mapped using MAP_HUGETLB, can only be made executable as a whole */
+	bool is_hugetlb;
+
+	/* The copy of the dispatcher used by compact wrappers in the chunk */
+	unsigned char *dispatcher;
+};
+
+static void create_movabs_r11(unsigned char *code, uint64_t value);
+
+static struct wrapper_chunk wrapper_chunks[0x100];
+static unsigned wrapper_chunk_count;
+
+static bool use_huge_pages;
+
+/*
+ * is_chunk_in_range
+ * Checks if any address in the chunk is reachable from anywhere in the
+ * text section using a 32 bit displacement, and vice versa.
+ */
 static bool
-is_asm_wrapper_space_full(void)
+is_chunk_in_range(const struct wrapper_chunk *chunk,
+		const struct intercept_desc *desc)
 {
-	return next_asm_wrapper_space + tmpl_size + 256 >
-			asm_wrapper_space + sizeof(asm_wrapper_space);
+	uintptr_t low = (uintptr_t)chunk->start;
+	uintptr_t high = (uintptr_t)chunk->start + WRAPPER_CHUNK_SIZE;
+
+	if ((uintptr_t)desc->text_start < low)
+		low = (uintptr_t)desc->text_start;
+
+	if ((uintptr_t)desc->text_end > high)
+		high = (uintptr_t)desc->text_end;
+
+	return high - low < (uintptr_t)INT32_MAX;
 }
 
+/*
+ * map_wrapper_chunk
+ * Maps a new chunk at the address chosen by find_unmapped_near.
+ * Returns false if something else got mapped at that address in the
+ * meantime. Kernels not knowing about MAP_FIXED_NOREPLACE treat the address
+ * as a hint, and map the chunk somewhere else in that case.
+ */
+static bool
+map_wrapper_chunk(unsigned char *address, bool *is_hugetlb)
+{
+	const int flags = MAP_FIXED_NOREPLACE | MAP_PRIVATE | MAP_ANON;
+	long result;
+
+	if (use_huge_pages) {
+		result = syscall_no_intercept(SYS_mmap, address,
+			WRAPPER_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+			flags | MAP_HUGETLB, -1, (off_t)0);
+
+		if (result == (long)address) {
+			debug_dump("asm wrapper chunk at %p using "
+			    "hugetlb pages\n", (void *)address);
+			*is_hugetlb = true;
+			return true;
+		}
+
+		if (syscall_error_code(result) == 0)
+			xmunmap((void *)result, WRAPPER_CHUNK_SIZE);
+	}
+
+	result = syscall_no_intercept(SYS_mmap, address,
+		WRAPPER_CHUNK_SIZE, PROT_READ | PROT_WRITE,
+		flags, -1, (off_t)0);
+
+	if (syscall_error_code(result) == EEXIST)
+		return false;
+
+	xabort_on_syserror(result, "mmap asm wrapper chunk");
+
+	if (result != (long)address) {
+		xmunmap((void *)result, WRAPPER_CHUNK_SIZE);
+		return false;
+	}
+
+	if (use_huge_pages &&
+	    syscall_no_intercept(SYS_madvise, address,
+	    WRAPPER_CHUNK_SIZE, MADV_HUGEPAGE) == 0)
+		debug_dump("asm wrapper chunk at %p using "
+		    "transparent huge pages\n", (void *)address);
+
+	*is_hugetlb = false;
+	return true;
+}
+
+/*
+ * get_wrapper_chunk
+ * Finds a chunk with enough space left for another wrapper, reachable from
+ * the text section of the object. Allocates a new one, if no such chunk
+ * exists yet.
+ */
+static struct wrapper_chunk *
+get_wrapper_chunk(const struct intercept_desc *desc)
+{
+	struct wrapper_chunk *chunk;
+
+	for (unsigned i = 0; i < wrapper_chunk_count; ++i) {
+		chunk = wrapper_chunks + i;
+
+		if (!is_chunk_in_range(chunk, desc))
+			continue;
+
+		if (chunk->next + asm_wrapper_max_size() <=
+		    chunk->start + WRAPPER_CHUNK_SIZE)
+			return chunk;
+	}
+
+	if (wrapper_chunk_count == ARRAY_SIZE(wrapper_chunks))
+		xabort("too many asm wrapper chunks");
+
+	unsigned char *address;
+	unsigned attempts = 0;
+	bool is_hugetlb;
+
+	do {
+		if (++attempts > 0x10)
+			xabort("unable to map asm wrapper chunk");
+
+		address = find_unmapped_near(desc,
+				WRAPPER_CHUNK_SIZE, WRAPPER_CHUNK_SIZE);
+
+		if (address == NULL)
+			xabort("unable to find place for asm wrappers");
+	} while (!map_wrapper_chunk(address, &is_hugetlb));
+
+	chunk = wrapper_chunks + wrapper_chunk_count++;
+	chunk->start = address;
+	chunk->next = address;
+	chunk->sealed_end = address;
+	chunk->is_hugetlb = is_hugetlb;
+	chunk->dispatcher = NULL;
+
+	if (use_compact_wrappers) {
+		unsigned char *dst = address;
+
+		memcpy(dst, intercept_asm_dispatcher_tmpl, dispatcher_size);
+		create_movabs_r11(dst + o_dispatcher_filter_addr,
+				(uintptr_t)syscall_filter_bitmap);
+		create_movabs_r11(dst + o_dispatcher_filter_addr2,
+				(uintptr_t)syscall_filter_bitmap);
+		create_movabs_r11(dst + o_dispatcher_patch_sites_addr,
+				(uintptr_t)patch_sites);
+		create_movabs_r11(dst + o_dispatcher_wrapper_level1_addr,
+				(uintptr_t)wrapper_level1);
+
+		/* The stubs start on a new cache line */
+		chunk->dispatcher = dst;
+		chunk->next = dst + ((dispatcher_size + 63) & ~(size_t)63);
+	}
+
+	return chunk;
+}
+
+
+/*
+ * select_wrapper_level1
+ * Choose between the two variants of intercept_wrapper, see
+ * intercept_wrapper.S -- the one not saving the SIMD registers can only be
+ * used if none of the C code it calls uses such registers. The C code
+ * in libsyscall_intercept called from intercept_wrapper must be compiled
+ * with the -mgeneral-regs-only flag ( see CMakeLists.txt ), and the
+ * hook library must declare it is compiled the same way.
+ */
+static unsigned char *
+select_wrapper_level1(void)
+{
+#ifdef SYSCALL_INTERCEPT_GENERAL_REGS_ONLY
+	if (&intercept_hook_general_regs_only != NULL &&
+	    intercept_hook_general_regs_only != 0) {
+		debug_dump("not saving SIMD registers in intercept_wrapper\n");
+		return &intercept_wrapper_general_regs_only;
+	}
+#endif
+
+	return &intercept_wrapper;
+}
+
+/* these functions are implemented in util.S */
+void intercept_cpuid(uint32_t leaf, uint32_t subleaf, uint32_t regs[4]);
+uint64_t intercept_xgetbv(uint32_t index);
+
+#define CPUID_1_ECX_OSXSAVE (1u << 27)
+#define CPUID_D_1_EAX_XSAVEC (1u << 1)
+#define CPUID_D_ECX_ALIGN64 (1u << 1)
+
+#define XFEATURE_PKRU 9
+#define XFEATURE_XTILEDATA 18
+
+#ifndef ARCH_GET_XCOMP_PERM
+#define ARCH_GET_XCOMP_PERM 0x1022
+#endif
+
+/*
+ * xsave_compacted_size
+ * Computes the size of the XSAVE area in compacted form, holding the
+ * components in mask. The first two components are part of the 512 byte
+ * legacy area, which is followed by the 64 byte XSAVE header.
+ */
+static uint64_t
+xsave_compacted_size(uint64_t mask)
+{
+	uint64_t size = 512 + 64;
+
+	for (uint32_t i = 2; i < 63; ++i) {
+		if ((mask & (1ull << i)) == 0)
+			continue;
+
+		uint32_t regs[4];
+
+		intercept_cpuid(0xd, i, regs);
+		if (regs[2] & CPUID_D_ECX_ALIGN64)
+			size = (size + 63) & ~(uint64_t)63;
+		size += regs[0];
+	}
+
+	return size;
+}
+
+/*
+ * init_xsave
+ * Decides how intercept_wrapper saves the extended processor state.
+ * Every state component enabled by the OS in XCR0 is saved, which includes
+ * the AVX-512 opmask and ZMM registers -- except for the AMX tile data, which
+ * is only saved if the process was already permitted to use it ( it is
+ * 8 kilobytes large ). The protection key rights register is not saved,
+ * restoring it is slow, and the C code does not change it by accident.
+ * If there is no XSAVE support, FXSAVE is used, which covers the x87 and
+ * SSE state.
+ */
+static void
+init_xsave(void)
+{
+	uint32_t regs[4];
+
+	intercept_cpuid(0, 0, regs);
+	uint32_t max_leaf = regs[0];
+
+	intercept_cpuid(1, 0, regs);
+	if (max_leaf < 0xd || (regs[2] & CPUID_1_ECX_OSXSAVE) == 0) {
+		intercept_xsave_mask = 0;
+		debug_dump("saving registers using fxsave\n");
+		return;
+	}
+
+	uint64_t mask = intercept_xgetbv(0) & ~(1ull << XFEATURE_PKRU);
+
+	if (mask & (1ull << XFEATURE_XTILEDATA)) {
+		uint64_t permitted;
+
+		if (syscall_no_intercept(SYS_arch_prctl,
+		    ARCH_GET_XCOMP_PERM, &permitted) == 0)
+			mask &= permitted;
+		else
+			mask &= ~(1ull << XFEATURE_XTILEDATA);
+	}
+
+	intercept_cpuid(0xd, 1, regs);
+	intercept_xsave_compacted = (regs[0] & CPUID_D_1_EAX_XSAVEC) != 0;
+
+	if (intercept_xsave_compacted) {
+		intercept_xsave_size = xsave_compacted_size(mask);
+	} else {
+		/* size of the standard form, for all features in XCR0 */
+		intercept_cpuid(0xd, 0, regs);
+		intercept_xsave_size = regs[1];
+	}
+
+	intercept_xsave_mask = mask;
+
+	debug_dump("saving registers using %s, mask: 0x%lx size: %lu\n",
+	    intercept_xsave_compacted ? "xsavec" : "xsave",
+	    (unsigned long)intercept_xsave_mask,
+	    (unsigned long)intercept_xsave_size);
+}
 
 /*
  * init_patcher
@@ -535,29 +1080,68 @@ init_patcher(void)
 	unsigned char *begin = &intercept_asm_wrapper_tmpl[0];
 
 	assert(&intercept_asm_wrapper_tmpl_end > begin);
-	assert(&intercept_asm_wrapper_patch_desc_addr > begin);
+	assert(&intercept_asm_wrapper_patch_site_addr > begin);
 	assert(&intercept_asm_wrapper_wrapper_level1_addr > begin);
-	assert(&intercept_asm_wrapper_patch_desc_addr <
+	assert(&intercept_asm_wrapper_patch_site_addr <
 		&intercept_asm_wrapper_tmpl_end);
 	assert(&intercept_asm_wrapper_wrapper_level1_addr <
 		&intercept_asm_wrapper_tmpl_end);
+	assert(&intercept_asm_wrapper_syscall_filter_addr > begin);
+	assert(&intercept_asm_wrapper_syscall_filter_addr <
+		&intercept_asm_wrapper_tmpl_end);
 
 	tmpl_size = (size_t)(&intercept_asm_wrapper_tmpl_end - begin);
-	o_patch_desc_addr = &intercept_asm_wrapper_patch_desc_addr - begin;
+	o_patch_site_addr = &intercept_asm_wrapper_patch_site_addr - begin;
 	o_wrapper_level1_addr =
 		&intercept_asm_wrapper_wrapper_level1_addr - begin;
-
-	/*
-	 * has_ymm_registers -- checks if AVX instructions are supported,
-	 * thus YMM registers can be used on this CPU.
-	 *
-	 * this function is implemented in util.s
-	 *
-	 * XXX check for ZMM registers, and save/restore them!
-	 */
-	extern bool has_ymm_registers(void);
-
-	intercept_routine_must_save_ymm = has_ymm_registers();
+	o_syscall_filter_addr =
+		&intercept_asm_wrapper_syscall_filter_addr - begin;
+
+	unsigned char *known_nr_begin = &intercept_asm_wrapper_known_nr_tmpl[0];
+
+	assert(known_nr_begin < begin);
+	assert(&intercept_asm_wrapper_known_nr_filter_addr >= known_nr_begin);
+	assert(&intercept_asm_wrapper_known_nr_filter_mask_end < begin);
+
+	known_nr_tmpl_size =
+		(size_t)(&intercept_asm_wrapper_tmpl_end - known_nr_begin);
+	o_known_nr_tmpl = begin - known_nr_begin;
+	o_known_nr_filter_addr =
+		&intercept_asm_wrapper_known_nr_filter_addr - known_nr_begin;
+	/* the mask is the last byte of the testb instruction */
+	o_known_nr_filter_mask =
+		&intercept_asm_wrapper_known_nr_filter_mask_end -
+		known_nr_begin - 1;
+
+	unsigned char *dispatcher = &intercept_asm_dispatcher_tmpl[0];
+
+	assert(&intercept_asm_dispatcher_tmpl_end > dispatcher);
+	assert(&intercept_asm_dispatcher_wrapper_level1_addr <
+		&intercept_asm_dispatcher_tmpl_end);
+
+	dispatcher_size =
+		(size_t)(&intercept_asm_dispatcher_tmpl_end - dispatcher);
+	o_dispatcher_known_nr = &intercept_asm_dispatcher_known_nr - dispatcher;
+	o_dispatcher_post_clone =
+		&intercept_asm_dispatcher_post_clone - dispatcher;
+	o_dispatcher_filter_addr =
+		&intercept_asm_dispatcher_syscall_filter_addr - dispatcher;
+	o_dispatcher_filter_addr2 =
+		&intercept_asm_dispatcher_syscall_filter_addr2 - dispatcher;
+	o_dispatcher_patch_sites_addr =
+		&intercept_asm_dispatcher_patch_sites_addr - dispatcher;
+	o_dispatcher_wrapper_level1_addr =
+		&intercept_asm_dispatcher_wrapper_level1_addr - dispatcher;
+
+	use_compact_wrappers = getenv("INTERCEPT_COMPACT_WRAPPERS") != NULL;
+	if (use_compact_wrappers)
+		patch_sites = xmmap_anon(MAX_COMPACT_WRAPPERS *
+					sizeof(patch_sites[0]));
+
+	use_known_nr_wrappers = getenv("INTERCEPT_GENERIC_WRAPPERS") == NULL;
+	use_huge_pages = getenv("INTERCEPT_HUGE_PAGES") != NULL;
+	wrapper_level1 = select_wrapper_level1();
+	init_xsave();
 }
 
 /*
@@ -582,25 +1166,73 @@ create_movabs_r11(unsigned char *code, uint64_t value)
 	code[9] = bytes[7];
 }
 
+/*
+ * uses_known_nr_wrapper
+ * Checks if the wrapper generated for a syscall instruction can be
+ * specialised to the syscall number used with that instruction. The
+ * syscalls that need special handling in intercept_routine are excluded,
+ * see intercept_routine_known_nr in intercept.c
+ */
+static bool
+uses_known_nr_wrapper(const struct patch_desc *patch)
+{
+	if (!use_known_nr_wrappers)
+		return false;
+
+	if (patch->syscall_nr < 0 || patch->syscall_nr >= SYSCALL_FILTER_SIZE)
+		return false;
+
+	switch (patch->syscall_nr) {
+		case SYS_write: /* might be a magic syscall */
+		case SYS_clone:
+		case SYS_clone3:
+		case SYS_vfork:
+		case SYS_rt_sigreturn:
+			return false;
+		default:
+			return true;
+	}
+}
+
+/*
+ * next_wrapper_start
+ * Each wrapper starts at a 16 byte aligned address, so the entries of
+ * two wrappers never share an instruction fetch block. The padding is
+ * filled with int3 instructions.
+ */
+static unsigned char *
+next_wrapper_start(struct wrapper_chunk *chunk)
+{
+	while (((uintptr_t)chunk->next & 0xf) != 0)
+		*chunk->next++ = INT3_OPCODE;
+
+	return chunk->next;
+}
+
 /*
  * create_wrapper
  * Generates an assembly wrapper. Copies the template written in
  * intercept_template.s, and generates the instructions specific
  * to a particular syscall into the new copy.
+ * The wrapper is generated into a chunk of memory close to the text,
+ * see get_wrapper_chunk.
  * After this wrapper is created, a syscall can be replaced with a
  * jump to this wrapper, and wrapper is going to call dest_routine
  * (actually only after a call to mprotect_asm_wrappers).
  */
 static void
-create_wrapper(struct patch_desc *patch)
+create_wrapper(struct intercept_desc *desc, struct patch_desc *patch)
 {
-	unsigned char *dst;
+	if (use_compact_wrappers) {
+		create_compact_wrapper(desc, patch);
+		return;
+	}
 
-	if (is_asm_wrapper_space_full())
-		xabort("not enough space in asm_wrapper_space");
+	struct wrapper_chunk *chunk = get_wrapper_chunk(desc);
+	unsigned char *dst;
 
 	/* Create a new copy of the template */
-	patch->asm_wrapper = dst = next_asm_wrapper_space;
+	patch->asm_wrapper = dst = next_wrapper_start(chunk);
 
 	/* Copy the previous instruction(s) */
 	if (patch->uses_prev_ins) {
@@ -612,11 +1244,30 @@ create_wrapper(struct patch_desc *patch)
 		dst += length;
 	}
 
+	if (uses_known_nr_wrapper(patch)) {
+		unsigned long nr = (unsigned long)patch->syscall_nr;
+		unsigned char *filter = (unsigned char *)syscall_filter_bitmap;
+
+		/*
+		 * Copy the prologue testing the single bit in the syscall
+		 * filter, and continue with the generic template.
+		 */
+		memcpy(dst, intercept_asm_wrapper_known_nr_tmpl,
+		    (size_t)o_known_nr_tmpl);
+		create_movabs_r11(dst + o_known_nr_filter_addr,
+				(uintptr_t)(filter + nr / 8));
+		dst[o_known_nr_filter_mask] = (unsigned char)(1 << (nr % 8));
+		dst += o_known_nr_tmpl;
+	}
+
 	memcpy(dst, intercept_asm_wrapper_tmpl, tmpl_size);
-	create_movabs_r11(dst + o_patch_desc_addr, (uintptr_t)patch);
+	create_movabs_r11(dst + o_patch_site_addr, (uintptr_t)patch->site);
 	create_movabs_r11(dst + o_wrapper_level1_addr,
-				(uintptr_t)&intercept_wrapper);
+				(uintptr_t)wrapper_level1);
+	create_movabs_r11(dst + o_syscall_filter_addr,
+				(uintptr_t)syscall_filter_bitmap);
 	dst += tmpl_size;
+	patch->wrapper_after_syscall = dst;
 
 	/* Copy the following instruction */
 	if (patch->uses_next_ins) {
@@ -626,9 +1277,40 @@ create_wrapper(struct patch_desc *patch)
 		dst += patch->following_ins.length;
 	}
 
-	dst = create_absolute_jump(dst, patch->return_address);
+	create_jump(JMP_OPCODE, dst, patch->return_address);
+	dst += JUMP_INS_SIZE;
+
+	chunk->next = dst;
+}
+
+/*
+ * create_short_branch
+ * Generates a 2 byte jump instruction, conditional or not. The to address
+ * must be reachable using an 8 bit displacement.
+ */
+static void
+create_short_branch(unsigned char opcode, unsigned char *from,
+			unsigned char *to)
+{
+	encode_short_branch(from, opcode, from, to);
+}
+
+/*
+ * encode_short_branch
+ * Same as create_short_branch, except the instruction is stored at code, to
+ * be copied to the from address later.
+ */
+static void
+encode_short_branch(unsigned char *code, unsigned char opcode,
+			unsigned char *from, unsigned char *to)
+{
+	ptrdiff_t d = to - (from + 2);
 
-	next_asm_wrapper_space = dst;
+	if (d < - 128 || d > 127)
+		xabort("create_short_jump distance check");
+
+	code[0] = opcode;
+	code[1] = (unsigned char)((char)d);
 }
 
 /*
@@ -639,13 +1321,135 @@ create_wrapper(struct patch_desc *patch)
 static void
 create_short_jump(unsigned char *from, unsigned char *to)
 {
-	ptrdiff_t d = to - (from + 2);
+	create_short_branch(SHORT_JMP_OPCODE, from, to);
+}
 
-	if (d < - 128 || d > 127)
-		xabort("create_short_jump distance check");
+/*
+ * create_dispatcher_call
+ * Generates the instructions calling a dispatcher in a compact wrapper:
+ *
+ * leaq -0x80(%rsp), %rsp
+ * pushq $index
+ * callq dispatcher
+ * leaq 0x88(%rsp), %rsp
+ *
+ * See intercept_asm_dispatcher_tmpl in intercept_template.s
+ */
+static unsigned char *
+create_dispatcher_call(unsigned char *dst, unsigned index,
+			unsigned char *dispatcher)
+{
+	static const unsigned char lea_sub[] = {0x48, 0x8d, 0x64, 0x24, 0x80};
+	static const unsigned char lea_add[] =
+		{0x48, 0x8d, 0xa4, 0x24, 0x88, 0x00, 0x00, 0x00};
+
+	memcpy(dst, lea_sub, sizeof(lea_sub));
+	dst += sizeof(lea_sub);
+
+	*dst++ = PUSH_IMM_OPCODE;
+	memcpy(dst, &index, 4);
+	dst += 4;
+
+	create_jump(CALL_OPCODE, dst, dispatcher);
+	dst += JUMP_INS_SIZE;
+
+	memcpy(dst, lea_add, sizeof(lea_add));
+	dst += sizeof(lea_add);
+
+	return dst;
+}
+
+/*
+ * create_compact_wrapper
+ * Generates a small stub instead of a copy of the whole template. The
+ * stub calls the copy of the dispatcher in its chunk, which looks up the
+ * struct patch_site via the index pushed by the stub. The syscall itself
+ * is executed in the stub, if the dispatcher asks for it -- see
+ * intercept_asm_dispatcher_tmpl:
+ *
+ *	( relocated preceding instructions )
+ *	( call the dispatcher )
+ *	jrcxz 2f
+ *	dec %ecx
+ *	jnz 1f
+ *	syscall
+ *	jmp 2f
+ * 1:	syscall
+ *	( call the dispatcher at post_clone )
+ * 2:	( relocated following instruction )
+ *	jmp return_address
+ *
+ * The part handling clone is omitted for syscalls with a known number,
+ * that is not clone -- see uses_known_nr_wrapper.
+ */
+static void
+create_compact_wrapper(struct intercept_desc *desc, struct patch_desc *patch)
+{
+	struct wrapper_chunk *chunk = get_wrapper_chunk(desc);
+	unsigned char *dst;
+	unsigned index;
+	bool known_nr = uses_known_nr_wrapper(patch);
+
+	if (patch_site_count == MAX_COMPACT_WRAPPERS)
+		xabort("too many compact wrappers");
+
+	index = patch_site_count++;
+	patch_sites[index] = patch->site;
+
+	patch->asm_wrapper = dst = next_wrapper_start(chunk);
+
+	debug_dump("compact wrapper %u at %p\n", index, (void *)dst);
+
+	/* Copy the previous instruction(s) */
+	if (patch->uses_prev_ins) {
+		size_t length = patch->preceding_ins.length;
+		if (patch->uses_prev_ins_2)
+			length += patch->preceding_ins_2.length;
+
+		memcpy(dst, patch->syscall_addr - length, length);
+		dst += length;
+	}
+
+	dst = create_dispatcher_call(dst, index, chunk->dispatcher +
+			(known_nr ? o_dispatcher_known_nr : 0));
+
+	if (known_nr) {
+		create_short_branch(JRCXZ_OPCODE, dst, dst + 4);
+		dst[2] = 0x0f; /* syscall */
+		dst[3] = 0x05;
+		dst += 4;
+	} else {
+		unsigned char *jrcxz = dst;
+		unsigned char *jnz = dst + 4;
+		unsigned char *jmp = dst + 8;
+
+		dst[2] = 0xff; /* dec %ecx */
+		dst[3] = 0xc9;
+		dst[6] = 0x0f; /* syscall */
+		dst[7] = 0x05;
+		dst[10] = 0x0f; /* syscall */
+		dst[11] = 0x05;
+		create_short_branch(SHORT_JNZ_OPCODE, jnz, dst + 10);
+		dst = create_dispatcher_call(dst + 12, index,
+				chunk->dispatcher + o_dispatcher_post_clone);
+		create_short_branch(JRCXZ_OPCODE, jrcxz, dst);
+		create_short_jump(jmp, dst);
+	}
+
+	patch->wrapper_after_syscall = dst;
+
+	/* Copy the following instruction */
+	if (patch->uses_next_ins) {
+		memcpy(dst,
+		    patch->syscall_addr + SYSCALL_INS_SIZE,
+		    patch->following_ins.length);
+		dst += patch->following_ins.length;
+	}
 
-	from[0] = SHORT_JMP_OPCODE;
-	from[1] = (unsigned char)((char)d);
+	create_jump(JMP_OPCODE, dst, patch->return_address);
+	dst += JUMP_INS_SIZE;
+
+	chunk->next = dst;
 }
 
 /*
@@ -668,27 +1472,175 @@ mprotect_no_intercept(void *addr, size_t len, int prot,
 }
 
 /*
- * activate_patches()
- * Loop over all the patches, and and overwrite each syscall.
+ * add_write
+ * Sets up a struct code_write, allocating twice the length of the new
+ * code: the original code at the address is saved right after the new
+ * code. Returns where the new code is to be stored.
  */
-void
-activate_patches(struct intercept_desc *desc)
+static unsigned char *
+add_write(struct code_write *write, unsigned char **code,
+		unsigned char *address, unsigned length,
+		unsigned char *redirect)
+{
+	unsigned char *new_code = *code;
+
+	write->address = address;
+	write->length = length;
+	write->redirect = redirect;
+	write->code = new_code;
+
+	memcpy(new_code + length, address, length);
+	*code += 2 * length;
+
+	return new_code;
+}
+
+/*
+ * jump_target -- where the jump replacing a syscall leads to, either the
+ * wrapper, or a trampoline jumping to it.
+ */
+static unsigned char *
+jump_target(struct intercept_desc *desc, const struct patch_desc *patch)
+{
+	if (!desc->uses_trampoline_table)
+		return patch->asm_wrapper;
+
+	/*
+	 * First jump to the trampoline table, which should be in
+	 * a 2 gigabyte range. From there, jump to the asm_wrapper.
+	 */
+	check_trampoline_usage(desc);
+
+	unsigned char *trampoline = desc->next_trampoline;
+
+	/* jump - escape the 2 GB range of the text segment */
+	create_absolute_jump(trampoline, patch->asm_wrapper);
+	desc->next_trampoline += TRAMPOLINE_SIZE;
+
+	return trampoline;
+}
+
+/* the two preceding instructions, and the following one */
+#define RESUME_POINTS_PER_PATCH 3
+
+/*
+ * add_resume_point
+ * Registers where a thread continues, when it finds an int3 instruction
+ * written by a patch at the address of one of the original instructions:
+ * at the relocated copy of the same instruction in the wrapper. The
+ * relocated preceding instructions are at the beginning of the wrapper.
+ * The instructions overwritten by the jump itself are not handled here,
+ * see is_live_patchable.
+ */
+static void
+add_resume_point(struct resume_point *points, unsigned *count,
+		const struct patch_desc *patch, unsigned char *address)
 {
-	unsigned char *first_page;
-	size_t size;
+	unsigned char *target;
 
-	if (desc->count == 0)
+	if (address < patch->dst_jmp_patch + JUMP_INS_SIZE ||
+	    address >= patch->return_address)
 		return;
 
-	first_page = round_down_address(desc->text_start);
-	size = (size_t)(desc->text_end - first_page);
+	if (address > patch->syscall_addr)
+		target = patch->wrapper_after_syscall;
+	else
+		target = patch->asm_wrapper +
+		    (address - patch->dst_jmp_patch);
 
-	mprotect_no_intercept(first_page, size,
-	    PROT_READ | PROT_WRITE | PROT_EXEC,
-	    "mprotect PROT_READ | PROT_WRITE | PROT_EXEC");
+	points[(*count)++] = (struct resume_point){address, target};
+}
+
+static void
+release_live_fixups(struct intercept_desc *desc)
+{
+	if (desc->live_fixups != NULL)
+		xmunmap(desc->live_fixups,
+		    desc->live_fixup_count * sizeof(desc->live_fixups[0]));
+
+	desc->live_fixups = NULL;
+	desc->live_fixup_count = 0;
+}
+
+/*
+ * add_live_fixup
+ * Records how a patch written at startup can be written again while other
+ * threads are running, see keep_live_patchable. The jump is moved by
+ * the number of bytes make_live_patchable moves it by, or the patch is
+ * dropped, when that is zero. The jump to a moved patch must lead to the
+ * wrapper directly, not via a trampoline table.
+ */
+static void
+add_live_fixup(struct intercept_desc *desc, const struct patch_desc *patch,
+		unsigned write_index)
+{
+	struct patch_desc live = *patch;
+	struct live_fixup *fixup = desc->live_fixups + desc->live_fixup_count++;
+
+	fixup->write_index = write_index;
+	fixup->site = patch->site;
+	fixup->skip = 0;
+
+	if (make_live_patchable(&live) && !desc->uses_trampoline_table)
+		fixup->skip =
+		    (unsigned)(live.dst_jmp_patch - patch->dst_jmp_patch);
+}
+
+/*
+ * collect_writes
+ * Prepares the code to be written by activate_patches, and registers the
+ * resume points of the patches ( see live_patch.c ). The instructions
+ * are written in three rounds, as some of them must not be reachable
+ * before others are complete:
+ *
+ * 1) The jumps to the wrappers over the original instructions, and the
+ *    short jumps over the NOPs used as trampolines.
+ * 2) The jumps to the wrappers in such NOPs -- these are not reachable
+ *    before round 1 is complete.
+ * 3) The short jumps to the NOPs, over the syscall instructions.
+ *
+ * The original code is restored by deactivate_patches in the reverse order.
+ */
+static void
+collect_writes(struct intercept_desc *desc)
+{
+	unsigned nop_count = 0;
+	unsigned fixup_count = 0;
+	size_t code_size = 0;
+
+	for (unsigned i = 0; i < desc->count; ++i) {
+		const struct patch_desc *patch = desc->items + i;
+
+		if (!is_live_patchable(patch))
+			++fixup_count;
+
+		if (patch->uses_nop_trampoline) {
+			++nop_count;
+			code_size += 2 + JUMP_INS_SIZE + 2;
+		} else {
+			code_size += (size_t)
+			    (patch->return_address - patch->dst_jmp_patch);
+		}
+	}
+
+	unsigned write_count = desc->count + 2 * nop_count;
+	size_t size = write_count * sizeof(struct code_write) + 2 * code_size;
+	struct code_write *writes = xmmap_anon(size);
+	unsigned char *code = (unsigned char *)(writes + write_count);
+	unsigned next[PATCH_ROUNDS] = {0, desc->count, desc->count + nop_count};
+	struct resume_point *resume_points =
+	    xmmap_anon(RESUME_POINTS_PER_PATCH * desc->count *
+		sizeof(resume_points[0]));
+	unsigned resume_point_count = 0;
+
+	if (fixup_count > 0)
+		desc->live_fixups =
+		    xmmap_anon(fixup_count * sizeof(desc->live_fixups[0]));
 
 	for (unsigned i = 0; i < desc->count; ++i) {
 		const struct patch_desc *patch = desc->items + i;
+		unsigned char *target = jump_target(desc, patch);
+		unsigned char *new_code;
 
 		if (patch->dst_jmp_patch < desc->text_start ||
 		    patch->dst_jmp_patch > desc->text_end)
@@ -703,28 +1655,6 @@ activate_patches(struct intercept_desc *desc)
 		 * it (an overwritable NOP instruction).
 		 */
 
-		if (desc->uses_trampoline_table) {
-			/*
-			 * First jump to the trampoline table, which
-			 * should be in a 2 gigabyte range. From there,
-			 * jump to the asm_wrapper.
-			 */
-			check_trampoline_usage(desc);
-
-			/* jump - escape the text segment */
-			create_jump(JMP_OPCODE,
-				patch->dst_jmp_patch, desc->next_trampoline);
-
-			/* jump - escape the 2 GB range of the text segment */
-			create_absolute_jump(
-				desc->next_trampoline, patch->asm_wrapper);
-
-			desc->next_trampoline += TRAMPOLINE_SIZE;
-		} else {
-			create_jump(JMP_OPCODE,
-				patch->dst_jmp_patch, patch->asm_wrapper);
-		}
-
 		if (patch->uses_nop_trampoline) {
 			/*
 			 * Create a mini trampoline jump.
@@ -739,46 +1669,341 @@ activate_patches(struct intercept_desc *desc)
 			 * See also: the is_overwritable_nop function in
 			 * the intercept_desc.c source file.
 			 */
+			unsigned char *nop = patch->nop_trampoline.address;
+
+			new_code = add_write(writes + next[0]++, &code,
+					nop, 2,
+					after_nop(&patch->nop_trampoline));
+			encode_short_branch(new_code, SHORT_JMP_OPCODE,
+					nop, after_nop(&patch->nop_trampoline));
+
+			new_code = add_write(writes + next[1]++, &code,
+					patch->dst_jmp_patch, JUMP_INS_SIZE,
+					patch->asm_wrapper);
+			encode_jump(new_code, JMP_OPCODE,
+					patch->dst_jmp_patch, target);
 
 			/* jump from syscall to mini trampoline */
-			create_short_jump(patch->syscall_addr,
-			    patch->dst_jmp_patch);
+			new_code = add_write(writes + next[2]++, &code,
+					patch->syscall_addr, 2,
+					patch->asm_wrapper);
+			encode_short_branch(new_code, SHORT_JMP_OPCODE,
+					patch->syscall_addr,
+					patch->dst_jmp_patch);
+			continue;
+		}
 
-			/*
-			 * Short jump to next instruction, skipping the newly
-			 * created trampoline jump.
-			 */
-			create_short_jump(patch->nop_trampoline.address,
-			    after_nop(&patch->nop_trampoline));
-		} else {
-			unsigned char *byte;
+		unsigned char *after_syscall =
+		    patch->syscall_addr + SYSCALL_INS_SIZE;
+		unsigned length =
+		    (unsigned)(patch->return_address - patch->dst_jmp_patch);
+
+		if (!is_live_patchable(patch))
+			add_live_fixup(desc, patch, next[0]);
+
+		new_code = add_write(writes + next[0]++, &code,
+				patch->dst_jmp_patch, length,
+				patch->asm_wrapper);
+		encode_jump(new_code, JMP_OPCODE, patch->dst_jmp_patch,
+				target);
+		memset(new_code + JUMP_INS_SIZE, INT3_OPCODE,
+				length - JUMP_INS_SIZE);
+
+		/*
+		 * A thread blocked in this syscall returns into the int3
+		 * instructions overwriting the following instruction. A
+		 * thread preempted before the syscall, or before the
+		 * preceding instruction, can also continue at one of the
+		 * int3 instructions.
+		 */
+		if (patch->uses_prev_ins_2)
+			add_resume_point(resume_points, &resume_point_count,
+			    patch, patch->syscall_addr -
+				patch->preceding_ins.length);
+
+		if (patch->uses_prev_ins)
+			add_resume_point(resume_points, &resume_point_count,
+			    patch, patch->syscall_addr);
+
+		add_resume_point(resume_points, &resume_point_count,
+		    patch, after_syscall);
+	}
+
+	desc->resume_block =
+	    add_resume_points(resume_points, resume_point_count);
+	xmunmap(resume_points, RESUME_POINTS_PER_PATCH * desc->count *
+		sizeof(resume_points[0]));
+
+	desc->writes = writes;
+	desc->write_count = write_count;
+	for (unsigned r = 0; r < PATCH_ROUNDS; ++r)
+		desc->round_ends[r] = next[r];
+	desc->patched_code_size = size;
+}
+
+/*
+ * is_text_unchanged -- does the text contain the code expected to be
+ * overwritten next? It would not, if the object was replaced by another one
+ * at the same address, or if someone else patched the code.
+ */
+static bool
+is_text_unchanged(const struct intercept_desc *desc)
+{
+	for (unsigned i = 0; i < desc->write_count; ++i) {
+		const struct code_write *write = desc->writes + i;
+		const unsigned char *current = desc->is_active ?
+		    write->code - write->length : write->code + write->length;
+
+		if (memcmp(write->address, current, write->length) != 0)
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * write_round
+ * Writes the code of the writes in a round, using live_patch when other
+ * threads might be running. The code pointer of each write is then
+ * pointed to the code that was overwritten, to be written next time.
+ */
+static void
+write_round(struct intercept_desc *desc, unsigned round, bool activate)
+{
+	unsigned begin = (round == 0) ? 0 : desc->round_ends[round - 1];
+	struct code_write *writes = desc->writes + begin;
+	unsigned count = desc->round_ends[round] - begin;
+
+	if (desc->uses_live_patching) {
+		live_patch(writes, count);
+	} else {
+		for (unsigned i = 0; i < count; ++i)
+			memcpy(writes[i].address, writes[i].code,
+			    writes[i].length);
+	}
+
+	for (unsigned i = 0; i < count; ++i) {
+		if (activate)
+			writes[i].code += writes[i].length;
+		else
+			writes[i].code -= writes[i].length;
+	}
+}
+
+static void
+mprotect_text(const struct intercept_desc *desc, int prot,
+		const char *msg_on_error)
+{
+	unsigned char *first_page = round_down_address(desc->text_start);
+
+	mprotect_no_intercept(first_page,
+	    (size_t)(desc->text_end - first_page), prot, msg_on_error);
+}
+
+/*
+ * activate_patches()
+ * Overwrites each syscall with a jump to its wrapper. The code written is
+ * kept, and written again by the later calls following a call to
+ * deactivate_patches.
+ */
+void
+activate_patches(struct intercept_desc *desc)
+{
+	if (desc->writes == NULL) {
+		if (desc->count == 0)
+			return;
+
+		collect_writes(desc);
+	}
+
+	if (desc->is_active)
+		return;
+
+	if (!is_text_unchanged(desc)) {
+		forget_patches(desc);
+		return;
+	}
+
+	mprotect_text(desc, PROT_READ | PROT_WRITE | PROT_EXEC,
+	    "mprotect PROT_READ | PROT_WRITE | PROT_EXEC");
+
+	for (unsigned r = 0; r < PATCH_ROUNDS; ++r)
+		write_round(desc, r, true);
+
+	mprotect_text(desc, PROT_READ | PROT_EXEC,
+	    "mprotect PROT_READ | PROT_EXEC");
 
-			for (byte = patch->dst_jmp_patch + JUMP_INS_SIZE;
-				byte < patch->return_address;
-				++byte) {
-				*byte = INT3_OPCODE;
+	desc->is_active = true;
+}
+
+/*
+ * move_jump
+ * Moves a jump written over the original code by skip bytes, keeping the
+ * original code after the new code, as done by add_write. The wrapper is
+ * entered after the relocated copy of the instructions skipped -- the
+ * redirect address of the write.
+ */
+static void
+move_jump(struct code_write *write, unsigned skip)
+{
+	unsigned char *code = (unsigned char *)write->code;
+	unsigned length = write->length - skip;
+
+	write->address += skip;
+	write->redirect += skip;
+	write->length = length;
+
+	memmove(code + length, code + length + 2 * skip, length);
+	encode_jump(code, JMP_OPCODE, write->address, write->redirect);
+	memset(code + JUMP_INS_SIZE, INT3_OPCODE, length - JUMP_INS_SIZE);
+}
+
+/*
+ * keep_live_patchable
+ * Called after deactivating the patches, as these are written again by
+ * activate_patches while other threads might be running. The patches
+ * written at startup, that can not be written again this way are moved,
+ * or dropped, see add_live_fixup. Each patch has a single write in the
+ * first round, the writes of the rest are moved to fill the gaps.
+ */
+static void
+keep_live_patchable(struct intercept_desc *desc)
+{
+	unsigned next_fixup = 0;
+	unsigned dropped = 0;
+
+	if (desc->live_fixups == NULL)
+		return;
+
+	for (unsigned i = 0; i < desc->write_count; ++i) {
+		const struct live_fixup *fixup =
+		    desc->live_fixups + next_fixup;
+
+		if (next_fixup < desc->live_fixup_count &&
+		    fixup->write_index == i) {
+			++next_fixup;
+
+			if (fixup->skip == 0) {
+				leave_unpatched(desc, fixup->site);
+				++dropped;
+				continue;
 			}
+
+			move_jump(desc->writes + i, fixup->skip);
 		}
+
+		desc->writes[i - dropped] = desc->writes[i];
+	}
+
+	desc->write_count -= dropped;
+	for (unsigned r = 0; r < PATCH_ROUNDS; ++r)
+		desc->round_ends[r] -= dropped;
+
+	release_live_fixups(desc);
+}
+
+/*
+ * deactivate_patches()
+ * Restores the original code overwritten by activate_patches. The wrappers
+ * are kept, threads executing them when this is called continue
+ * normally.
+ */
+void
+deactivate_patches(struct intercept_desc *desc)
+{
+	if (desc->writes == NULL || !desc->is_active)
+		return;
+
+	if (!is_text_unchanged(desc)) {
+		forget_patches(desc);
+		return;
 	}
 
-	mprotect_no_intercept(first_page, size,
-	    PROT_READ | PROT_EXEC,
+	mprotect_text(desc, PROT_READ | PROT_WRITE | PROT_EXEC,
+	    "mprotect PROT_READ | PROT_WRITE | PROT_EXEC");
+
+	for (unsigned r = PATCH_ROUNDS; r > 0; --r)
+		write_round(desc, r - 1, false);
+
+	mprotect_text(desc, PROT_READ | PROT_EXEC,
 	    "mprotect PROT_READ | PROT_EXEC");
+
+	desc->is_active = false;
+
+	if (desc->uses_live_patching)
+		keep_live_patchable(desc);
+}
+
+/*
+ * forget_patches
+ * Releases the code kept for activating, and deactivating the patches,
+ * used when the object is no longer loaded. The resume points are dropped
+ * as well, no thread can continue in the original code once it is gone.
+ */
+void
+forget_patches(struct intercept_desc *desc)
+{
+	release_live_fixups(desc);
+
+	remove_resume_points(desc->resume_block);
+	desc->resume_block = NULL;
+
+	if (desc->writes != NULL)
+		xmunmap(desc->writes, desc->patched_code_size);
+
+	desc->writes = NULL;
+	desc->write_count = 0;
+	desc->patched_code_size = 0;
+	desc->is_active = false;
+}
+
+/*
+ * asm_wrapper_space
+ * The number of bytes used in the chunks so far, including the parts of
+ * pages left unused by mprotect_asm_wrappers. This memory is never
+ * released, or reused.
+ */
+size_t
+asm_wrapper_space(void)
+{
+	size_t size = 0;
+
+	for (unsigned i = 0; i < wrapper_chunk_count; ++i)
+		size += (size_t)(wrapper_chunks[i].next -
+				wrapper_chunks[i].start);
+
+	return size;
 }
 
 /*
  * mprotect_asm_wrappers
- * The code generated into the data segment at the asm_wrapper_space
- * array is not executable by default. This routine sets that memory region
- * to be executable, must called before attempting to execute any patched
- * syscall.
+ * The chunks of memory the wrappers are generated into are not executable
+ * while the wrappers are being generated. This routine sets the pages
+ * containing the wrappers generated since the last call to be executable
+ * (and no longer writable), must be called before attempting to execute
+ * any patched syscall. The next wrapper in a chunk is generated at the
+ * start of the following page.
  */
 void
 mprotect_asm_wrappers(void)
 {
-	mprotect_no_intercept(
-	    round_down_address(asm_wrapper_space + PAGE_SIZE),
-	    sizeof(asm_wrapper_space) - PAGE_SIZE,
-	    PROT_READ | PROT_EXEC,
-	    "mprotect_asm_wrappers PROT_READ | PROT_EXEC");
+	for (unsigned i = 0; i < wrapper_chunk_count; ++i) {
+		struct wrapper_chunk *chunk = wrapper_chunks + i;
+
+		if (chunk->next == chunk->sealed_end)
+			continue;
+
+		unsigned char *end = round_down_address(chunk->next +
+		    PAGE_SIZE - 1);
+
+		if (chunk->is_hugetlb)
+			end = chunk->start + WRAPPER_CHUNK_SIZE;
+
+		mprotect_no_intercept(chunk->sealed_end,
+		    (size_t)(end - chunk->sealed_end), PROT_READ | PROT_EXEC,
+		    "mprotect_asm_wrappers PROT_READ | PROT_EXEC");
+
+		chunk->sealed_end = end;
+		chunk->next = end;
+	}
 }
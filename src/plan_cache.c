@@ -0,0 +1,639 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * plan_cache.c -- caching the results of find_syscalls on disk.
+ *
+ * Disassembling the whole text section of libc is the most expensive part
+ * of starting a process using libsyscall_intercept. When the
+ * INTERCEPT_PLAN_CACHE environment variable names a directory, the
+ * information collected by find_syscalls about an object is stored in a
+ * file in that directory, named after the GNU build-id of the object.
+ * Another process loading the same object reads that file instead of
+ * disassembling the text section again.
+ *
+ * The file contains a header, followed by an array of struct plan_patch,
+ * and an array of struct plan_nop. It is only used if the build-id, the
+ * size and modification time of the object file, and the location of its
+ * text section all match, and if it was computed by the same disassembler,
+ * in the same mode ( full sweep, or INTERCEPT_SCAN_WINDOWS ). Only the
+ * parts of the jump table that are examined in create_patch_wrappers are
+ * stored, i.e. whether the syscall instruction and the instructions around
+ * it are jump destinations.
+ *
+ * The syscall numbers stored are not yet filtered by the syscall filter
+ * ( see remove_unselected_patches in intercept_desc.c ), so the same file
+ * can be used by processes with different filters.
+ *
+ * The plan is only trusted as far as it can be checked cheaply: the file
+ * must be owned by the effective user, and must not be writable by others.
+ * The instructions recorded around each syscall, and the NOPs recorded
+ * are decoded again from the text section, and must match the plan.
+ *
+ * Errors while storing the file are ignored, and a file that is not valid
+ * is ignored while loading it -- the text is disassembled in both cases.
+ * A new file is written to a temporary file first, and renamed, so a
+ * process never sees an incomplete file.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <syscall.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "intercept.h"
+#include "intercept_util.h"
+#include "disasm_wrapper.h"
+#include "libsyscall_intercept_hook_point.h"
+
+/* Changed whenever the format, or the way it is computed changes */
+#define PLAN_CACHE_VERSION 2
+
+#define PLAN_BUILD_ID_MAX 64
+#define PLAN_DISASM_NAME_MAX 16
+
+/* How the plan was computed */
+enum {
+	PLAN_MODE_SCAN_WINDOWS = 1 << 0,
+};
+
+static const char plan_cache_magic[8] = "SCIPLAN";
+
+struct plan_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t build_id_size;
+	unsigned char build_id[PLAN_BUILD_ID_MAX];
+	uint64_t file_size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint64_t text_offset;
+	uint64_t text_size;
+	char disasm_name[PLAN_DISASM_NAME_MAX];
+	uint32_t mode;
+	uint32_t patch_count;
+	uint32_t nop_count;
+};
+
+/*
+ * The parts of a struct intercept_disasm_result used after crawling
+ * the text section.
+ */
+enum {
+	PLAN_INS_SET = 1 << 0,
+	PLAN_INS_SYSCALL = 1 << 1,
+	PLAN_INS_IP_RELATIVE = 1 << 2,
+	PLAN_INS_CALL = 1 << 3,
+	PLAN_INS_JUMP = 1 << 4,
+	PLAN_INS_REL_JUMP = 1 << 5,
+	PLAN_INS_INDIRECT_JUMP = 1 << 6,
+	PLAN_INS_RET = 1 << 7,
+	PLAN_INS_NOP = 1 << 8,
+};
+
+struct plan_ins {
+	uint16_t length;
+	uint16_t flags;
+};
+
+/* Which addresses around a syscall instruction are jump destinations */
+enum {
+	PLAN_JUMP_TO_SYSCALL = 1 << 0,
+	PLAN_JUMP_TO_PRECEDING = 1 << 1,
+	PLAN_JUMP_TO_FOLLOWING = 1 << 2,
+};
+
+struct plan_patch {
+	/* the offset of the syscall instruction in the text section */
+	uint64_t offset;
+	int64_t syscall_nr;
+	uint32_t syscall_nr_distance;
+	uint8_t jumps;
+	struct plan_ins preceding_ins_2;
+	struct plan_ins preceding_ins;
+	struct plan_ins following_ins;
+};
+
+struct plan_nop {
+	uint64_t offset;
+	uint64_t size;
+};
+
+static const char *plan_cache_dir;
+
+/*
+ * plan_cache_setup -- the directory used, from INTERCEPT_PLAN_CACHE
+ */
+void
+plan_cache_setup(const char *dir)
+{
+	if (dir != NULL && dir[0] != '\0')
+		plan_cache_dir = dir;
+}
+
+/*
+ * plan_path
+ * Formats the path of the file belonging to the object, optionally with
+ * a suffix. Returns false if there is no such path.
+ */
+static bool
+plan_path(const struct intercept_desc *desc, char *buf, size_t size,
+		const char *suffix)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t dir_len = strlen(plan_cache_dir);
+
+	if (dir_len + 2 + 2 * desc->build_id_size + strlen(suffix) >= size)
+		return false;
+
+	memcpy(buf, plan_cache_dir, dir_len);
+	buf += dir_len;
+	*buf++ = '/';
+
+	for (size_t i = 0; i < desc->build_id_size; ++i) {
+		*buf++ = hex[desc->build_id[i] >> 4];
+		*buf++ = hex[desc->build_id[i] & 0xf];
+	}
+
+	strcpy(buf, suffix);
+
+	return true;
+}
+
+static bool
+is_usable(const struct intercept_desc *desc)
+{
+	return plan_cache_dir != NULL &&
+		desc->build_id != NULL &&
+		desc->build_id_size > 0 &&
+		desc->build_id_size <= PLAN_BUILD_ID_MAX;
+}
+
+/*
+ * fill_header
+ * The header expected for the object currently loaded, from its
+ * build-id, the file opened by find_syscalls, and the text section.
+ */
+static bool
+fill_header(const struct intercept_desc *desc, int fd,
+		struct plan_header *header)
+{
+	struct stat st;
+
+	if (syscall_no_intercept(SYS_fstat, fd, &st) != 0)
+		return false;
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, plan_cache_magic, sizeof(header->magic));
+	header->version = PLAN_CACHE_VERSION;
+	header->build_id_size = (uint32_t)desc->build_id_size;
+	memcpy(header->build_id, desc->build_id, desc->build_id_size);
+	header->file_size = (uint64_t)st.st_size;
+	header->mtime_sec = st.st_mtim.tv_sec;
+	header->mtime_nsec = st.st_mtim.tv_nsec;
+	header->text_offset = desc->text_offset;
+	header->text_size = (uint64_t)(desc->text_end - desc->text_start + 1);
+	strncpy(header->disasm_name, intercept_disasm_name,
+			sizeof(header->disasm_name) - 1);
+	header->mode = scan_windows ? PLAN_MODE_SCAN_WINDOWS : 0;
+
+	return true;
+}
+
+static struct plan_ins
+store_ins(const struct intercept_disasm_result *ins)
+{
+	struct plan_ins result;
+
+	result.length = (uint16_t)ins->length;
+	result.flags = (uint16_t)(
+		(ins->is_set ? PLAN_INS_SET : 0) |
+		(ins->is_syscall ? PLAN_INS_SYSCALL : 0) |
+		(ins->has_ip_relative_opr ? PLAN_INS_IP_RELATIVE : 0) |
+		(ins->is_call ? PLAN_INS_CALL : 0) |
+		(ins->is_jump ? PLAN_INS_JUMP : 0) |
+		(ins->is_rel_jump ? PLAN_INS_REL_JUMP : 0) |
+		(ins->is_indirect_jump ? PLAN_INS_INDIRECT_JUMP : 0) |
+		(ins->is_ret ? PLAN_INS_RET : 0) |
+		(ins->is_nop ? PLAN_INS_NOP : 0));
+
+	return result;
+}
+
+static struct intercept_disasm_result
+load_ins(struct plan_ins ins)
+{
+	struct intercept_disasm_result result;
+
+	memset(&result, 0, sizeof(result));
+	result.length = ins.length;
+	result.is_set = (ins.flags & PLAN_INS_SET) != 0;
+	result.is_syscall = (ins.flags & PLAN_INS_SYSCALL) != 0;
+	result.has_ip_relative_opr = (ins.flags & PLAN_INS_IP_RELATIVE) != 0;
+	result.is_call = (ins.flags & PLAN_INS_CALL) != 0;
+	result.is_jump = (ins.flags & PLAN_INS_JUMP) != 0;
+	result.is_rel_jump = (ins.flags & PLAN_INS_REL_JUMP) != 0;
+	result.is_indirect_jump = (ins.flags & PLAN_INS_INDIRECT_JUMP) != 0;
+	result.is_ret = (ins.flags & PLAN_INS_RET) != 0;
+	result.is_nop = (ins.flags & PLAN_INS_NOP) != 0;
+
+	return result;
+}
+
+/*
+ * is_trusted_file
+ * Only files written by the same user are used, which can not be
+ * modified by anyone else.
+ */
+static bool
+is_trusted_file(const struct stat *st)
+{
+	return S_ISREG(st->st_mode) &&
+		st->st_uid == (uid_t)syscall_no_intercept(SYS_geteuid) &&
+		(st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/*
+ * ins_matches
+ * Decodes the instruction at the address, and compares it to the one
+ * recorded in the plan.
+ */
+static bool
+ins_matches(struct intercept_disasm_context *context,
+		const struct intercept_desc *desc,
+		const unsigned char *code, struct plan_ins expected)
+{
+	if (code < desc->text_start ||
+	    code + expected.length - 1 > desc->text_end)
+		return false;
+
+	struct intercept_disasm_result ins =
+		intercept_disasm_next_instruction(context, code);
+	struct plan_ins found = store_ins(&ins);
+
+	return found.length == expected.length &&
+		found.flags == expected.flags;
+}
+
+/*
+ * patch_matches
+ * Checks a patch in the plan against the text section: the syscall
+ * instruction must be there, and the instructions around it must be
+ * decoded to the same lengths and kinds as recorded.
+ */
+static bool
+patch_matches(struct intercept_disasm_context *context,
+		const struct intercept_desc *desc,
+		const struct plan_patch *patch)
+{
+	const unsigned char *syscall_addr = desc->text_start + patch->offset;
+	const unsigned char *prev = syscall_addr - patch->preceding_ins.length;
+	const unsigned char *prev2 = prev - patch->preceding_ins_2.length;
+
+	if (syscall_addr[0] != 0x0f || syscall_addr[1] != 0x05)
+		return false;
+
+	if (patch->preceding_ins.length == 0 ||
+	    patch->following_ins.length == 0)
+		return false;
+
+	if (!ins_matches(context, desc, prev, patch->preceding_ins))
+		return false;
+
+	if (patch->preceding_ins_2.length != 0 &&
+	    !ins_matches(context, desc, prev2, patch->preceding_ins_2))
+		return false;
+
+	return ins_matches(context, desc, syscall_addr + SYSCALL_INS_SIZE,
+			patch->following_ins);
+}
+
+/*
+ * nop_matches
+ * Checks a NOP in the plan against the text section, it must be a single
+ * NOP instruction of the recorded size.
+ */
+static bool
+nop_matches(struct intercept_disasm_context *context,
+		const struct intercept_desc *desc,
+		const struct plan_nop *nop)
+{
+	const unsigned char *code = desc->text_start + nop->offset;
+
+	if (nop->size < 2 + 5 || nop->size > UINT16_MAX)
+		return false;
+
+	struct intercept_disasm_result ins =
+		intercept_disasm_next_instruction(context, code);
+
+	return ins.is_nop && ins.length == nop->size;
+}
+
+/*
+ * plan_matches_text
+ * Checks every patch, and every NOP in the plan against the text section.
+ */
+static bool
+plan_matches_text(const struct intercept_desc *desc,
+		const struct plan_header *header,
+		const struct plan_patch *patches,
+		const struct plan_nop *nops)
+{
+	struct intercept_disasm_context *context =
+		intercept_disasm_init(desc->text_start, desc->text_end);
+	bool result = true;
+
+	for (uint32_t i = 0; result && i < header->patch_count; ++i)
+		result = patch_matches(context, desc, patches + i);
+
+	for (uint32_t i = 0; result && i < header->nop_count; ++i)
+		result = nop_matches(context, desc, nops + i);
+
+	intercept_disasm_destroy(context);
+
+	return result;
+}
+
+/*
+ * plan_cache_load
+ * Fills the patches, the NOP table, and the relevant parts of the jump
+ * table from the file belonging to the object, if there is a valid one.
+ * The desc argument must already describe the text section, and have
+ * its jump table and NOP table allocated.
+ */
+bool
+plan_cache_load(struct intercept_desc *desc, int fd)
+{
+	char path[0x1000];
+	struct plan_header expected;
+	struct stat st;
+	bool result = false;
+
+	if (!is_usable(desc))
+		return false;
+
+	if (!plan_path(desc, path, sizeof(path), ""))
+		return false;
+
+	if (!fill_header(desc, fd, &expected))
+		return false;
+
+	long plan_fd = syscall_no_intercept(SYS_open, path, O_RDONLY);
+	if (plan_fd < 0)
+		return false;
+
+	if (syscall_no_intercept(SYS_fstat, plan_fd, &st) != 0 ||
+	    !is_trusted_file(&st) ||
+	    (size_t)st.st_size < sizeof(expected)) {
+		syscall_no_intercept(SYS_close, plan_fd);
+		return false;
+	}
+
+	size_t size = (size_t)st.st_size;
+	long addr = syscall_no_intercept(SYS_mmap, NULL, size, PROT_READ,
+				MAP_PRIVATE, plan_fd, (off_t)0);
+
+	syscall_no_intercept(SYS_close, plan_fd);
+
+	if (syscall_error_code(addr) != 0)
+		return false;
+
+	const struct plan_header *header = (const void *)addr;
+	const struct plan_patch *patches = (const void *)(header + 1);
+	const struct plan_nop *nops =
+		(const void *)(patches + header->patch_count);
+
+	if (memcmp(header, &expected, offsetof(struct plan_header,
+	    patch_count)) != 0)
+		goto out;
+
+	if (size != sizeof(*header) +
+	    header->patch_count * sizeof(patches[0]) +
+	    header->nop_count * sizeof(nops[0]))
+		goto out;
+
+	if (header->nop_count > desc->max_nop_count)
+		goto out;
+
+	for (uint32_t i = 0; i < header->patch_count; ++i) {
+		if (patches[i].offset > expected.text_size - SYSCALL_INS_SIZE)
+			goto out;
+	}
+
+	for (uint32_t i = 0; i < header->nop_count; ++i) {
+		if (nops[i].offset > expected.text_size ||
+		    nops[i].size > expected.text_size - nops[i].offset)
+			goto out;
+	}
+
+	if (!plan_matches_text(desc, header, patches, nops)) {
+		debug_dump("plan %s does not match %s\n", path, desc->path);
+		goto out;
+	}
+
+	desc->count = header->patch_count;
+	if (desc->count > 0)
+		desc->items = xmmap_anon(desc->count * sizeof(desc->items[0]));
+	desc->max_count = desc->count;
+
+	for (unsigned i = 0; i < desc->count; ++i) {
+		const struct plan_patch *src = patches + i;
+		struct patch_desc *patch = desc->items + i;
+
+		patch->containing_lib_path = desc->path;
+		patch->syscall_addr = desc->text_start + src->offset;
+		patch->syscall_offset = desc->text_offset + src->offset;
+		patch->preceding_ins_2 = load_ins(src->preceding_ins_2);
+		patch->preceding_ins = load_ins(src->preceding_ins);
+		patch->following_ins = load_ins(src->following_ins);
+		patch->syscall_nr = src->syscall_nr;
+		patch->syscall_nr_distance = src->syscall_nr_distance;
+		track_jumps_around(desc, patch->syscall_addr);
+	}
+
+	allocate_jump_table(desc);
+
+	for (unsigned i = 0; i < desc->count; ++i) {
+		const struct plan_patch *src = patches + i;
+		struct patch_desc *patch = desc->items + i;
+
+		if (src->jumps & PLAN_JUMP_TO_SYSCALL)
+			mark_jump(desc, patch->syscall_addr);
+
+		if (src->jumps & PLAN_JUMP_TO_PRECEDING)
+			mark_jump(desc, patch->syscall_addr -
+				patch->preceding_ins.length);
+
+		if (src->jumps & PLAN_JUMP_TO_FOLLOWING)
+			mark_jump(desc, patch->syscall_addr +
+				SYSCALL_INS_SIZE);
+	}
+
+	desc->nop_count = header->nop_count;
+	for (size_t i = 0; i < desc->nop_count; ++i) {
+		desc->nop_table[i].address = desc->text_start + nops[i].offset;
+		desc->nop_table[i].size = nops[i].size;
+	}
+
+	debug_dump("plan of %s loaded from %s\n", desc->path, path);
+
+	result = true;
+
+out:
+	xmunmap((void *)addr, size);
+
+	return result;
+}
+
+/*
+ * write_all -- write the whole buffer, or fail
+ */
+static bool
+write_all(long fd, const void *buffer, size_t size)
+{
+	const char *c = buffer;
+
+	while (size > 0) {
+		long r = syscall_no_intercept(SYS_write, fd, c, size);
+
+		if (r <= 0)
+			return false;
+
+		c += r;
+		size -= (size_t)r;
+	}
+
+	return true;
+}
+
+/*
+ * plan_cache_store
+ * Stores the information collected by find_syscalls about the object,
+ * to be used by plan_cache_load in other processes.
+ */
+void
+plan_cache_store(const struct intercept_desc *desc, int fd)
+{
+	char path[0x1000];
+	char tmp_path[0x1000];
+	char suffix[32] = ".tmp.";
+	struct plan_header *header;
+
+	if (!is_usable(desc))
+		return;
+
+	long pid = syscall_no_intercept(SYS_getpid);
+	char *c = suffix + strlen(suffix);
+	char digits[24];
+	size_t n = 0;
+
+	do {
+		digits[n++] = (char)('0' + pid % 10);
+		pid /= 10;
+	} while (pid > 0);
+
+	while (n > 0)
+		*c++ = digits[--n];
+	*c = '\0';
+
+	if (!plan_path(desc, path, sizeof(path), "") ||
+	    !plan_path(desc, tmp_path, sizeof(tmp_path), suffix))
+		return;
+
+	size_t size = sizeof(*header) +
+		desc->count * sizeof(struct plan_patch) +
+		desc->nop_count * sizeof(struct plan_nop);
+
+	header = xmmap_anon(size);
+
+	if (!fill_header(desc, fd, header))
+		goto out;
+
+	header->patch_count = desc->count;
+	header->nop_count = (uint32_t)desc->nop_count;
+
+	struct plan_patch *patches = (void *)(header + 1);
+	struct plan_nop *nops = (void *)(patches + desc->count);
+
+	for (unsigned i = 0; i < desc->count; ++i) {
+		const struct patch_desc *patch = desc->items + i;
+		struct plan_patch *dst = patches + i;
+
+		dst->offset =
+		    (uint64_t)(patch->syscall_addr - desc->text_start);
+		dst->syscall_nr = patch->syscall_nr;
+		dst->syscall_nr_distance = patch->syscall_nr_distance;
+		dst->preceding_ins_2 = store_ins(&patch->preceding_ins_2);
+		dst->preceding_ins = store_ins(&patch->preceding_ins);
+		dst->following_ins = store_ins(&patch->following_ins);
+		dst->jumps = 0;
+
+		if (has_jump(desc, patch->syscall_addr))
+			dst->jumps |= PLAN_JUMP_TO_SYSCALL;
+
+		if (has_jump(desc, patch->syscall_addr -
+		    patch->preceding_ins.length))
+			dst->jumps |= PLAN_JUMP_TO_PRECEDING;
+
+		if (has_jump(desc, patch->syscall_addr + SYSCALL_INS_SIZE))
+			dst->jumps |= PLAN_JUMP_TO_FOLLOWING;
+	}
+
+	for (size_t i = 0; i < desc->nop_count; ++i) {
+		nops[i].offset =
+		    (uint64_t)(desc->nop_table[i].address - desc->text_start);
+		nops[i].size = desc->nop_table[i].size;
+	}
+
+	long tmp_fd = syscall_no_intercept(SYS_open, tmp_path,
+			O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+
+	if (tmp_fd < 0)
+		goto out;
+
+	bool written = write_all(tmp_fd, header, size);
+
+	syscall_no_intercept(SYS_close, tmp_fd);
+
+	if (written &&
+	    syscall_no_intercept(SYS_rename, tmp_path, path) == 0)
+		debug_dump("plan of %s stored to %s\n", desc->path, path);
+	else
+		syscall_no_intercept(SYS_unlink, tmp_path);
+
+out:
+	xmunmap(header, size);
+}
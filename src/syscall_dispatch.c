@@ -0,0 +1,662 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * syscall_dispatch.c -- intercepting syscalls at the syscall instructions
+ * that are not patched, using Syscall User Dispatch ( see
+ * PR_SET_SYSCALL_USER_DISPATCH in prctl(2) ), when the
+ * INTERCEPT_USER_DISPATCH environment variable is set.
+ *
+ * The kernel raises SIGSYS in a thread attempting a syscall while the
+ * selector byte registered for the thread is SYSCALL_DISPATCH_FILTER_BLOCK,
+ * unless the syscall instruction is in the allowed region -- which covers
+ * the syscall instructions in util.S, e.g. syscall_no_intercept. In this
+ * mode, every syscall of a patched syscall instruction is passed to
+ * intercept_routine ( see syscall_filter_require_all ), and executed by
+ * syscall_no_intercept. Thus SIGSYS is only raised at syscall instructions
+ * that are not patched: the ones create_patch_wrappers found no space
+ * around, the ones in objects not patched, and the ones in code generated
+ * at runtime. The handle_sigsys function forwards these to intercept_routine,
+ * and counts them per address -- the counts are written to the log when the
+ * process exits.
+ *
+ * The setting is per thread, and is not inherited by new threads, or
+ * processes, it is turned on for each thread by dispatch_enter, when the
+ * thread first enters intercept_routine.
+ *
+ * The few syscalls executed in their original context ( clone with a new
+ * stack, clone3, vfork ) are executed with the selector set to
+ * SYSCALL_DISPATCH_FILTER_ALLOW. The selector is only set back when the
+ * thread enters intercept_routine again, the syscalls of the code not
+ * patched are not intercepted in the meantime.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/prctl.h>
+#include <syscall.h>
+#include <ucontext.h>
+
+#include "intercept.h"
+#include "intercept_log.h"
+#include "intercept_util.h"
+#include "libsyscall_intercept_hook_point.h"
+
+/* missing from old headers */
+#ifndef PR_SET_SYSCALL_USER_DISPATCH
+#define PR_SET_SYSCALL_USER_DISPATCH 59
+#define PR_SYS_DISPATCH_OFF 0
+#define PR_SYS_DISPATCH_ON 1
+#define SYSCALL_DISPATCH_FILTER_ALLOW 0
+#define SYSCALL_DISPATCH_FILTER_BLOCK 1
+#endif
+
+#ifndef SYS_USER_DISPATCH
+#define SYS_USER_DISPATCH 2
+#endif
+
+bool dispatch_enabled;
+
+/* see util.S */
+extern unsigned char intercept_dispatch_allowed_begin;
+extern unsigned char intercept_dispatch_allowed_end;
+__attribute__((noreturn)) void intercept_sigreturn(long rsp);
+
+/*
+ * The state of a thread: the selector byte registered using prctl, is the
+ * setting turned on, and the number of handle_sigsys calls running on the
+ * thread. The selector stays SYSCALL_DISPATCH_FILTER_ALLOW while the hooks
+ * are called from handle_sigsys -- a SIGSYS raised while SIGSYS is blocked
+ * would kill the process.
+ */
+struct dispatch_thread {
+	volatile char selector;
+	bool is_on;
+	unsigned handling;
+};
+
+static __thread struct dispatch_thread thread
+	__attribute__((tls_model("initial-exec")));
+
+/*
+ * The syscall instructions SIGSYS was raised at, in an open addressing hash
+ * table keyed by address. The sites create_patch_wrappers did not patch are
+ * added at startup with their paths, and offsets -- the rest are only known
+ * by their addresses. Once the table is full, the rest are counted together
+ * in overflow_site.
+ */
+struct dispatch_site {
+	struct patch_site site;
+	unsigned long count;
+};
+
+#define DISPATCH_SITE_BITS 12
+#define DISPATCH_SITE_COUNT (1u << DISPATCH_SITE_BITS)
+
+static struct dispatch_site *sites;
+
+static const char unknown_path[] = "[unknown]";
+
+static struct dispatch_site overflow_site = {
+	.site = {
+		.containing_lib_path = unknown_path,
+		.syscall_nr = -1,
+	},
+};
+
+/*
+ * The SIGSYS handler the program installed, or the one in effect before the
+ * one installed here. It is read by handle_sigsys in any thread, so a new
+ * one is published by replacing the pointer. The old ones are not unmapped,
+ * a handler might still be reading them -- a program only changes the
+ * handling of SIGSYS a few times.
+ */
+static struct kernel_sigaction initial_action;
+static struct kernel_sigaction *previous_action = &initial_action;
+
+static const struct kernel_sigaction *
+load_previous_action(void)
+{
+	return __atomic_load_n(&previous_action, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * find_site -- looks up the record of a syscall instruction, adds it if it
+ * is not in the table yet. The path, and offset are copied from the known
+ * argument when adding, if it is not NULL.
+ */
+static struct dispatch_site *
+find_site(unsigned char *address, const struct patch_site *known)
+{
+	uint64_t hash = (uint64_t)(uintptr_t)address *
+				UINT64_C(0x9e3779b97f4a7c15);
+	unsigned first = (unsigned)(hash >> (64 - DISPATCH_SITE_BITS));
+
+	for (unsigned i = 0; i < DISPATCH_SITE_COUNT; ++i) {
+		struct dispatch_site *s =
+			sites + ((first + i) & (DISPATCH_SITE_COUNT - 1));
+		unsigned char *expected = NULL;
+
+		if (__atomic_compare_exchange_n(&s->site.syscall_addr,
+		    &expected, address, false,
+		    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			s->site.syscall_offset =
+			    known ? known->syscall_offset : 0;
+			s->site.syscall_nr = known ? known->syscall_nr : -1;
+			__atomic_store_n(&s->site.containing_lib_path,
+			    known ? known->containing_lib_path : unknown_path,
+			    __ATOMIC_RELEASE);
+			return s;
+		}
+
+		if (expected != address)
+			continue;
+
+		/* added by another thread just now? */
+		while (__atomic_load_n(&s->site.containing_lib_path,
+		    __ATOMIC_ACQUIRE) == NULL)
+			syscall_no_intercept(SYS_sched_yield);
+
+		return s;
+	}
+
+	return &overflow_site;
+}
+
+static bool
+is_dispatch_site(const struct patch_site *site)
+{
+	const struct dispatch_site *s = (const struct dispatch_site *)site;
+
+	return s == &overflow_site ||
+	    (s >= sites && s < sites + DISPATCH_SITE_COUNT);
+}
+
+/*
+ * dispatch_register_site -- called by create_patch_wrappers for each syscall
+ * instruction it could not patch.
+ */
+void
+dispatch_register_site(const struct patch_site *site)
+{
+	find_site(site->syscall_addr, site);
+}
+
+static void
+set_sigsys_action(const struct kernel_sigaction *action,
+			struct kernel_sigaction *old)
+{
+	long result = syscall_no_intercept(SYS_rt_sigaction, SIGSYS,
+			action, old, sizeof(action->mask));
+
+	xabort_on_syserror(result, "rt_sigaction SIGSYS");
+}
+
+/*
+ * dispatch_report -- writes the number of syscalls seen by handle_sigsys
+ * at each syscall instruction to the log, and the debug output. The counts
+ * are reset, a process reporting them before an execve that fails only
+ * reports the ones seen later when it exits.
+ */
+static void
+dispatch_report(void)
+{
+	char buffer[0x200];
+
+	for (unsigned i = 0; i <= DISPATCH_SITE_COUNT; ++i) {
+		struct dispatch_site *s = (i < DISPATCH_SITE_COUNT) ?
+			(sites + i) : &overflow_site;
+		unsigned long count =
+			__atomic_exchange_n(&s->count, 0, __ATOMIC_RELAXED);
+
+		if (count == 0)
+			continue;
+
+		int l = snprintf(buffer, sizeof(buffer),
+			"%s 0x%x -- %lu syscalls dispatched at %p\n",
+			s->site.containing_lib_path, s->site.syscall_offset,
+			count, (void *)s->site.syscall_addr);
+
+		intercept_log(buffer, (size_t)l);
+		debug_dump("%s", buffer);
+	}
+}
+
+/*
+ * forward_sigsys -- a SIGSYS not raised by Syscall User Dispatch, e.g. by
+ * seccomp, is handled by the handler the program installed.
+ */
+static void
+forward_sigsys(int sig, siginfo_t *info, void *context)
+{
+	const struct kernel_sigaction *action = load_previous_action();
+
+	if (action->u.handler == SIG_IGN)
+		return;
+
+	if (action->u.handler == SIG_DFL) {
+		dispatch_report();
+		set_sigsys_action(action, NULL);
+		syscall_no_intercept(SYS_tgkill,
+			syscall_no_intercept(SYS_getpid),
+			syscall_no_intercept(SYS_gettid), SIGSYS);
+		return;
+	}
+
+	if (action->flags & SA_SIGINFO)
+		action->u.sigaction(sig, info, context);
+	else
+		action->u.handler(sig);
+}
+
+/*
+ * handle_sigsys
+ * The registers of the thread are the ones seen at the syscall instruction,
+ * the instruction pointer points to the following instruction. If the
+ * syscall is not executed by intercept_routine_dispatched, the thread
+ * executes the syscall instruction again, while the selector allows it.
+ */
+static void
+handle_sigsys(int sig, siginfo_t *info, void *context)
+{
+	ucontext_t *uc = context;
+	greg_t *regs = uc->uc_mcontext.gregs;
+
+	if (info->si_code != SYS_USER_DISPATCH) {
+		forward_sigsys(sig, info, context);
+		return;
+	}
+
+	thread.selector = SYSCALL_DISPATCH_FILTER_ALLOW;
+	++thread.handling;
+
+	unsigned char *address = (unsigned char *)info->si_call_addr -
+					SYSCALL_INS_SIZE;
+	struct dispatch_site *site = find_site(address, NULL);
+
+	__atomic_add_fetch(&site->count, 1, __ATOMIC_RELAXED);
+
+	if (intercept_routine_dispatched(&site->site, regs))
+		thread.selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+	else
+		regs[REG_RIP] = (greg_t)address;
+
+	--thread.handling;
+}
+
+/*
+ * dispatch_setup -- turns on the mode, if the value of the
+ * INTERCEPT_USER_DISPATCH environment variable is not NULL, and the kernel
+ * supports Syscall User Dispatch ( Linux 5.11 and newer ).
+ */
+void
+dispatch_setup(const char *value)
+{
+	if (value == NULL)
+		return;
+
+	long result = syscall_no_intercept(SYS_prctl,
+			PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_OFF,
+			0, 0, 0);
+
+	if (syscall_error_code(result) != 0) {
+		debug_dump("Syscall User Dispatch not supported: %d\n",
+		    syscall_error_code(result));
+		return;
+	}
+
+	sites = xmmap_anon(DISPATCH_SITE_COUNT * sizeof(sites[0]));
+
+	/*
+	 * SIGSYS is not blocked while handling it: a signal delivered right
+	 * after SIGSYS is handled before handle_sigsys starts, and its
+	 * handler might raise SIGSYS, too.
+	 */
+	struct kernel_sigaction action = {
+		.u.sigaction = handle_sigsys,
+		.flags = SA_SIGINFO | SA_RESTORER | SA_NODEFER,
+		.restorer = intercept_restore_rt,
+		.mask = 0,
+	};
+
+	set_sigsys_action(&action, &initial_action);
+	syscall_filter_require_all();
+
+	dispatch_enabled = true;
+}
+
+/*
+ * dispatch_thread_start -- turns the setting on for the calling thread.
+ */
+static void
+dispatch_thread_start(void)
+{
+	thread.selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+
+	long result = syscall_no_intercept(SYS_prctl,
+			PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_ON,
+			&intercept_dispatch_allowed_begin,
+			&intercept_dispatch_allowed_end -
+			&intercept_dispatch_allowed_begin,
+			&thread.selector);
+
+	xabort_on_syserror(result, "prctl PR_SET_SYSCALL_USER_DISPATCH");
+	thread.is_on = true;
+}
+
+/*
+ * dispatch_thread_stop -- turns the setting off for the calling thread,
+ * while the patches are deactivated ( see intercept_deactivate ), the
+ * syscalls of the code not patched are not intercepted either.
+ */
+void
+dispatch_thread_stop(void)
+{
+	long result = syscall_no_intercept(SYS_prctl,
+			PR_SET_SYSCALL_USER_DISPATCH, PR_SYS_DISPATCH_OFF,
+			0, 0, 0);
+
+	xabort_on_syserror(result, "prctl PR_SET_SYSCALL_USER_DISPATCH");
+	thread.is_on = false;
+}
+
+/*
+ * dispatch_enter -- called when a thread enters intercept_routine. Turns the
+ * setting on in threads that were not seen before, and sets the selector
+ * back after a syscall executed in its original context.
+ */
+void
+dispatch_enter(bool patches_active)
+{
+	if (!patches_active || thread.handling != 0)
+		return;
+
+	if (!thread.is_on)
+		dispatch_thread_start();
+	else
+		thread.selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+}
+
+/*
+ * dispatch_original_context -- called before returning a syscall to be
+ * executed in its original context to the asm wrapper, or to handle_sigsys.
+ * The rt_sigreturn syscall is executed here, in the allowed region, with the
+ * state of the thread set back to the state seen before handle_sigsys, if
+ * it is called from there.
+ */
+void
+dispatch_original_context(const struct patch_site *site,
+			long syscall_number, long rsp)
+{
+	if (syscall_number == SYS_rt_sigreturn) {
+		if (is_dispatch_site(site)) {
+			--thread.handling;
+			thread.selector = SYSCALL_DISPATCH_FILTER_BLOCK;
+		}
+
+		intercept_sigreturn(rsp);
+	}
+
+	thread.selector = SYSCALL_DISPATCH_FILTER_ALLOW;
+}
+
+/*
+ * replace_sigsys_action
+ * Executes rt_sigaction for SIGSYS, without changing the handler installed
+ * by dispatch_setup -- the program's handler is only stored, and called from
+ * forward_sigsys. Fails the way the kernel would, on an invalid set size,
+ * or address.
+ */
+static long
+replace_sigsys_action(long new, long old, long set_size)
+{
+	struct kernel_sigaction action;
+	const struct kernel_sigaction *previous;
+
+	if (set_size != sizeof(action.mask))
+		return -EINVAL;
+
+	if (new != 0) {
+		if (!read_user_memory(&action, new, sizeof(action)))
+			return -EFAULT;
+
+		struct kernel_sigaction *copy = xmmap_anon(sizeof(*copy));
+
+		*copy = action;
+		previous = __atomic_exchange_n(&previous_action, copy,
+				__ATOMIC_ACQ_REL);
+	} else {
+		previous = load_previous_action();
+	}
+
+	if (old != 0 && !write_user_memory(old, previous, sizeof(*previous)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/*
+ * is_last_thread -- is the calling thread the only one in the process,
+ * judging by the entries in /proc/self/task.
+ */
+static bool
+is_last_thread(void)
+{
+	struct linux_dirent64 {
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+		char d_name[];
+	};
+
+	char buffer[0x400] __attribute__((aligned(8)));
+	unsigned threads = 0;
+
+	long fd = syscall_no_intercept(SYS_open, "/proc/self/task",
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	if (fd < 0)
+		return false;
+
+	long size;
+	while (threads <= 1 && (size = syscall_no_intercept(SYS_getdents64,
+	    fd, buffer, sizeof(buffer))) > 0) {
+		for (long offset = 0; offset < size; ) {
+			const struct linux_dirent64 *entry =
+				(const void *)(buffer + offset);
+
+			if (entry->d_name[0] != '.')
+				++threads;
+
+			offset += entry->d_reclen;
+		}
+	}
+
+	syscall_no_intercept(SYS_close, fd);
+
+	return threads == 1;
+}
+
+/*
+ * is_fatal_to_self
+ * Is the syscall sending a signal to the calling process, which terminates
+ * it -- a signal whose default action is to terminate the process, and that
+ * has no handler.
+ */
+static bool
+is_fatal_to_self(const struct syscall_desc *desc)
+{
+	const long *a = desc->args;
+	long pid = syscall_no_intercept(SYS_getpid);
+	long sig;
+
+	if (desc->nr == SYS_kill && (a[0] == 0 || a[0] == pid))
+		sig = a[1];
+	else if (desc->nr == SYS_tgkill && a[0] == pid)
+		sig = a[2];
+	else if (desc->nr == SYS_tkill &&
+	    a[0] == syscall_no_intercept(SYS_gettid))
+		sig = a[1];
+	else
+		return false;
+
+	switch (sig) {
+	case SIGCHLD:
+	case SIGCONT:
+	case SIGURG:
+	case SIGWINCH:
+	case SIGSTOP:
+	case SIGTSTP:
+	case SIGTTIN:
+	case SIGTTOU:
+		return false;
+	}
+
+	if (sig <= 0 || sig > 64)
+		return false;
+
+	if (sig == SIGSYS)
+		return load_previous_action()->u.handler == SIG_DFL;
+
+	struct kernel_sigaction action;
+
+	if (syscall_no_intercept(SYS_rt_sigaction, sig, NULL, &action,
+	    sizeof(action.mask)) != 0)
+		return false;
+
+	return action.u.handler == SIG_DFL;
+}
+
+/*
+ * sigset_without_sigsys -- a signal set with SIGSYS removed, a
+ * SIGSYS raised while SIGSYS is blocked kills the process.
+ */
+static uint64_t
+sigset_without_sigsys(uint64_t set)
+{
+	return set & ~(UINT64_C(1) << (SIGSYS - 1));
+}
+
+/*
+ * dispatch_syscall
+ * Called by intercept_routine instead of executing a syscall using
+ * syscall_no_intercept. Returns true if it executed the syscall -- the ones
+ * changing the handling of SIGSYS are altered, and a new process gets the
+ * setting turned on. The counts are reported when the process is about to
+ * exit, or to execute a new program: on exit_group, exit of the last thread,
+ * execve, and on a fatal signal sent to itself.
+ */
+bool
+dispatch_syscall(const struct syscall_desc *desc, long *result)
+{
+	const long *a = desc->args;
+
+	switch (desc->nr) {
+	case SYS_rt_sigaction:
+		if (a[0] == SIGSYS) {
+			*result = replace_sigsys_action(a[1], a[2], a[3]);
+			return true;
+		}
+
+		if (a[1] != 0 && a[3] == sizeof(uint64_t)) {
+			struct kernel_sigaction action;
+
+			if (!read_user_memory(&action, a[1], sizeof(action))) {
+				*result = -EFAULT;
+				return true;
+			}
+
+			action.mask = sigset_without_sigsys(action.mask);
+			*result = syscall_no_intercept(desc->nr, a[0],
+					&action, a[2], a[3]);
+			return true;
+		}
+
+		return false;
+
+	case SYS_rt_sigprocmask:
+		if (a[0] != SIG_UNBLOCK && a[1] != 0 &&
+		    a[3] == sizeof(uint64_t)) {
+			uint64_t set;
+
+			if (!read_user_memory(&set, a[1], sizeof(set))) {
+				*result = -EFAULT;
+				return true;
+			}
+
+			set = sigset_without_sigsys(set);
+			*result = syscall_no_intercept(desc->nr, a[0],
+					&set, a[2], a[3]);
+			return true;
+		}
+
+		return false;
+
+	case SYS_clone:
+	case SYS_fork:
+		*result = syscall_no_intercept(desc->nr, a[0], a[1], a[2],
+					a[3], a[4], a[5]);
+		if (*result == 0)
+			dispatch_thread_start();
+
+		return true;
+
+	case SYS_exit:
+		if (is_last_thread())
+			dispatch_report();
+		return false;
+
+	case SYS_kill:
+	case SYS_tgkill:
+	case SYS_tkill:
+		if (is_fatal_to_self(desc))
+			dispatch_report();
+		return false;
+
+	case SYS_execve:
+#ifdef SYS_execveat
+	case SYS_execveat:
+#endif
+	case SYS_exit_group:
+		dispatch_report();
+		return false;
+
+	default:
+		return false;
+	}
+}
@@ -0,0 +1,368 @@
+/*
+ * Copyright 2016-2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * syscall_filter.c -- the set of syscall numbers the user of the library
+ * is interested in.
+ *
+ * The asm wrappers test the syscall number against syscall_filter_bitmap
+ * before calling intercept_wrapper. If the corresponding bit is not set,
+ * the wrapper executes the syscall on its own -- see intercept_template.S.
+ *
+ * There are two sets stored here:
+ * requested_filter -- the set of syscalls to forward to the hooks, as
+ *  described by the user of the library.
+ * syscall_filter_bitmap -- the set of syscalls that should be passed
+ *  to intercept_routine by the asm wrappers. This is the union of the
+ *  requested_filter, and the set of syscalls with hooks registered
+ *  using intercept_register_hook, and the syscalls the library itself
+ *  needs to see ( see syscall_filter_require ) -- except while logging is
+ *  enabled, in which case every syscall must be seen by intercept_routine.
+ *
+ * The initial set can also be specified using the INTERCEPT_SYSCALL_FILTER
+ * environment variable. In that case, syscall instructions known to
+ * be used for syscalls outside of that set are not even patched, see
+ * should_patch_syscall below.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "intercept.h"
+#include "intercept_log.h"
+#include "intercept_util.h"
+#include "syscall_formats.h"
+#include "libsyscall_intercept_hook_point.h"
+
+#define ALL_SELECTED { \
+	UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX, \
+	UINT64_MAX, UINT64_MAX, UINT64_MAX, UINT64_MAX }
+
+uint64_t syscall_filter_bitmap[SYSCALL_FILTER_SIZE / 64] = ALL_SELECTED;
+
+static uint64_t requested_filter[SYSCALL_FILTER_SIZE / 64] = ALL_SELECTED;
+
+/* The syscalls with hook functions registered, see hook_registry.c */
+static uint64_t registered_hooks[SYSCALL_FILTER_SIZE / 64];
+
+/* The syscalls intercept_routine needs to see, see syscall_filter_require */
+static uint64_t required_syscalls[SYSCALL_FILTER_SIZE / 64];
+
+static bool logging_enabled;
+
+/* Must every syscall be seen? See syscall_filter_require_all */
+static bool all_required;
+
+/* Was the filter specified using the INTERCEPT_SYSCALL_FILTER variable? */
+static bool patch_selected_only;
+
+/*
+ * Serializes update_bitmap calls -- e.g. one made while registering a hook,
+ * and one made by intercept_set_syscall_filter on another thread. Without
+ * it, the words computed by the first one could be stored last.
+ */
+static int bitmap_lock;
+
+static void
+lock_bitmap(void)
+{
+	spin_lock(&bitmap_lock);
+}
+
+static void
+unlock_bitmap(void)
+{
+	spin_unlock(&bitmap_lock);
+}
+
+/*
+ * update_bitmap -- copy the requested set into the bitmap used by the
+ * asm wrappers. Each word is stored using a single store, as the asm
+ * wrappers might be reading it concurrently.
+ */
+static void
+update_bitmap(void)
+{
+	lock_bitmap();
+
+	for (size_t i = 0; i < SYSCALL_FILTER_SIZE / 64; ++i) {
+		uint64_t word = __atomic_load_n(requested_filter + i,
+						__ATOMIC_RELAXED);
+
+		word |= __atomic_load_n(registered_hooks + i,
+					__ATOMIC_RELAXED);
+		word |= required_syscalls[i];
+
+		if (logging_enabled || all_required)
+			word = UINT64_MAX;
+
+		__atomic_store_n(syscall_filter_bitmap + i, word,
+				__ATOMIC_RELAXED);
+	}
+
+	unlock_bitmap();
+}
+
+/*
+ * is_syscall_selected -- should a syscall be forwarded to the hooks?
+ * Syscall numbers too large for the bitmap are always forwarded.
+ */
+bool
+is_syscall_selected(long syscall_number)
+{
+	unsigned long nr = (unsigned long)syscall_number;
+
+	if (nr >= SYSCALL_FILTER_SIZE)
+		return true;
+
+	uint64_t word = __atomic_load_n(requested_filter + nr / 64,
+					__ATOMIC_RELAXED);
+
+	return (word & (UINT64_C(1) << (nr % 64))) != 0;
+}
+
+static void
+log_unpatched_hook(unsigned long nr)
+{
+	char buffer[0x100];
+
+	int l = snprintf(buffer, sizeof(buffer),
+		"hook registered for syscall %lu, the syscall instructions "
+		"used only for it are not patched, as it is not in "
+		"INTERCEPT_SYSCALL_FILTER\n", nr);
+
+	intercept_log(buffer, (size_t)l);
+}
+
+/*
+ * syscall_filter_set_registered -- called when the first hook is registered
+ * for a syscall, or the last one is unregistered. The syscalls with hooks
+ * registered are always passed to intercept_routine, regardless of the
+ * filter requested for intercept_hook_point -- from the syscall
+ * instructions that are patched, see should_patch_syscall. A hook
+ * registered for a syscall whose instructions are left intact is logged.
+ */
+void
+syscall_filter_set_registered(long syscall_number, bool registered)
+{
+	unsigned long nr = (unsigned long)syscall_number;
+	uint64_t bit = UINT64_C(1) << (nr % 64);
+
+	if (nr >= SYSCALL_FILTER_SIZE)
+		return;
+
+	if (registered) {
+		uint64_t old = __atomic_fetch_or(registered_hooks + nr / 64,
+					bit, __ATOMIC_RELAXED);
+
+		if ((old & bit) == 0 && !should_patch_syscall(syscall_number))
+			log_unpatched_hook(nr);
+	} else {
+		__atomic_fetch_and(registered_hooks + nr / 64, ~bit,
+				__ATOMIC_RELAXED);
+	}
+
+	update_bitmap();
+}
+
+/*
+ * syscall_filter_require -- called at startup for syscalls the library
+ * watches on its own, e.g. the mmap syscalls of the dynamic loader. These are
+ * always passed to intercept_routine, and always patched, but are only
+ * forwarded to the hooks if selected.
+ */
+void
+syscall_filter_require(long syscall_number)
+{
+	unsigned long nr = (unsigned long)syscall_number;
+
+	if (nr >= SYSCALL_FILTER_SIZE)
+		return;
+
+	required_syscalls[nr / 64] |= UINT64_C(1) << (nr % 64);
+
+	update_bitmap();
+}
+
+/*
+ * syscall_filter_require_all -- called at startup when Syscall User Dispatch
+ * is used, every syscall must be executed by intercept_routine in that case,
+ * and every syscall instruction must be patched -- see syscall_dispatch.c
+ * The syscall instructions in the wrappers are outside the region allowed by
+ * Syscall User Dispatch, so the paths of the wrappers executing a syscall
+ * without calling intercept_routine can not be used. This makes every
+ * syscall as expensive as one forwarded to the hooks, and patching ignores
+ * INTERCEPT_SYSCALL_FILTER.
+ */
+void
+syscall_filter_require_all(void)
+{
+	all_required = true;
+	update_bitmap();
+}
+
+/*
+ * syscall_filter_select_all -- called when logging is turned on, or off.
+ * While logging, every syscall goes through intercept_routine, but only
+ * the selected ones are forwarded to the hooks.
+ */
+void
+syscall_filter_select_all(bool all)
+{
+	logging_enabled = all;
+	update_bitmap();
+}
+
+/*
+ * parse_syscall -- parse a single item of the list in the
+ * INTERCEPT_SYSCALL_FILTER environment variable, a syscall name or a
+ * decimal syscall number. Returns -1 if it is neither.
+ */
+static long
+parse_syscall(const char *item, size_t length)
+{
+	long nr = 0;
+
+	if (length == 0)
+		return -1;
+
+	if (item[0] < '0' || item[0] > '9')
+		return syscall_number_by_name(item, length);
+
+	for (size_t i = 0; i < length; ++i) {
+		if (item[i] < '0' || item[i] > '9')
+			return -1;
+
+		nr = nr * 10 + (item[i] - '0');
+
+		if (nr >= SYSCALL_FILTER_SIZE)
+			return -1;
+	}
+
+	return nr;
+}
+
+/*
+ * syscall_filter_setup -- set up the initial set of syscalls selected,
+ * using a comma separated list of syscall names and numbers, e.g.:
+ * "read,write,openat,257". If the list is NULL, every syscall is selected.
+ */
+void
+syscall_filter_setup(const char *spec)
+{
+	if (spec == NULL)
+		return;
+
+	for (size_t i = 0; i < SYSCALL_FILTER_SIZE / 64; ++i)
+		requested_filter[i] = 0;
+
+	while (*spec != '\0') {
+		size_t length = 0;
+
+		while (spec[length] != '\0' && spec[length] != ',')
+			++length;
+
+		long nr = parse_syscall(spec, length);
+		if (nr < 0 || nr >= SYSCALL_FILTER_SIZE)
+			xabort("invalid syscall in INTERCEPT_SYSCALL_FILTER");
+
+		requested_filter[nr / 64] |= UINT64_C(1) << (nr % 64);
+
+		spec += length;
+		if (*spec == ',')
+			++spec;
+	}
+
+	patch_selected_only = true;
+	update_bitmap();
+}
+
+/*
+ * should_patch_syscall -- should a syscall instruction be patched, given
+ * the syscall number it is used for? The syscall_number argument is -1
+ * if it is not known.
+ * Syscall instructions used only for syscalls not selected using the
+ * INTERCEPT_SYSCALL_FILTER environment variable are left intact, so
+ * these syscalls have no overhead at all.
+ */
+bool
+should_patch_syscall(long syscall_number)
+{
+	if (!patch_selected_only || all_required || syscall_number < 0)
+		return true;
+
+	if (syscall_number < SYSCALL_FILTER_SIZE &&
+	    (required_syscalls[syscall_number / 64] &
+	    (UINT64_C(1) << (syscall_number % 64))) != 0)
+		return true;
+
+	return is_syscall_selected(syscall_number);
+}
+
+int
+intercept_set_syscall_filter(const long *syscall_numbers, unsigned count)
+	__attribute__((visibility("default")));
+
+/*
+ * intercept_set_syscall_filter -- replace the set of syscalls forwarded
+ * to the hooks.
+ * This is part of syscall_intercept's public API.
+ */
+int
+intercept_set_syscall_filter(const long *syscall_numbers, unsigned count)
+{
+	uint64_t new_filter[SYSCALL_FILTER_SIZE / 64] = {0, };
+
+	if (syscall_numbers == NULL) {
+		for (size_t i = 0; i < SYSCALL_FILTER_SIZE / 64; ++i)
+			new_filter[i] = UINT64_MAX;
+	} else {
+		for (unsigned i = 0; i < count; ++i) {
+			unsigned long nr = (unsigned long)syscall_numbers[i];
+
+			if (nr >= SYSCALL_FILTER_SIZE)
+				return -1;
+
+			new_filter[nr / 64] |= UINT64_C(1) << (nr % 64);
+		}
+	}
+
+	for (size_t i = 0; i < SYSCALL_FILTER_SIZE / 64; ++i)
+		__atomic_store_n(requested_filter + i, new_filter[i],
+				__ATOMIC_RELAXED);
+
+	update_bitmap();
+
+	return 0;
+}
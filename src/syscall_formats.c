@@ -36,6 +36,7 @@
 #include <fcntl.h>
 #include <sys/syscall.h>
 #include <linux/version.h>
+#include <string.h>
 
 #define SARGS(name, r, ...) [SYS_##name] = {#name, r, {__VA_ARGS__}}
 
@@ -464,3 +465,25 @@ get_syscall_format(const struct syscall_desc *desc)
 
 	return formats + desc->nr;
 }
+
+/*
+ * syscall_number_by_name -- look up a syscall number using the names found
+ * in the formats table, returns -1 if the name is not found. The name
+ * is not required to be zero terminated.
+ */
+long
+syscall_number_by_name(const char *name, size_t length)
+{
+	for (size_t nr = 0; nr < ARRAY_SIZE(formats); ++nr) {
+		const char *candidate = formats[nr].name;
+
+		if (candidate == NULL)
+			continue;
+
+		if (strncmp(candidate, name, length) == 0 &&
+		    candidate[length] == '\0')
+			return (long)nr;
+	}
+
+	return -1;
+}
@@ -89,4 +89,6 @@ struct syscall_format {
 const struct syscall_format *
 get_syscall_format(const struct syscall_desc *desc);
 
+long syscall_number_by_name(const char *name, size_t length);
+
 #endif
@@ -0,0 +1,276 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * workers.c -- running the disassembling at startup on multiple threads.
+ *
+ * The library is initialized before the program's main routine, and
+ * before it is known if the program uses threads at all, so pthreads can
+ * not be used here. The worker threads are started using the clone
+ * syscall directly ( see intercept_spawn_worker in util.S ), they share
+ * the thread local storage of the thread that started them, therefore
+ * the code running on them must not use libc functions that rely on it,
+ * e.g. anything setting errno or allocating memory -- only
+ * syscall_no_intercept is used for syscalls.
+ *
+ * The workers only exist while run_workers, or run_on_new_thread is
+ * executing, they are all joined before these return, thus the rest of the
+ * library never sees them.
+ */
+
+#include <linux/futex.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <syscall.h>
+
+#include "intercept.h"
+#include "intercept_util.h"
+#include "libsyscall_intercept_hook_point.h"
+
+/*
+ * The number of threads used by run_workers ( including the calling
+ * thread ), set from INTERCEPT_WORKERS -- see workers_setup.
+ */
+static unsigned worker_count = 1;
+
+#define MAX_WORKERS 16
+
+/*
+ * The stack of a worker thread. The code running on the workers does not
+ * need much stack, only the pages actually used are backed by memory.
+ */
+#define WORKER_STACK_SIZE (256 * 1024)
+
+int intercept_spawn_worker(unsigned long flags, void *stack_top, int *tid,
+			void (*func)(void *), void *arg);
+
+struct work {
+	void (*func)(void *arg, unsigned index);
+	void *arg;
+	unsigned count;
+	unsigned next;
+};
+
+/*
+ * workers_setup -- sets the number of threads to use, either from the
+ * value of the INTERCEPT_WORKERS environment variable, or the number of
+ * CPUs the process can run on. With a single worker, everything is
+ * executed on the calling thread.
+ */
+void
+workers_setup(const char *count)
+{
+	if (count != NULL) {
+		long n = atol(count);
+
+		if (n < 1)
+			n = 1;
+		if (n > MAX_WORKERS)
+			n = MAX_WORKERS;
+
+		worker_count = (unsigned)n;
+		return;
+	}
+
+	unsigned long mask[1024 / (8 * sizeof(unsigned long))] = {0, };
+
+	long size = syscall_no_intercept(SYS_sched_getaffinity, 0,
+				sizeof(mask), mask);
+
+	if (syscall_error_code(size) != 0)
+		return;
+
+	unsigned cpus = 0;
+	for (size_t i = 0; i < (size_t)size / sizeof(mask[0]); ++i)
+		cpus += (unsigned)__builtin_popcountl(mask[i]);
+
+	if (cpus > MAX_WORKERS)
+		cpus = MAX_WORKERS;
+
+	if (cpus > 0)
+		worker_count = cpus;
+}
+
+/*
+ * work_loop -- takes the next item not taken by any other thread yet,
+ * until there are none left.
+ */
+static void
+work_loop(void *arg)
+{
+	struct work *work = arg;
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&work->next, 1, __ATOMIC_RELAXED)) <
+	    work->count)
+		work->func(work->arg, i);
+}
+
+/*
+ * spawn_worker -- starts a new thread calling func(arg), with all signals
+ * blocked on it. Returns false if the thread could not be started.
+ */
+static bool
+spawn_worker(void (*func)(void *), void *arg, int *tid,
+		unsigned char **stack)
+{
+	static const unsigned long flags = CLONE_VM | CLONE_FS |
+		CLONE_FILES | CLONE_SIGHAND | CLONE_THREAD | CLONE_SYSVSEM |
+		CLONE_PARENT_SETTID | CLONE_CHILD_CLEARTID;
+
+	long mem = syscall_no_intercept(SYS_mmap, NULL,
+		WORKER_STACK_SIZE, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANON | MAP_NORESERVE | MAP_STACK,
+		-1, (off_t)0);
+
+	xabort_on_syserror(mem, "worker stack");
+	*stack = (unsigned char *)mem;
+
+	int result = intercept_spawn_worker(flags,
+			*stack + WORKER_STACK_SIZE, tid, func, arg);
+
+	if (syscall_error_code(result) != 0) {
+		xmunmap(*stack, WORKER_STACK_SIZE);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * join_worker -- waits for a thread started by spawn_worker to exit.
+ * The kernel clears the tid, and wakes a waiter, on thread exit.
+ */
+static void
+join_worker(int *tid, unsigned char *stack)
+{
+	int value;
+
+	while ((value = __atomic_load_n(tid, __ATOMIC_ACQUIRE)) != 0)
+		syscall_no_intercept(SYS_futex, tid, FUTEX_WAIT,
+				value, NULL, NULL, 0);
+
+	xmunmap(stack, WORKER_STACK_SIZE);
+}
+
+/*
+ * Signals are blocked on the workers, so signal handlers only
+ * run on the original thread -- the new threads inherit the signal
+ * mask that is in effect while they are started.
+ */
+static uint64_t
+block_signals(void)
+{
+	uint64_t all_signals = UINT64_MAX;
+	uint64_t old_mask;
+
+	syscall_no_intercept(SYS_rt_sigprocmask, SIG_SETMASK,
+			&all_signals, &old_mask, sizeof(old_mask));
+
+	return old_mask;
+}
+
+static void
+restore_signals(uint64_t old_mask)
+{
+	syscall_no_intercept(SYS_rt_sigprocmask, SIG_SETMASK,
+			&old_mask, NULL, sizeof(old_mask));
+}
+
+/*
+ * run_workers -- calls func(arg, i) for each i in [0, count), on up to
+ * worker_count threads in parallel, in no particular order. Returns when
+ * all calls have returned.
+ */
+void
+run_workers(void (*func)(void *arg, unsigned index), void *arg,
+		unsigned count)
+{
+	struct work work = {func, arg, count, 0};
+	unsigned thread_count = worker_count;
+
+	if (thread_count > count)
+		thread_count = count;
+
+	if (thread_count <= 1) {
+		work_loop(&work);
+		return;
+	}
+
+	int tids[MAX_WORKERS] = {0, };
+	unsigned char *stacks[MAX_WORKERS];
+	unsigned started;
+	uint64_t old_mask = block_signals();
+
+	for (started = 0; started < thread_count - 1; ++started) {
+		/* the threads already started do the rest on failure */
+		if (!spawn_worker(work_loop, &work,
+		    tids + started, stacks + started))
+			break;
+	}
+
+	restore_signals(old_mask);
+
+	debug_dump("%u items on %u threads\n", count, started + 1);
+
+	work_loop(&work);
+
+	for (unsigned i = 0; i < started; ++i)
+		join_worker(tids + i, stacks[i]);
+}
+
+/*
+ * run_on_new_thread -- calls func(arg) on a new thread, and waits for it to
+ * return. This is used for running code from intercept_routine, which
+ * could otherwise clobber the registers not saved by intercept_wrapper
+ * ( see select_wrapper_level1 in patcher.c ). The calling thread only
+ * waits, and issues syscalls in the meantime.
+ */
+void
+run_on_new_thread(void (*func)(void *arg), void *arg)
+{
+	int tid = 0;
+	unsigned char *stack;
+	uint64_t old_mask = block_signals();
+	bool started = spawn_worker(func, arg, &tid, &stack);
+
+	restore_signals(old_mask);
+
+	if (!started)
+		xabort("unable to start thread");
+
+	join_worker(&tid, stack);
+}
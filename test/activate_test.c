@@ -0,0 +1,224 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program deactivates, and activates the patches while another thread
+ * keeps issuing syscalls, and checks if getpid syscalls reach the hook
+ * function at each step. With the "lazy" argument, it expects nothing
+ * to be patched until a hook function is registered -- see the
+ * INTERCEPT_LAZY environment variable. Meanwhile, another thread is
+ * blocked in a read syscall, which must return normally after libc is
+ * patched -- the same is checked while activating the patches again.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <syscall.h>
+#include <unistd.h>
+
+#include "libsyscall_intercept_hook_point.h"
+
+#define HOOKED_PID 1234
+#define TOGGLE_COUNT 100
+
+static int
+hook(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	if (syscall_number == SYS_getpid) {
+		*result = HOOKED_PID;
+		return 0;
+	}
+
+	return 1;
+}
+
+static void
+report(const char *step)
+{
+	if (getpid() == HOOKED_PID)
+		printf("%s: hooked\n", step);
+	else
+		printf("%s: not hooked\n", step);
+}
+
+static int done;
+
+static void *
+issue_syscalls(void *arg)
+{
+	(void) arg;
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		pid_t pid = getpid();
+
+		if (pid != HOOKED_PID && pid != (pid_t)syscall_no_intercept(
+		    SYS_getpid)) {
+			puts("unexpected getpid result");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	return NULL;
+}
+
+static int pipe_fds[2];
+static pid_t reader_tid;
+
+static void *
+blocked_read(void *arg)
+{
+	char c;
+
+	(void) arg;
+
+	__atomic_store_n(&reader_tid, (pid_t)syscall(SYS_gettid),
+	    __ATOMIC_RELEASE);
+
+	if (read(pipe_fds[0], &c, 1) != 1 || c != 'x') {
+		puts("unexpected read result");
+		exit(EXIT_FAILURE);
+	}
+
+	return NULL;
+}
+
+/*
+ * is_blocked_in_read -- is the thread in the read syscall, according to
+ * /proc/self/task/<tid>/syscall ?
+ */
+static int
+is_blocked_in_read(pid_t tid)
+{
+	char path[0x100];
+	long nr = -1;
+
+	snprintf(path, sizeof(path), "/proc/self/task/%d/syscall", (int)tid);
+
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+
+	if (fscanf(f, "%ld", &nr) != 1)
+		nr = -1;
+
+	fclose(f);
+
+	return nr == SYS_read;
+}
+
+static void
+start_blocked_reader(pthread_t *thread)
+{
+	pid_t tid;
+
+	if (pipe(pipe_fds) != 0 ||
+	    pthread_create(thread, NULL, blocked_read, NULL) != 0) {
+		puts("starting reader failed");
+		exit(EXIT_FAILURE);
+	}
+
+	while ((tid = __atomic_load_n(&reader_tid, __ATOMIC_ACQUIRE)) == 0 ||
+	    !is_blocked_in_read(tid))
+		usleep(1000);
+}
+
+static void
+finish_blocked_reader(pthread_t thread)
+{
+	if (write(pipe_fds[1], "x", 1) != 1) {
+		puts("write failed");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_join(thread, NULL);
+	close(pipe_fds[0]);
+	close(pipe_fds[1]);
+	reader_tid = 0;
+
+	puts("blocked read: ok");
+}
+
+int
+main(int argc, char **argv)
+{
+	pthread_t thread;
+
+	intercept_hook_point = hook;
+
+	if (argc > 1 && strcmp(argv[1], "lazy") == 0) {
+		report("lazy");
+		start_blocked_reader(&thread);
+		intercept_register_hook(SYS_getpid, hook, 0);
+		finish_blocked_reader(thread);
+		report("registered");
+	} else {
+		report("startup");
+	}
+
+	if (pthread_create(&thread, NULL, issue_syscalls, NULL) != 0) {
+		puts("pthread_create failed");
+		return EXIT_FAILURE;
+	}
+
+	for (unsigned i = 0; i < TOGGLE_COUNT; ++i) {
+		if (intercept_deactivate() != 0 || intercept_activate() != 0) {
+			puts("toggling failed");
+			return EXIT_FAILURE;
+		}
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+	pthread_join(thread, NULL);
+
+	intercept_deactivate();
+	report("deactivated");
+	start_blocked_reader(&thread);
+	intercept_activate();
+	finish_blocked_reader(thread);
+	report("activated");
+
+	return EXIT_SUCCESS;
+}
@@ -200,6 +200,7 @@ main(int argc, char **argv)
 	 * file.
 	 */
 	struct intercept_desc patches;
+	memset(&patches, 0, sizeof(patches));
 	init_patcher();
 
 	/*
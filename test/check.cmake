@@ -55,7 +55,77 @@ else()
 	unset(ENV{INTERCEPT_ALL_OBJS})
 endif()
 
-execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS} RESULT_VARIABLE HAD_ERROR)
+if(SYSCALL_FILTER)
+	set(ENV{INTERCEPT_SYSCALL_FILTER} ${SYSCALL_FILTER})
+else()
+	unset(ENV{INTERCEPT_SYSCALL_FILTER})
+endif()
+
+if(COMPACT_WRAPPERS)
+	set(ENV{INTERCEPT_COMPACT_WRAPPERS} 1)
+else()
+	unset(ENV{INTERCEPT_COMPACT_WRAPPERS})
+endif()
+
+if(HUGE_PAGES)
+	set(ENV{INTERCEPT_HUGE_PAGES} 1)
+else()
+	unset(ENV{INTERCEPT_HUGE_PAGES})
+endif()
+
+if(SCAN_WINDOWS)
+	set(ENV{INTERCEPT_SCAN_WINDOWS} 1)
+else()
+	unset(ENV{INTERCEPT_SCAN_WINDOWS})
+endif()
+
+if(WORKERS)
+	set(ENV{INTERCEPT_WORKERS} ${WORKERS})
+else()
+	unset(ENV{INTERCEPT_WORKERS})
+endif()
+
+if(DLOPEN_OBJS)
+	set(ENV{INTERCEPT_DLOPEN_OBJS} 1)
+else()
+	unset(ENV{INTERCEPT_DLOPEN_OBJS})
+endif()
+
+if(LAZY)
+	set(ENV{INTERCEPT_LAZY} 1)
+else()
+	unset(ENV{INTERCEPT_LAZY})
+endif()
+
+if(USER_DISPATCH)
+	set(ENV{INTERCEPT_USER_DISPATCH} 1)
+else()
+	unset(ENV{INTERCEPT_USER_DISPATCH})
+endif()
+
+if(JIT)
+	set(ENV{INTERCEPT_JIT} 1)
+else()
+	unset(ENV{INTERCEPT_JIT})
+endif()
+
+if(DEBUG_DUMP)
+	set(ENV{INTERCEPT_DEBUG_DUMP} 1)
+else()
+	unset(ENV{INTERCEPT_DEBUG_DUMP})
+endif()
+
+if(DEBUG_DUMP)
+	# The debug output is printed before the output of the program, so
+	# a regular expression can match both in this order
+	execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS}
+		RESULT_VARIABLE HAD_ERROR
+		OUTPUT_VARIABLE TEST_OUTPUT ERROR_VARIABLE DEBUG_OUTPUT)
+	message("${DEBUG_OUTPUT}${TEST_OUTPUT}")
+else()
+	execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS}
+		RESULT_VARIABLE HAD_ERROR)
+endif()
 
 unset(ENV{LD_PRELOAD})
 
@@ -0,0 +1,105 @@
+#
+# Copyright 2017, Intel Corporation
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+#
+#     * Redistributions of source code must retain the above copyright
+#       notice, this list of conditions and the following disclaimer.
+#
+#     * Redistributions in binary form must reproduce the above copyright
+#       notice, this list of conditions and the following disclaimer in
+#       the documentation and/or other materials provided with the
+#       distribution.
+#
+#     * Neither the name of the copyright holder nor the names of its
+#       contributors may be used to endorse or promote products derived
+#       from this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+# "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+# LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+# A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+# LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+
+# Runs the test program several times, with an empty plan cache directory. The
+# first run is expected to store the plans of the patched objects, the
+# second one is expected to load them. The syscall filter is only used in
+# the second run, as the stored plans must not depend on it. A third run,
+# using INTERCEPT_SCAN_WINDOWS, is expected to ignore the plans computed
+# by sweeping the whole text section. A fourth run is expected to ignore
+# the plans, after making them writable by the group.
+
+set(CACHE_DIR ${CMAKE_CURRENT_BINARY_DIR}/plan_cache_test)
+file(REMOVE_RECURSE ${CACHE_DIR})
+file(MAKE_DIRECTORY ${CACHE_DIR})
+
+set(ENV{LD_PRELOAD} ${LIB_FILE})
+set(ENV{INTERCEPT_PLAN_CACHE} ${CACHE_DIR})
+unset(ENV{INTERCEPT_DEBUG_DUMP})
+unset(ENV{INTERCEPT_SYSCALL_FILTER})
+
+execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS}
+	RESULT_VARIABLE HAD_ERROR OUTPUT_QUIET)
+
+if(HAD_ERROR)
+	message(FATAL_ERROR "Error: ${HAD_ERROR}")
+endif()
+
+file(GLOB PLANS ${CACHE_DIR}/*)
+if(NOT PLANS)
+	message(FATAL_ERROR "Error: no plan stored in ${CACHE_DIR}")
+endif()
+
+set(ENV{INTERCEPT_DEBUG_DUMP} 1)
+if(SYSCALL_FILTER)
+	set(ENV{INTERCEPT_SYSCALL_FILTER} ${SYSCALL_FILTER})
+endif()
+
+execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS}
+	RESULT_VARIABLE HAD_ERROR ERROR_VARIABLE DEBUG_DUMP)
+
+if(NOT HAD_ERROR)
+	set(ENV{INTERCEPT_SCAN_WINDOWS} 1)
+	execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS}
+		RESULT_VARIABLE HAD_ERROR OUTPUT_QUIET
+		ERROR_VARIABLE SCAN_WINDOWS_DEBUG_DUMP)
+	unset(ENV{INTERCEPT_SCAN_WINDOWS})
+endif()
+
+if(NOT HAD_ERROR)
+	execute_process(COMMAND chmod g+w ${PLANS})
+	execute_process(COMMAND ${TEST_PROG} ${TEST_PROG_ARGS}
+		RESULT_VARIABLE HAD_ERROR OUTPUT_QUIET
+		ERROR_VARIABLE UNTRUSTED_DEBUG_DUMP)
+endif()
+
+unset(ENV{INTERCEPT_DEBUG_DUMP})
+unset(ENV{INTERCEPT_SYSCALL_FILTER})
+unset(ENV{INTERCEPT_PLAN_CACHE})
+unset(ENV{LD_PRELOAD})
+file(REMOVE_RECURSE ${CACHE_DIR})
+
+if(HAD_ERROR)
+	message(FATAL_ERROR "Error: ${HAD_ERROR}")
+endif()
+
+if(NOT DEBUG_DUMP MATCHES "plan of [^\n]*libc[^\n]* loaded from")
+	message(FATAL_ERROR "Error: plan of libc not loaded from ${CACHE_DIR}")
+endif()
+
+if(SCAN_WINDOWS_DEBUG_DUMP MATCHES "plan of [^\n]* loaded from")
+	message(FATAL_ERROR "Error: plan of a full sweep used with scan windows")
+endif()
+
+if(UNTRUSTED_DEBUG_DUMP MATCHES "plan of [^\n]* loaded from")
+	message(FATAL_ERROR "Error: group writable plan loaded from ${CACHE_DIR}")
+endif()
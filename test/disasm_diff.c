@@ -0,0 +1,286 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * disasm_diff.c -- compares the builtin instruction decoder in
+ * src/disasm_builtin.c with the capstone based one in src/disasm_wrapper.c
+ *
+ * The executable sections of each ELF file named on the command line are
+ * decoded instruction by instruction, the same way crawl_text walks a text
+ * section, following the instruction lengths reported by capstone. The
+ * word "libc" as an argument refers to the libc used by this program.
+ *
+ * The builtin decoder is compiled with its public symbols renamed, see
+ * test/CMakeLists.txt.
+ *
+ * The two results must agree on the length of each instruction, on
+ * syscall instructions, and on the destination of jumps. Otherwise, the
+ * builtin decoder must be at least as conservative as capstone:
+ * it can only call an instruction a NOP, or loading a constant
+ * into RAX, if capstone does too -- and it must not miss an instruction
+ * that can not be relocated, e.g. a jump, or one using a RIP relative
+ * operand. Bytes capstone can not decode are skipped.
+ */
+
+#include <elf.h>
+#include <link.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "disasm_wrapper.h"
+
+struct intercept_disasm_context *
+builtin_disasm_init(const unsigned char *begin, const unsigned char *end);
+
+void builtin_disasm_destroy(struct intercept_disasm_context *context);
+
+struct intercept_disasm_result
+builtin_disasm_next_instruction(struct intercept_disasm_context *context,
+					const unsigned char *code);
+
+/* Print at most this many differences */
+#define MAX_REPORTS 32
+
+static unsigned long instruction_count;
+static unsigned long skipped_count;
+static unsigned long difference_count;
+
+static void
+report(const char *path, const unsigned char *section,
+	unsigned long section_offset, const unsigned char *code,
+	const char *what)
+{
+	++difference_count;
+
+	if (difference_count > MAX_REPORTS)
+		return;
+
+	fprintf(stderr, "%s 0x%lx: %s, bytes:", path,
+	    section_offset + (unsigned long)(code - section), what);
+
+	for (int i = 0; i < 8; ++i)
+		fprintf(stderr, " %02x", code[i]);
+
+	fputc('\n', stderr);
+}
+
+/*
+ * compare -- compares the two results of decoding an instruction,
+ * returns a description of the first difference found, or NULL
+ */
+static const char *
+compare(const struct intercept_disasm_result *cs,
+	const struct intercept_disasm_result *bi)
+{
+	if (bi->length != cs->length)
+		return "length";
+
+	if (bi->is_syscall != cs->is_syscall)
+		return "is_syscall";
+
+	if (bi->is_nop && !cs->is_nop)
+		return "is_nop";
+
+	if (cs->is_call && !bi->is_call)
+		return "is_call";
+
+	if (cs->is_jump && !bi->is_jump)
+		return "is_jump";
+
+	if (cs->is_rel_jump && !bi->is_rel_jump)
+		return "is_rel_jump";
+
+	if (cs->is_indirect_jump && !bi->is_indirect_jump)
+		return "is_indirect_jump";
+
+	if (cs->is_ret && !bi->is_ret)
+		return "is_ret";
+
+	if (cs->has_ip_relative_opr && !bi->has_ip_relative_opr)
+		return "has_ip_relative_opr";
+
+	if (cs->has_ip_relative_opr && bi->rip_ref_addr != cs->rip_ref_addr)
+		return "rip_ref_addr";
+
+	if (bi->sets_rax_imm &&
+	    (!cs->sets_rax_imm || bi->rax_imm != cs->rax_imm))
+		return "rax_imm";
+
+	return NULL;
+}
+
+static void
+compare_section(const char *path, const unsigned char *begin,
+		const unsigned char *end, unsigned long section_offset)
+{
+	struct intercept_disasm_context *cs_context =
+	    intercept_disasm_init(begin, end);
+	struct intercept_disasm_context *bi_context =
+	    builtin_disasm_init(begin, end);
+
+	const unsigned char *code = begin;
+
+	while (code <= end) {
+		struct intercept_disasm_result cs =
+		    intercept_disasm_next_instruction(cs_context, code);
+
+		if (cs.length == 0) {
+			++skipped_count;
+			++code;
+			continue;
+		}
+
+		struct intercept_disasm_result bi =
+		    builtin_disasm_next_instruction(bi_context, code);
+
+		const char *difference = compare(&cs, &bi);
+
+		if (difference != NULL)
+			report(path, begin, section_offset, code, difference);
+
+		++instruction_count;
+		code += cs.length;
+	}
+
+	builtin_disasm_destroy(bi_context);
+	intercept_disasm_destroy(cs_context);
+}
+
+static void
+compare_file(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st) != 0) {
+		perror(path);
+		exit(EXIT_FAILURE);
+	}
+
+	const unsigned char *file = mmap(NULL, (size_t)st.st_size,
+	    PROT_READ, MAP_PRIVATE, fd, 0);
+
+	if (file == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	const Elf64_Ehdr *ehdr = (const Elf64_Ehdr *)file;
+
+	if ((size_t)st.st_size < sizeof(*ehdr) ||
+	    memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+	    ehdr->e_shoff + ehdr->e_shnum * sizeof(Elf64_Shdr) >
+	    (size_t)st.st_size) {
+		fprintf(stderr, "%s: invalid ELF file\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	const Elf64_Shdr *shdrs = (const Elf64_Shdr *)(file + ehdr->e_shoff);
+
+	for (Elf64_Half i = 0; i < ehdr->e_shnum; ++i) {
+		const Elf64_Shdr *shdr = shdrs + i;
+
+		if (shdr->sh_type != SHT_PROGBITS ||
+		    (shdr->sh_flags & SHF_EXECINSTR) == 0 ||
+		    shdr->sh_size == 0 ||
+		    shdr->sh_offset + shdr->sh_size > (size_t)st.st_size)
+			continue;
+
+		compare_section(path, file + shdr->sh_offset,
+		    file + shdr->sh_offset + shdr->sh_size - 1,
+		    shdr->sh_offset);
+	}
+
+	munmap((void *)file, (size_t)st.st_size);
+}
+
+static int
+find_libc(struct dl_phdr_info *info, size_t size, void *data)
+{
+	(void) size;
+
+	if (strstr(info->dlpi_name, "/libc.so") == NULL &&
+	    strstr(info->dlpi_name, "/libc-") == NULL)
+		return 0;
+
+	*(const char **)data = info->dlpi_name;
+
+	return 1;
+}
+
+/*
+ * libc_path -- the path of the libc this program uses
+ */
+static const char *
+libc_path(void)
+{
+	const char *path = NULL;
+
+	dl_iterate_phdr(find_libc, &path);
+
+	if (path == NULL) {
+		fputs("libc not found\n", stderr);
+		exit(EXIT_FAILURE);
+	}
+
+	return path;
+}
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s libc|path...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "libc") == 0)
+			compare_file(libc_path());
+		else
+			compare_file(argv[i]);
+	}
+
+	printf("instructions: %lu skipped bytes: %lu differences: %lu\n",
+	    instruction_count, skipped_count, difference_count);
+
+	return difference_count == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * dispatch_sigaction.c -- sets, and queries the handler of SIGSYS using the
+ * rt_sigaction syscall, which is emulated by the library while
+ * INTERCEPT_USER_DISPATCH is set. Invalid arguments must make the syscall
+ * fail the way the kernel would, and the handler set must be called for a
+ * SIGSYS sent by the program.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <syscall.h>
+#include <unistd.h>
+
+struct kernel_sigaction {
+	void (*handler)(int);
+	unsigned long flags;
+	void (*restorer)(void);
+	uint64_t mask;
+};
+
+static volatile sig_atomic_t handled;
+
+static void
+handler(int sig)
+{
+	(void) sig;
+	handled = 1;
+}
+
+static long
+rt_sigaction(long sig, const void *new, void *old, long size)
+{
+	long result = syscall(SYS_rt_sigaction, sig, new, old, size);
+
+	return result == 0 ? 0 : -errno;
+}
+
+int
+main(void)
+{
+	struct kernel_sigaction action;
+	struct kernel_sigaction old;
+	void *invalid = (void *)8;
+
+	memset(&action, 0, sizeof(action));
+	action.handler = handler;
+
+	if (rt_sigaction(SIGSYS, &action, NULL, 4) != -EINVAL)
+		return 1;
+
+	if (rt_sigaction(SIGSYS, invalid, NULL, 8) != -EFAULT)
+		return 1;
+
+	if (rt_sigaction(SIGSYS, NULL, invalid, 8) != -EFAULT)
+		return 1;
+
+	if (rt_sigaction(SIGSYS, &action, NULL, 8) != 0)
+		return 1;
+
+	if (rt_sigaction(SIGSYS, NULL, &old, 8) != 0 ||
+	    old.handler != handler)
+		return 1;
+
+	if (kill(getpid(), SIGSYS) != 0 || !handled)
+		return 1;
+
+	puts("sigaction ok");
+
+	return 0;
+}
@@ -0,0 +1,127 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This library uses exit hooks to alter the results of the getpid and
+ * getppid syscalls, to be used with the program built from syscall_filter.c
+ * -- which expects getpid to return 1234, and getppid to return 4321
+ * when hooked.
+ *
+ * The getpid syscall is selected by the syscall filter, and is altered by
+ * intercept_hook_point_exit. The getppid syscall is altered by two registered
+ * exit hooks, which check they are called in the order of their priorities.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "libsyscall_intercept_hook_point.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <syscall.h>
+
+static void
+exit_hook(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	assert(syscall_number != SYS_getppid);
+
+	if (syscall_number == SYS_getpid) {
+		assert(*result == syscall_no_intercept(SYS_getpid));
+		*result = 1234;
+	}
+}
+
+static void
+getppid_exit_hook_first(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	assert(syscall_number == SYS_getppid);
+	assert(*result == syscall_no_intercept(SYS_getppid));
+	*result = 4000;
+}
+
+static void
+getppid_exit_hook_second(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	assert(syscall_number == SYS_getppid);
+	assert(*result == 4000);
+	*result += 321;
+}
+
+static __attribute__((constructor)) void
+init(void)
+{
+	static const long selected[] = {SYS_getpid};
+
+	assert(intercept_set_syscall_filter(selected, 1) == 0);
+
+	assert(intercept_register_exit_hook(SYS_getppid,
+				getppid_exit_hook_second, 1) == 0);
+	assert(intercept_register_exit_hook(SYS_getppid,
+				getppid_exit_hook_first, 2) == 0);
+
+	intercept_hook_point_exit = exit_hook;
+}
@@ -0,0 +1,81 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program checks the register values seen by the hook in the library
+ * built from hook_context_preload.c. The syscall function in libc does not
+ * set up a stack frame of its own, thus at the syscall instruction the stack
+ * pointer points to the return address into call_getppid, and the frame
+ * pointer is that of call_getppid.
+ * The hook returns these values as the results of the getppid and getpid
+ * syscalls.
+ *
+ * This program is compiled with -fno-omit-frame-pointer.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <unistd.h>
+
+static __attribute__((noinline)) void
+call_getppid(uintptr_t *return_address, uintptr_t *frame_address,
+		uintptr_t *own_frame_address)
+{
+	*return_address = (uintptr_t)syscall(SYS_getppid);
+	*frame_address = (uintptr_t)syscall(SYS_getpid);
+	*own_frame_address = (uintptr_t)__builtin_frame_address(0);
+}
+
+int
+main()
+{
+	uintptr_t return_address;
+	uintptr_t frame_address;
+	uintptr_t own_frame_address;
+
+	call_getppid(&return_address, &frame_address, &own_frame_address);
+
+	if (return_address > (uintptr_t)call_getppid &&
+	    return_address < (uintptr_t)call_getppid + 0x100)
+		puts("return address found");
+	else
+		puts("return address not found");
+
+	if (frame_address == own_frame_address)
+		puts("frame pointer found");
+	else
+		puts("frame pointer not found");
+
+	return EXIT_SUCCESS;
+}
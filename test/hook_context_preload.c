@@ -0,0 +1,73 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The hook function in this library uses intercept_hook_point_context, to
+ * find the caller of getppid, and getpid -- see hook_context.c
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "libsyscall_intercept_hook_point.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <syscall.h>
+
+static int
+hook(const struct intercept_context *context, long *result)
+{
+	assert(context->size >= sizeof(*context));
+	assert(context->site != NULL);
+	assert(context->rip != NULL);
+	assert(context->object_path != NULL);
+
+	if (context->syscall.nr == SYS_getppid) {
+		*result = *(const long *)context->rsp;
+		return 0;
+	}
+
+	if (context->syscall.nr == SYS_getpid) {
+		*result = context->rbp;
+		return 0;
+	}
+
+	return 1;
+}
+
+static __attribute__((constructor)) void
+init(void)
+{
+	intercept_hook_point_context = hook;
+}
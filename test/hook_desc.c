@@ -0,0 +1,96 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program issues syscalls modified by the hook in the library built
+ * from hook_desc_preload.c, which uses intercept_hook_point_desc to:
+ *
+ * - redirect opening a non-existent path to /dev/null
+ * - add the O_CLOEXEC flag to the same open syscall
+ * - turn getppid into a getpid syscall
+ * - turn sched_yield into a vfork syscall, which must be executed in the
+ *   original context of the syscall instruction
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <syscall.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+int
+main()
+{
+	int fd = open("/hook_desc_redirected", O_RDONLY);
+
+	if (fd < 0) {
+		puts("open not redirected");
+		return EXIT_SUCCESS;
+	}
+
+	puts("open redirected");
+
+	if (fcntl(fd, F_GETFD) & FD_CLOEXEC)
+		puts("O_CLOEXEC added");
+	else
+		puts("O_CLOEXEC not added");
+
+	close(fd);
+
+	if (getppid() == getpid())
+		puts("getppid replaced");
+	else
+		puts("getppid not replaced");
+
+	fflush(stdout);
+
+	/*
+	 * The child shares the stack with the parent, thus it must not
+	 * call any function -- it exits using a syscall instruction.
+	 */
+	int pid = sched_yield();
+
+	if (pid == 0)
+		__asm__ volatile("syscall" : : "a" (SYS_exit), "D" (0));
+
+	int status;
+
+	if (pid > 0 && waitpid(pid, &status, 0) == pid &&
+	    WIFEXITED(status) && WEXITSTATUS(status) == 0)
+		puts("sched_yield replaced with vfork");
+	else
+		puts("sched_yield not replaced");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,86 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The hook function in this library modifies syscalls issued by the program
+ * built from hook_desc.c, before they are executed.
+ */
+
+#include "libsyscall_intercept_hook_point.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <syscall.h>
+
+static const char redirected_path[] = "/hook_desc_redirected";
+
+static int
+hook(struct intercept_syscall_desc *desc, long *result)
+{
+	(void) result;
+
+	if (desc->nr == SYS_getppid) {
+		desc->nr = SYS_getpid;
+		return INTERCEPT_HOOK_FORWARD_MODIFIED;
+	}
+
+	if (desc->nr == SYS_sched_yield) {
+		desc->nr = SYS_vfork;
+		return INTERCEPT_HOOK_FORWARD_MODIFIED;
+	}
+
+	/* open(path, flags) or openat(dirfd, path, flags) */
+	int path_arg;
+
+	if (desc->nr == SYS_open)
+		path_arg = 0;
+	else if (desc->nr == SYS_openat)
+		path_arg = 1;
+	else
+		return INTERCEPT_HOOK_FORWARD;
+
+	const char *path = (const char *)desc->args[path_arg];
+
+	if (strcmp(path, redirected_path) != 0)
+		return INTERCEPT_HOOK_FORWARD;
+
+	desc->args[path_arg] = (long)"/dev/null";
+	desc->args[path_arg + 1] |= O_CLOEXEC;
+
+	return INTERCEPT_HOOK_FORWARD_MODIFIED;
+}
+
+static __attribute__((constructor)) void
+init(void)
+{
+	intercept_hook_point_desc = hook;
+}
@@ -0,0 +1,188 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This library registers hook functions for individual syscalls, to be used
+ * with the program built from syscall_filter.c -- which expects getpid
+ * to return 1234, and getppid to return 4321 when hooked.
+ *
+ * The getpid syscall is passed through two registered hooks, which check
+ * they are called in the order of their priorities, and is handled by the
+ * legacy intercept_hook_point. The getppid syscall is not selected by the
+ * syscall filter for intercept_hook_point, it only reaches the
+ * registered hook.
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "libsyscall_intercept_hook_point.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <syscall.h>
+
+static int getpid_hook_calls;
+
+static int
+legacy_hook(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	assert(syscall_number != SYS_getppid);
+
+	if (syscall_number == SYS_getpid) {
+		assert(getpid_hook_calls == 2);
+		getpid_hook_calls = 0;
+		*result = 1234;
+		return 0;
+	}
+
+	return 1;
+}
+
+static int
+getpid_hook_first(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+	(void) result;
+
+	assert(syscall_number == SYS_getpid);
+	assert(getpid_hook_calls == 0);
+	++getpid_hook_calls;
+
+	return 1;
+}
+
+static int
+getpid_hook_second(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+	(void) result;
+
+	assert(syscall_number == SYS_getpid);
+	assert(getpid_hook_calls == 1);
+	++getpid_hook_calls;
+
+	return 1;
+}
+
+static int
+getppid_hook(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	assert(syscall_number == SYS_getppid);
+	*result = 4321;
+
+	return 0;
+}
+
+static int
+getppid_hook_removed(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) syscall_number;
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+	(void) result;
+
+	assert(0);
+
+	return 1;
+}
+
+static __attribute__((constructor)) void
+init(void)
+{
+	static const long selected[] = {SYS_getpid};
+
+	assert(intercept_set_syscall_filter(selected, 1) == 0);
+
+	assert(intercept_register_hook(100000, getppid_hook, 0) != 0);
+	assert(intercept_register_hook(SYS_getppid, NULL, 0) != 0);
+	assert(intercept_unregister_hook(SYS_getppid, getppid_hook) != 0);
+
+	assert(intercept_register_hook(SYS_getpid, getpid_hook_second, 1) == 0);
+	assert(intercept_register_hook(SYS_getpid, getpid_hook_first, 2) == 0);
+	assert(intercept_register_hook(SYS_getppid, getppid_hook, 0) == 0);
+	assert(intercept_register_hook(SYS_getppid,
+				getppid_hook_removed, 10) == 0);
+	assert(intercept_unregister_hook(SYS_getppid,
+				getppid_hook_removed) == 0);
+
+	intercept_hook_point = legacy_hook;
+}
@@ -0,0 +1,90 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+/*
+ * jit_test.c -- copies some code into anonymous memory, the way a JIT
+ * compiler would, makes it executable, and prints the first argument
+ * using it. The code issues the write syscall on its own. The instructions
+ * around a syscall instruction are not overwritten in such code, so the
+ * first syscall instruction can only be patched using the NOP padding
+ * following it as a trampoline -- the second one has no NOP left to use.
+ */
+
+#include <string.h>
+#include <sys/mman.h>
+
+static const unsigned char code[] = {
+	/* write_patchable: */
+	0xb8, 0x01, 0x00, 0x00, 0x00,	/* mov eax, 1 -- SYS_write */
+	0x0f, 0x05,			/* syscall */
+	0x48, 0x89, 0xc2,		/* mov rdx, rax */
+	0xc3,				/* ret */
+	0x0f, 0x1f, 0x80, 0x00, 0x00, 0x00, 0x00, /* nop DWORD PTR [rax] */
+	0xcc, 0xcc, 0xcc, 0xcc, 0xcc, 0xcc,
+	/* write_unpatchable: */
+	0xb8, 0x01, 0x00, 0x00, 0x00,	/* mov eax, 1 */
+	0x0f, 0x05,			/* syscall */
+	0xc3,				/* ret */
+};
+
+#define WRITE_UNPATCHABLE 0x18
+
+int
+main(int argc, char **argv)
+{
+	if (argc < 2)
+		return 1;
+
+	size_t size = 0x1000;
+	unsigned char *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		return 1;
+
+	memset(mem, 0xcc, size);
+	memcpy(mem, code, sizeof(code));
+
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0)
+		return 1;
+
+	long (*write_patchable)(int, const char *, size_t);
+	long (*write_unpatchable)(int, const char *, size_t);
+
+	*(void **)(&write_patchable) = mem;
+	*(void **)(&write_unpatchable) = mem + WRITE_UNPATCHABLE;
+
+	write_patchable(1, argv[1], strlen(argv[1]));
+	write_unpatchable(1, "\n", 1);
+
+	return 0;
+}
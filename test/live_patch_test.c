@@ -0,0 +1,194 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program tests live_patch, by repeatedly overwriting instructions
+ * some other threads are executing in a loop. The code being patched
+ * consists of two jump instructions, each one either jumps to a routine
+ * returning 1, or one returning 2. The threads calling these check the
+ * values returned, a thread executing a partially written instruction
+ * would most likely crash, or return something else.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "intercept.h"
+
+#define THREAD_COUNT 4
+#define ROUND_COUNT 500
+#define ENTRY_COUNT 2
+
+#define JMP_OPCODE 0xe9
+#define JMP_SIZE 5
+
+static unsigned char *code;
+
+static unsigned char *
+entry(unsigned i)
+{
+	return code + 8 * i;
+}
+
+static unsigned char *
+routine(int value)
+{
+	return code + 16 * (unsigned)(value + 1);
+}
+
+static unsigned started;
+static int done;
+static int failed;
+
+static void
+write_jump(unsigned char *dst, unsigned char *from, unsigned char *to)
+{
+	int32_t delta = (int32_t)(to - (from + JMP_SIZE));
+
+	dst[0] = JMP_OPCODE;
+	memcpy(dst + 1, &delta, sizeof(delta));
+}
+
+/*
+ * create_code -- each entry initially jumps to the routine returning 1.
+ * The routines are: mov $value, %eax; ret
+ */
+static void
+create_code(void)
+{
+	code = mmap(NULL, 0x1000, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANON, -1, 0);
+
+	if (code == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+
+	for (int value = 1; value <= 2; ++value) {
+		static const unsigned char mov_ret[] = {
+			0xb8, 0x00, 0x00, 0x00, 0x00, 0xc3};
+
+		memcpy(routine(value), mov_ret, sizeof(mov_ret));
+		routine(value)[1] = (unsigned char)value;
+	}
+
+	for (unsigned i = 0; i < ENTRY_COUNT; ++i)
+		write_jump(entry(i), entry(i), routine(1));
+}
+
+static void *
+call_entries(void *arg)
+{
+	(void) arg;
+
+	__atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+
+	while (!__atomic_load_n(&done, __ATOMIC_ACQUIRE)) {
+		for (unsigned i = 0; i < ENTRY_COUNT; ++i) {
+			int (*func)(void);
+			*(void **)(&func) = entry(i);
+
+			int value = func();
+			if (value != 1 && value != 2)
+				__atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+int
+main(void)
+{
+	pthread_t threads[THREAD_COUNT];
+
+	create_code();
+
+	for (unsigned i = 0; i < THREAD_COUNT; ++i) {
+		if (pthread_create(threads + i, NULL, call_entries, NULL)) {
+			fputs("pthread_create failed\n", stderr);
+			return EXIT_FAILURE;
+		}
+	}
+
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < THREAD_COUNT)
+		sched_yield();
+
+	for (unsigned round = 0; round < ROUND_COUNT; ++round) {
+		struct code_write writes[ENTRY_COUNT];
+		unsigned char code[ENTRY_COUNT][JMP_SIZE];
+		int value = (round % 2 == 0) ? 2 : 1;
+
+		for (unsigned i = 0; i < ENTRY_COUNT; ++i) {
+			writes[i].address = entry(i);
+			writes[i].redirect = routine(value);
+			writes[i].length = JMP_SIZE;
+			writes[i].code = code[i];
+			write_jump(code[i], entry(i), routine(value));
+		}
+
+		live_patch(writes, ENTRY_COUNT);
+
+		/* let the other threads run on a single CPU as well */
+		sched_yield();
+	}
+
+	__atomic_store_n(&done, 1, __ATOMIC_RELEASE);
+
+	for (unsigned i = 0; i < THREAD_COUNT; ++i)
+		pthread_join(threads[i], NULL);
+
+	if (failed) {
+		fputs("unexpected value returned\n", stderr);
+		return EXIT_FAILURE;
+	}
+
+	puts("live_patch_done");
+
+	return EXIT_SUCCESS;
+}
+
+/*
+ * syscall_hook_in_process_allowed - this symbol must be provided to
+ * be able to link with syscall_intercept's objects, see asm_pattern.c
+ * Returning zero here also means nothing else is patched in this process.
+ */
+int
+syscall_hook_in_process_allowed(void)
+{
+	return 0;
+}
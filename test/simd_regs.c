@@ -0,0 +1,129 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program checks whether the SIMD registers are preserved across
+ * a hooked syscall. The hook function in the library built from
+ * simd_regs_preload.c overwrites XMM15, and if the CPU supports AVX-512,
+ * ZMM31 and the K1 opmask register as well. These are loaded with known
+ * values before calling getppid, and checked after it returns.
+ *
+ * The getppid function in libc does not use any of these registers, so
+ * any change seen must be due to the hook not being undone by the
+ * intercepting code.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static pid_t (*volatile getppid_ptr)(void) = getppid;
+
+/*
+ * The stack pointer is realigned around the call, and the red zone is
+ * skipped, as the compiler does not expect a call from the inline asm.
+ */
+static void
+getppid_xmm15(const uint64_t in[2], uint64_t out[2])
+{
+	__asm__ volatile(
+		"movdqu     (%[in]), %%xmm15\n\t"
+		"movq       %%rsp, %%r12\n\t"
+		"subq       $128, %%rsp\n\t"
+		"andq       $-16, %%rsp\n\t"
+		"call       *%[fn]\n\t"
+		"movq       %%r12, %%rsp\n\t"
+		"movdqu     %%xmm15, (%[out])\n\t"
+		:
+		: [in] "r" (in), [out] "r" (out), [fn] "r" (getppid_ptr)
+		: "memory", "cc", "rax", "rcx", "rdx", "rsi", "rdi",
+		"r8", "r9", "r10", "r11", "r12", "xmm15");
+}
+
+/*
+ * This program is not compiled with -mavx512f, thus the compiler does not
+ * use ZMM31 and K1 in any way, they are not listed as clobbered.
+ */
+static void
+getppid_zmm31_k1(const uint64_t in[9], uint64_t out[9])
+{
+	__asm__ volatile(
+		"vmovdqu64  (%[in]), %%zmm31\n\t"
+		"kmovw      64(%[in]), %%k1\n\t"
+		"movq       %%rsp, %%r12\n\t"
+		"subq       $128, %%rsp\n\t"
+		"andq       $-16, %%rsp\n\t"
+		"call       *%[fn]\n\t"
+		"movq       %%r12, %%rsp\n\t"
+		"vmovdqu64  %%zmm31, (%[out])\n\t"
+		"kmovw      %%k1, 64(%[out])\n\t"
+		"vzeroupper\n\t"
+		:
+		: [in] "r" (in), [out] "r" (out), [fn] "r" (getppid_ptr)
+		: "memory", "cc", "rax", "rcx", "rdx", "rsi", "rdi",
+		"r8", "r9", "r10", "r11", "r12");
+}
+
+int
+main()
+{
+	uint64_t in[9];
+	uint64_t out[9];
+
+	for (unsigned i = 0; i < 9; ++i)
+		in[i] = 0x0102030405060708ull * (i + 1);
+
+	memset(out, 0, sizeof(out));
+	getppid_xmm15(in, out);
+	if (memcmp(in, out, 2 * sizeof(in[0])) == 0)
+		puts("xmm15 preserved");
+	else
+		puts("xmm15 clobbered");
+
+	__builtin_cpu_init();
+	if (!__builtin_cpu_supports("avx512f")) {
+		puts("no AVX-512");
+		return EXIT_SUCCESS;
+	}
+
+	memset(out, 0, sizeof(out));
+	in[8] &= 0xffff;
+	getppid_zmm31_k1(in, out);
+	if (memcmp(in, out, sizeof(in)) == 0)
+		puts("zmm31 and k1 preserved");
+	else
+		puts("zmm31 or k1 clobbered");
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * This program issues getpid and getppid syscalls, both of them hooked by
+ * the library built with syscall_filter_preload.c. Each syscall is issued
+ * twice: once via the syscall(2) function, which contains a syscall
+ * instruction used for any syscall, and once via the libc functions
+ * dedicated to these syscalls.
+ * Which of these syscalls reach the hook function depends on the syscall
+ * filter set in the library, and on the INTERCEPT_SYSCALL_FILTER environment
+ * variable ( see the syscall_filter tests in CMakeLists.txt ).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syscall.h>
+#include <unistd.h>
+
+static void
+report(const char *name, long result, long hooked_result)
+{
+	if (result == hooked_result)
+		printf("%s hooked\n", name);
+	else
+		printf("%s not hooked\n", name);
+}
+
+int
+main()
+{
+	report("syscall(SYS_getpid)", syscall(SYS_getpid), 1234);
+	report("syscall(SYS_getppid)", syscall(SYS_getppid), 4321);
+	report("getpid()", getpid(), 1234);
+	report("getppid()", getppid(), 4321);
+
+	return EXIT_SUCCESS;
+}
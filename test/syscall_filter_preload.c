@@ -0,0 +1,103 @@
+/*
+ * Copyright 2017, Intel Corporation
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in
+ *       the documentation and/or other materials provided with the
+ *       distribution.
+ *
+ *     * Neither the name of the copyright holder nor the names of its
+ *       contributors may be used to endorse or promote products derived
+ *       from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * The hook function in this library would alter the results of both the
+ * getpid and the getppid syscalls, but only getpid is selected using
+ * intercept_set_syscall_filter, thus getppid must never reach the hook.
+ *
+ * When built with SELECT_ALL defined, every syscall is selected, which
+ * is meant to be used with the INTERCEPT_SYSCALL_FILTER environment variable.
+ * In that case, only the syscall instructions which were patched are
+ * able to reach the hook.
+ *
+ * When built with GENERAL_REGS_ONLY defined, the library declares that
+ * it does not use SIMD registers ( see intercept_hook_general_regs_only ).
+ */
+
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "libsyscall_intercept_hook_point.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <syscall.h>
+
+#ifdef GENERAL_REGS_ONLY
+const int intercept_hook_general_regs_only = 1;
+#endif
+
+static int
+hook(long syscall_number,
+	long arg0, long arg1,
+	long arg2, long arg3,
+	long arg4, long arg5,
+	long *result)
+{
+	(void) arg0;
+	(void) arg1;
+	(void) arg2;
+	(void) arg3;
+	(void) arg4;
+	(void) arg5;
+
+	if (syscall_number == SYS_getpid) {
+		*result = 1234;
+		return 0;
+	}
+
+	if (syscall_number == SYS_getppid) {
+		*result = 4321;
+		return 0;
+	}
+
+	return 1;
+}
+
+static __attribute__((constructor)) void
+init(void)
+{
+#ifdef SELECT_ALL
+	assert(intercept_set_syscall_filter(NULL, 0) == 0);
+#else
+	static const long invalid[] = {SYS_getppid, 100000};
+	static const long selected[] = {SYS_getpid};
+
+	/* an out of range number must be rejected, without side effects */
+	assert(intercept_set_syscall_filter(invalid, 2) != 0);
+	assert(intercept_set_syscall_filter(selected, 1) == 0);
+#endif
+
+	intercept_hook_point = hook;
+}
@@ -48,6 +48,10 @@
 #include <syscall.h>
 #include <stdio.h>
 
+#ifndef SYS_clone3
+#define SYS_clone3 435
+#endif
+
 static long flags = -1;
 
 static int
@@ -74,14 +78,16 @@ hook(long syscall_number,
 	 *
 	 * So, such a clone syscall can be observed with a hook function
 	 * before the syscall, and in the child process, after the syscall.
+	 * The return value (the child's pid) can be observed using
+	 * intercept_hook_point_exit.
 	 *
-	 * At the moment, libsyscall_intercept does not provide a way to
-	 * execute a hook function after the syscall in the parent process,
-	 * therefore the return value (the child's pid) can not be observed,
-	 * or modified.
+	 * Newer versions of libc create threads using clone3, which receives
+	 * its arguments in a struct, the first field of which is the flags.
 	 */
 	if (syscall_number == SYS_clone && (arg1 != 0))
 		flags = arg0;
+	else if (syscall_number == SYS_clone3)
+		flags = *(const long *)arg0;
 
 	return 1;
 }